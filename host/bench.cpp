@@ -0,0 +1,278 @@
+// Load benchmark for esp_httpd on the host. Runs the example program in src/ over the simulated
+// network with a number of clients, each making requests one after another, and reports requests
+// per second, latency percentiles and the server's peak heap.
+//
+//   build/bench [-v] [-n requests] [-c clients] [-1] [-C cache_budget] [-u request ...] [sim options]
+//
+// The requests are taken in turn from the list given with -u, "METHOD /uri" with an optional body
+// after another space, or by default a mix of the example's routes. Clients keep their connection
+// open for the next request, or with -1 make HTTP/1.0 requests and connect for each one.
+// With more clients than the server has slots for, a connection the simulated SDK refuses is tried
+// again a millisecond later, and counted.
+//
+// Latency and requests per second are in virtual time, so they depend only on the server and the
+// simulated network and come out the same on every run. Latency runs from the request being sent
+// to the server sending the last of the response, so it includes half a round trip. Host time
+// measures how much work the server, and the simulation, did.
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "host_sim.h"
+#include "esp_httpd_test.h"
+
+// Give up on a response that hasn't finished after this long.
+#define BENCH_TIMEOUT_MS 10000
+
+struct BenchRequest {
+  std::string name;  // As given, for the report.
+  std::string text;  // The request as sent.
+  std::vector<uint32_t> latencies;
+  uint16_t status;   // Of the last response.
+  uint32_t errors;
+};
+
+struct BenchClient {
+  SimConn conn;      // -1 when not connected.
+  bool waiting;
+  bool closing;      // Waiting for the connection to close before making another.
+  size_t request;    // Index of the request being waited for.
+  uint32_t msSent;
+};
+
+const char* const bench_defaultRequests[] = {
+  "GET /static",
+  "GET /test?a=1&b=two",
+  "POST /test a=1&b=two",
+  "POST /count one\ntwo\nthree\n",
+  "GET /readings",
+  "GET /menu.htm",
+  "GET /stop.png",
+  "GET /",
+  "GET /dir.json",
+  "GET /metrics",
+  "GET /nothere",
+};
+
+std::vector<BenchRequest> bench_requests;
+uint32_t bench_cacheBudget;
+bool bench_http10;
+
+void bench_setup() {
+  setup();
+  if(bench_cacheBudget) httpd_cacheInit(bench_cacheBudget);
+}
+
+void bench_addRequest(const char* spec) {
+  BenchRequest r;
+  r.name = spec;
+  std::string s = spec;
+  size_t uriAt = s.find(' ');
+  size_t bodyAt = uriAt == std::string::npos ? std::string::npos : s.find(' ', uriAt + 1);
+  std::string body = bodyAt == std::string::npos ? "" : s.substr(bodyAt + 1);
+  r.text = s.substr(0, bodyAt) + (bench_http10 ? " HTTP/1.0\r\n" : " HTTP/1.1\r\n") + "Host: esp\r\n";
+  if(!body.empty() || s.compare(0, 4, "POST") == 0) {
+    r.text += "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: " + std::to_string(body.size()) + "\r\n";
+  }
+  r.text += "\r\n" + body;
+  r.status = 0;
+  r.errors = 0;
+  bench_requests.push_back(r);
+  size_t p;
+  while((p = bench_requests.back().name.find('\n')) != std::string::npos) bench_requests.back().name.replace(p, 1, "\\n");
+}
+
+// Finds the end of the response at the start of s. Returns false if it hasn't all arrived. A
+// response without a length ends when the connection closes.
+bool bench_responseEnd(const std::string &s, bool closed, size_t &end, uint16_t &status, bool &close) {
+  size_t headEnd = s.find("\r\n\r\n");
+  if(headEnd == std::string::npos) return false;
+  status = atoi(s.c_str() + 9);
+  long length = -1;
+  bool chunked = false;
+  close = false;
+  for(size_t p = s.find("\r\n") + 2; p < headEnd; p = s.find("\r\n", p) + 2) {
+    const char* line = s.c_str() + p;
+    if(strncasecmp(line, "Content-Length:", 15) == 0) length = atol(line + 15);
+    else if(strncasecmp(line, "Transfer-Encoding: chunked", 26) == 0) chunked = true;
+    else if(strncasecmp(line, "Connection: close", 17) == 0) close = true;
+  }
+  end = headEnd + 4;
+  if(status < 200 || status == 204 || status == 304) return true;
+  if(chunked) {
+    while(true) {
+      size_t lineEnd = s.find("\r\n", end);
+      if(lineEnd == std::string::npos) return false;
+      size_t size = strtoul(s.c_str() + end, NULL, 16);
+      end = lineEnd + 2 + size + 2;
+      if(end > s.size()) return false;
+      if(size == 0) return true;
+    }
+  }
+  if(length >= 0) {
+    end += length;
+    return end <= s.size();
+  }
+  end = s.size();
+  return closed;
+}
+
+// v must be sorted.
+uint32_t bench_percentile(const std::vector<uint32_t> &v, uint8_t pct) {
+  return v.empty() ? 0 : v[(v.size() - 1) * pct / 100];
+}
+
+void bench_printRow(const char* name, std::vector<uint32_t> &v, const char* status, uint32_t errors) {
+  std::sort(v.begin(), v.end());
+  printf("%-32.32s %7zu %6s %6u %6u %6u %6u %6u\n", name, v.size(), status,
+    bench_percentile(v, 50), bench_percentile(v, 90), bench_percentile(v, 99),
+    v.empty() ? 0 : v.back(), errors);
+}
+
+int main(int argc, char** argv) {
+  uint32_t total = 2000;
+  uint32_t clientCount = 4;
+  std::vector<const char*> specs;
+  int opt;
+  while((opt = getopt(argc, argv, SIM_OPTIONS "vn:c:1C:u:")) != -1) {
+    if(opt == 'v') simConfig.echoSerial = true;
+    else if(opt == 'n') total = atoi(optarg);
+    else if(opt == 'c') clientCount = atoi(optarg);
+    else if(opt == '1') bench_http10 = true;
+    else if(opt == 'C') bench_cacheBudget = atoi(optarg);
+    else if(opt == 'u') specs.push_back(optarg);
+    else if(!sim_option(opt, optarg)) {
+      fprintf(stderr, "usage: %s [-v] [-n requests] [-c clients] [-1] [-C cache_budget] [-u request ...] " SIM_USAGE "\n", argv[0]);
+      return 2;
+    }
+  }
+  if(specs.empty()) specs.assign(bench_defaultRequests, bench_defaultRequests + sizeof(bench_defaultRequests) / sizeof(bench_defaultRequests[0]));
+  for(size_t i = 0; i < specs.size(); i++) bench_addRequest(specs[i]);
+  if(clientCount < 1) clientCount = 1;
+
+  sim_reset();
+  sim_call(bench_setup);
+  uint32_t heapSetup = sim_heapUsed();
+  sim_heapResetPeak();
+  uint64_t allocsSetup = sim_allocCount();
+
+  std::vector<BenchClient> clients(clientCount);
+  for(size_t i = 0; i < clients.size(); i++) {
+    clients[i].conn = -1;
+    clients[i].waiting = false;
+    clients[i].closing = false;
+  }
+  uint32_t issued = 0;
+  uint32_t done = 0;
+  uint32_t refused = 0;
+  uint16_t port = 1024;
+  uint32_t msStart = sim_now();
+  timespec wallStart;
+  clock_gettime(CLOCK_MONOTONIC, &wallStart);
+
+  while(done < total) {
+    for(size_t i = 0; i < clients.size(); i++) {
+      BenchClient &client = clients[i];
+      if(client.waiting || issued == total) continue;
+      if(client.closing) {
+        if(sim_isOpen(client.conn)) continue;
+        client.closing = false;
+        client.conn = -1;
+      }
+      if(client.conn < 0) {
+        const uint8_t ip[4] = {10, 0, 0, (uint8_t) (2 + i)};
+        client.conn = sim_connect(ip, port++);
+        if(port == 0) port = 1024;
+        // Refused for want of room, so try again a millisecond later.
+        if(!sim_isOpen(client.conn)) {
+          client.conn = -1;
+          refused++;
+          continue;
+        }
+      }
+      client.request = issued++ % bench_requests.size();
+      const std::string &text = bench_requests[client.request].text;
+      sim_write(client.conn, text.data(), text.size());
+      client.msSent = sim_now();
+      client.waiting = true;
+    }
+
+    // Call loop() every millisecond, as the Arduino core would.
+    sim_runUntil(sim_now() + 1);
+    sim_call(loop);
+
+    for(size_t i = 0; i < clients.size(); i++) {
+      BenchClient &client = clients[i];
+      if(!client.waiting) continue;
+      BenchRequest &req = bench_requests[client.request];
+      std::string &received = sim_received(client.conn);
+      bool closed = !sim_isOpen(client.conn);
+      size_t end;
+      uint16_t status;
+      bool close;
+      bool complete = bench_responseEnd(received, closed, end, status, close);
+      // A 100 Continue is followed by the real response.
+      if(complete && status == 100) {
+        received.erase(0, end);
+        continue;
+      }
+      if(complete) {
+        req.latencies.push_back(sim_now() - client.msSent);
+        req.status = status;
+        received.erase(0, end);
+      } else if(closed || sim_now() - client.msSent > BENCH_TIMEOUT_MS) {
+        req.errors++;
+        if(!closed) sim_close(client.conn);
+        close = true;
+      } else {
+        continue;
+      }
+      client.waiting = false;
+      done++;
+      // Like a browser, don't connect again until the server has seen the last connection
+      // close, or it may not have a slot free yet.
+      if(close || closed || bench_http10) {
+        if(!closed && bench_http10) sim_close(client.conn);
+        client.closing = true;
+      }
+    }
+  }
+
+  timespec wallEnd;
+  clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+  double wallS = (wallEnd.tv_sec - wallStart.tv_sec) + (wallEnd.tv_nsec - wallStart.tv_nsec) / 1e9;
+  double virtualS = (sim_now() - msStart) / 1000.0;
+
+  printf("%u requests, %u clients, %s, rtt %u ms, segment %u, send buffer %u, cache %u\n\n",
+    total, clientCount, bench_http10 ? "HTTP/1.0" : "keep-alive", simConfig.rttMs, simConfig.segmentSize,
+    simConfig.sendBufLimit, bench_cacheBudget);
+  printf("%-32s %7s %6s %6s %6s %6s %6s %6s\n", "request", "count", "status", "p50", "p90", "p99", "max", "errors");
+  std::vector<uint32_t> all;
+  uint32_t errors = 0;
+  for(size_t i = 0; i < bench_requests.size(); i++) {
+    BenchRequest &req = bench_requests[i];
+    char status[8];
+    snprintf(status, sizeof(status), "%u", req.status);
+    all.insert(all.end(), req.latencies.begin(), req.latencies.end());
+    errors += req.errors;
+    bench_printRow(req.name.c_str(), req.latencies, status, req.errors);
+  }
+  bench_printRow("all", all, "", errors);
+  printf("\nLatency in virtual ms.\n");
+  printf("virtual time %.3f s, %.1f requests/s\n", virtualS, virtualS > 0 ? done / virtualS : 0);
+  printf("host time %.3f s, %.0f requests/s\n", wallS, wallS > 0 ? done / wallS : 0);
+  // Sanitizer builds leave out the heap accounting, and setup() always allocates.
+  if(heapSetup) {
+    printf("heap %u bytes after setup, peak %u, %.2f allocations per request\n",
+      heapSetup, sim_heapPeak(), (double) (sim_allocCount() - allocsSetup) / done);
+  } else {
+    printf("heap not counted\n");
+  }
+  printf("%u sends, %u refused\n", simStats.sends, simStats.sendFails);
+  printf("%u connections refused\n", refused);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+# Compares two sets of microbenchmark results, as written by build/microbench --benchmark_out, and
+# fails if any benchmark has got slower by more than the threshold or allocates more per call.
+# Of repeated runs the fastest is taken, being the least disturbed by whatever else the machine
+# was doing.
+#
+#   ./compare_bench.py [-t percent] [-r] baseline.json results.json
+#
+# Timings only compare between runs on the same machine, so make a baseline of your own with
+# `make microbench-baseline` before changing anything. -r just reports the differences, as for
+# results from another machine.
+
+import argparse
+import json
+import sys
+
+UNITS = {'ns': 1, 'us': 1e3, 'ms': 1e6, 's': 1e9}
+
+
+def load(path):
+    """Returns {name: (ns per call, allocations per call)}, taking the fastest of repeated runs."""
+    with open(path) as f:
+        runs = json.load(f)['benchmarks']
+    results = {}
+    for r in runs:
+        if r.get('run_type') == 'aggregate':
+            continue
+        name = r.get('run_name', r['name'])
+        ns = r['cpu_time'] * UNITS[r.get('time_unit', 'ns')]
+        if name not in results or ns < results[name][0]:
+            results[name] = (ns, r.get('allocs/op', 0.0))
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-t', '--threshold', type=float, default=10,
+                        help='percentage slowdown counted as a regression (default 10)')
+    parser.add_argument('-r', '--report', action='store_true',
+                        help='report the differences without failing')
+    parser.add_argument('baseline')
+    parser.add_argument('results')
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    results = load(args.results)
+    regressions = 0
+    print('%-32s %10s %10s %8s %11s %11s' % ('benchmark', 'base ns', 'new ns', 'change', 'base allocs', 'new allocs'))
+    for name, (ns, allocs) in results.items():
+        if name not in baseline:
+            print('%-32s %10s %10.1f %8s %11s %11.2f  new' % (name, '-', ns, '', '-', allocs))
+            continue
+        baseNs, baseAllocs = baseline[name]
+        change = (ns - baseNs) / baseNs * 100 if baseNs else 0
+        notes = []
+        if change > args.threshold:
+            notes.append('slower')
+        if allocs > baseAllocs + 0.01:
+            notes.append('more allocations')
+        regressions += bool(notes)
+        print('%-32s %10.1f %10.1f %+7.1f%% %11.2f %11.2f  %s' % (name, baseNs, ns, change, baseAllocs, allocs, ', '.join(notes)))
+    for name in baseline:
+        if name not in results:
+            print('%-32s  missing from the results' % name)
+
+    if regressions and not args.report:
+        print('\n%d regression%s beyond %g%%' % (regressions, '' if regressions == 1 else 's', args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
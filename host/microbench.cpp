@@ -0,0 +1,338 @@
+// Microbenchmarks for the per-request work on the server's hot path: parsing the request header,
+// matching routes, parsing and looking up arguments, tokenizing JSON bodies, looking up MIME types
+// and formatting response headers. Each function is timed on its own, with the inputs a busy
+// device sees: browser headers with long cookies, a table of 50 routes, query strings of 30
+// arguments and a JSON configuration of 1 KB. Besides the time per call, each reports the
+// allocations per call, counted by the simulated heap.
+//
+//   build/microbench [benchmark options]
+//
+// `make microbench` runs it and compares the results with the baseline recorded on this machine by
+// `make microbench-baseline`. See compare_bench.py.
+
+#include <Arduino.h>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+#include "host_sim.h"
+#include <esp_httpd.h>
+
+// Internal to the library, but timed here on their own.
+extern HttpRequest* httpd_requests;
+void httpd_nextRequest(uint8_t r);
+uint httpd_parseHead(HttpRequest &httpd_request, const char* pData, uint len);
+void httpd_matchRoutes(int16_t n, const char* uri, HTTPMethod method, int16_t* matches, uint8_t &matchCount);
+uint httpd_sendHead(HttpRequest &httpd_request, char* buf, uint responseCode, const char* pMime, const char* pData, uint lData);
+
+/********************************************************
+   Inputs
+ ********************************************************/
+
+bool micro_handler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg) {
+  return true;
+}
+
+// Ten resources, each with the five kinds of route a REST-ish device tends to have.
+const char* const micro_resources[] = {
+  "sensors", "relays", "schedules", "users", "logs", "config", "wifi", "firmware", "alarms", "zones"
+};
+std::vector<std::string> micro_uris;
+std::vector<HttpRoute> micro_routes;
+
+void micro_buildRoutes() {
+  const char* const patterns[] = {"/api/%s", "/api/%s/:id", "/api/%s/:id/history", "/%s.htm", "/%s/*"};
+  std::vector<HTTPMethod> methods;
+  for(uint8_t r = 0; r < sizeof(micro_resources) / sizeof(micro_resources[0]); r++) {
+    for(uint8_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+      char uri[64];
+      snprintf(uri, sizeof(uri), patterns[p], micro_resources[r]);
+      micro_uris.push_back(uri);
+      methods.push_back(p == 1 ? HTTP_ANY : p == 0 && r % 2 ? HTTP_POST : HTTP_GET);
+    }
+  }
+  // The strings have all been made, so their c_str()'s stay put.
+  for(size_t i = 0; i < micro_uris.size(); i++) {
+    micro_routes.push_back({methods[i], micro_uris[i].c_str(), micro_handler, NULL, NULL});
+  }
+  micro_routes.push_back({HTTP_NONE, NULL, NULL, NULL, NULL});
+}
+
+std::string micro_cookie(uint len) {
+  std::string cookie;
+  for(uint i = 0; cookie.size() < len; i++) {
+    if(i) cookie += "; ";
+    cookie += "c" + std::to_string(i) + "=";
+    cookie.append(40, 'a' + i % 26);
+  }
+  return cookie.substr(0, len);
+}
+
+// A request head as a desktop browser sends it, with a cookie of the given length.
+std::string micro_head(uint lenCookie) {
+  std::string head =
+    "GET /api/sensors/12/history?from=1700000000&to=1700086400 HTTP/1.1\r\n"
+    "Host: 192.168.4.1\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Referer: http://192.168.4.1/sensors.htm\r\n";
+  if(lenCookie) head += "Cookie: " + micro_cookie(lenCookie) + "\r\n";
+  return head + "\r\n";
+}
+
+// A device configuration as a settings page posts it, of about 1 KB.
+std::string micro_json() {
+  std::string json = "{\"name\":\"greenhouse \\u00e9\",\"wifi\":{\"ssid\":\"garden\",\"dhcp\":true},\"zones\":[";
+  for(uint i = 0; i < 12; i++) {
+    if(i) json += ',';
+    json += "{\"name\":\"zone " + std::to_string(i) + "\",\"pin\":" + std::to_string(i + 4) +
+      ",\"on\":" + (i % 2 ? "true" : "false") + ",\"minutes\":[5,10,15]}";
+  }
+  return json + "],\"version\":3}";
+}
+
+std::string micro_args(uint count) {
+  std::string args;
+  for(uint i = 0; i < count; i++) {
+    if(i) args += '&';
+    args += "field" + std::to_string(i) + "=value" + std::to_string(i * 37);
+  }
+  return args;
+}
+
+/********************************************************
+   Setup
+ ********************************************************/
+
+uint8_t micro_slot;
+
+void micro_init() {
+  httpd_init(micro_routes.data(), 80, 0);
+}
+
+// Starts the server with the route table and connects a client, so there's a slot to work with.
+HttpRequest &micro_setup() {
+  static bool ready;
+  if(!ready) {
+    micro_buildRoutes();
+    sim_reset();
+    sim_call(micro_init);
+    const uint8_t ip[4] = {10, 0, 0, 2};
+    sim_connect(ip, 40000);
+    ready = true;
+  }
+  return httpd_requests[micro_slot];
+}
+
+// Counts what the server allocates between construction and report(), per iteration.
+struct MicroAllocs {
+  uint64_t start;
+  MicroAllocs() : start(sim_allocCount()) { sim_inServer = true; }
+  void report(benchmark::State &state) {
+    sim_inServer = false;
+    state.counters["allocs/op"] = benchmark::Counter((double) (sim_allocCount() - start), benchmark::Counter::kAvgIterations);
+  }
+};
+
+/********************************************************
+   Benchmarks
+ ********************************************************/
+
+// The header, arriving in one segment, as httpd_recv() parses it. The 2000 byte cookie doesn't fit
+// in the header buffer and is dropped as it goes by.
+void BM_ParseHead(benchmark::State &state) {
+  HttpRequest &req = micro_setup();
+  std::string head = micro_head(state.range(0));
+  MicroAllocs allocs;
+  for(auto _ : state) {
+    httpd_nextRequest(micro_slot);
+    benchmark::DoNotOptimize(httpd_parseHead(req, head.data(), head.size()));
+    if(req.parseState != PARSE_BODY) state.SkipWithError("Header not parsed");
+  }
+  allocs.report(state);
+  state.SetBytesProcessed(state.iterations() * head.size());
+}
+BENCHMARK(BM_ParseHead)->Arg(0)->Arg(600)->Arg(2000);
+
+// The same header in 64 byte segments, as it arrives from a slow client.
+void BM_ParseHeadSegmented(benchmark::State &state) {
+  HttpRequest &req = micro_setup();
+  std::string head = micro_head(600);
+  MicroAllocs allocs;
+  for(auto _ : state) {
+    httpd_nextRequest(micro_slot);
+    for(size_t i = 0; i < head.size(); i += 64) {
+      httpd_parseHead(req, head.data() + i, head.size() - i < 64 ? head.size() - i : 64);
+    }
+    if(req.parseState != PARSE_BODY) state.SkipWithError("Header not parsed");
+  }
+  allocs.report(state);
+  state.SetBytesProcessed(state.iterations() * head.size());
+}
+BENCHMARK(BM_ParseHeadSegmented);
+
+// Looking up the routes for a URI in the table of 50: a literal route near the start, a :param
+// route near the end, one matched by a prefix, and one that isn't there.
+const char* const micro_routeUris[] = {"/api/sensors", "/api/zones/7/history", "/alarms/today.csv", "/api/nothing/here"};
+
+void BM_MatchRoutes(benchmark::State &state) {
+  micro_setup();
+  const char* uri = micro_routeUris[state.range(0)];
+  state.SetLabel(uri);
+  MicroAllocs allocs;
+  for(auto _ : state) {
+    int16_t matches[HTTPD_MAX_ROUTE_MATCHES];
+    uint8_t matchCount = 0;
+    httpd_matchRoutes(0, uri, HTTP_GET, matches, matchCount);
+    benchmark::DoNotOptimize(matches);
+    benchmark::DoNotOptimize(matchCount);
+  }
+  allocs.report(state);
+}
+BENCHMARK(BM_MatchRoutes)->DenseRange(0, 3);
+
+// The router as a whole, matching, binding the :params and calling a handler that does nothing.
+void BM_Router(benchmark::State &state) {
+  HttpRequest &req = micro_setup();
+  char uri[64];
+  strcpy(uri, micro_routeUris[state.range(0)]);
+  state.SetLabel(uri);
+  MicroAllocs allocs;
+  for(auto _ : state) {
+    req.uri = uri;
+    req.method = HTTP_GET;
+    httpd_router(req.pEspconn, req);
+    benchmark::DoNotOptimize(req.route);
+  }
+  allocs.report(state);
+}
+BENCHMARK(BM_Router)->DenseRange(0, 2);
+
+// Splitting, decoding and indexing a query string, or a form body, of 30 arguments. Parsing is in
+// place, so each iteration copies the input back first; that's under 10% of the time.
+void BM_ParseParams(benchmark::State &state) {
+  HttpRequest &req = micro_setup();
+  ParamLocation where = state.range(0) ? HTTP_DATA : HTTP_QUERY;
+  std::string args = micro_args(30);
+  std::string uri = "/api/sensors?" + args;
+  const std::string &input = where == HTTP_QUERY ? uri : args;
+  state.SetLabel(where == HTTP_QUERY ? "query" : "body");
+  char* buf = req.head;
+  MicroAllocs allocs;
+  for(auto _ : state) {
+    memcpy(buf, input.c_str(), input.size() + 1);
+    req.arenaUsed = 0;
+    req.argCount = 0;
+    req.argsParsed = 0;
+    req.method = HTTP_GET;
+    req.uri = where == HTTP_QUERY ? buf : (char*) "/api/sensors";
+    req.data = where == HTTP_DATA ? buf : NULL;
+    httpd_parseParams(req, where);
+    if(req.argCount != 30) state.SkipWithError("Arguments not parsed");
+  }
+  allocs.report(state);
+}
+BENCHMARK(BM_ParseParams)->DenseRange(0, 1);
+
+// Looking up an argument among the 30, and one that isn't there.
+const char* const micro_argKeys[] = {"field17", "missing"};
+
+void BM_GetArg(benchmark::State &state) {
+  HttpRequest &req = micro_setup();
+  std::string uri = "/api/sensors?" + micro_args(30);
+  std::vector<char> buf(uri.begin(), uri.end());
+  buf.push_back('\0');
+  req.arenaUsed = 0;
+  req.argCount = 0;
+  req.argsParsed = 0;
+  req.method = HTTP_GET;
+  req.uri = buf.data();
+  req.data = NULL;
+  httpd_parseParams(req);
+  const char* key = micro_argKeys[state.range(0)];
+  state.SetLabel(key);
+  MicroAllocs allocs;
+  for(auto _ : state) {
+    benchmark::DoNotOptimize(httpd_getArg(req, key));
+  }
+  allocs.report(state);
+}
+BENCHMARK(BM_GetArg)->DenseRange(0, 1);
+
+// Tokenizing the configuration where it lies, with the tokens in the arena. As with the arguments,
+// each iteration copies the input back first.
+void BM_ParseJson(benchmark::State &state) {
+  HttpRequest &req = micro_setup();
+  std::string json = micro_json();
+  std::vector<char> buf(json.size() + 1);
+  MicroAllocs allocs;
+  for(auto _ : state) {
+    memcpy(buf.data(), json.c_str(), json.size() + 1);
+    req.arenaUsed = 0;
+    req.data = buf.data();
+    req.lenData = json.size();
+    if(httpd_parseJson(req) <= 0) state.SkipWithError("JSON not parsed");
+  }
+  allocs.report(state);
+  state.SetBytesProcessed(state.iterations() * json.size());
+}
+BENCHMARK(BM_ParseJson);
+
+// Looking up a value near the start of the configuration and one in the last element of an array.
+const char* const micro_jsonPaths[] = {"wifi.dhcp", "zones.11.minutes.2"};
+
+void BM_JsonFind(benchmark::State &state) {
+  HttpRequest &req = micro_setup();
+  std::string json = micro_json();
+  std::vector<char> buf(json.begin(), json.end());
+  buf.push_back('\0');
+  req.arenaUsed = 0;
+  req.data = buf.data();
+  req.lenData = json.size();
+  httpd_parseJson(req);
+  const char* path = micro_jsonPaths[state.range(0)];
+  state.SetLabel(path);
+  MicroAllocs allocs;
+  for(auto _ : state) {
+    int16_t t = httpd_jsonFind(req, 0, path);
+    if(t == NOT_FOUND) state.SkipWithError("Path not found");
+    benchmark::DoNotOptimize(t);
+  }
+  allocs.report(state);
+}
+BENCHMARK(BM_JsonFind)->DenseRange(0, 1);
+
+const char* const micro_filenames[] = {"/index.htm", "/app.js", "/logo.png", "/firmware.bin", "/README"};
+
+void BM_Mimetype(benchmark::State &state) {
+  const char* filename = micro_filenames[state.range(0)];
+  state.SetLabel(filename);
+  MicroAllocs allocs;
+  for(auto _ : state) {
+    benchmark::DoNotOptimize(httpd_mimetype(filename));
+  }
+  allocs.report(state);
+}
+BENCHMARK(BM_Mimetype)->DenseRange(0, 4);
+
+// Formatting the header httpd_send() sends: a 200 with an HTML body, a 404 from the ready-made
+// ones and a 201 without a body, which is formatted in full.
+void BM_SendHead(benchmark::State &state) {
+  HttpRequest &req = micro_setup();
+  uint code = state.range(0);
+  const char* body = code == 200 ? "<html><body><h3>Hello</h3></body></html>" : NULL;
+  char buf[HTTPD_TX_BUFFER_SIZE];
+  state.SetLabel(std::to_string(code));
+  MicroAllocs allocs;
+  for(auto _ : state) {
+    benchmark::DoNotOptimize(httpd_sendHead(req, buf, code, "text/html", body, body ? strlen(body) : 0));
+    benchmark::ClobberMemory();
+  }
+  allocs.report(state);
+}
+BENCHMARK(BM_SendHead)->Arg(200)->Arg(404)->Arg(201);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,117 @@
+// Sends requests to the example program in src/ over the simulated network and prints the
+// responses, each request on a connection of its own. A literal \r\n in a request stands for a
+// CR LF, and @file reads the request from a file.
+//
+//   build/request [-v] [-t] [-C cache_budget] [sim options] 'GET /static HTTP/1.1\r\n\r\n' ...
+//
+// -v prints what the server logs. Files the server writes go to the data directory, so point -d
+// at a copy when uploading. -t sends the requests in request_checks instead, and fails unless each
+// gets the status expected.
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <string>
+
+#include "host_sim.h"
+#include "esp_httpd_test.h"
+
+uint32_t request_cacheBudget;
+
+struct RequestCheck {
+  const char* request;
+  const char* status;
+};
+
+// Requests the parser has got wrong before, with the status line each should get.
+const RequestCheck request_checks[] = {
+  {"POST /static HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc", "HTTP/1.1 200"},
+  // Whitespace may follow the value, but digits can't follow the whitespace.
+  {"POST /static HTTP/1.1\r\nContent-Length: 3 \r\n\r\nabc", "HTTP/1.1 200"},
+  {"POST /static HTTP/1.1\r\nContent-Length: 3\t\r\n\r\nabc", "HTTP/1.1 200"},
+  {"POST /static HTTP/1.1\r\nContent-Length: 3 4\r\n\r\nabc", "HTTP/1.1 400"},
+  {"POST /static HTTP/1.1\r\nContent-Length: \r\n\r\nabc", "HTTP/1.1 400"},
+  {"POST /static HTTP/1.1\r\nContent-Length: 3x\r\n\r\nabc", "HTTP/1.1 400"},
+  // Too big for a uint32_t, which would otherwise wrap to 3.
+  {"POST /static HTTP/1.1\r\nContent-Length: 4294967299\r\n\r\nabc", "HTTP/1.1 413"},
+};
+
+void request_setup() {
+  setup();
+  if(request_cacheBudget) httpd_cacheInit(request_cacheBudget);
+}
+
+bool request_read(const char* arg, std::string &req) {
+  if(arg[0] == '@') {
+    FILE* f = fopen(arg + 1, "rb");
+    if(!f) return false;
+    char buf[4096];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0) req.append(buf, n);
+    fclose(f);
+    return true;
+  }
+  req = arg;
+  for(size_t p; (p = req.find("\\r\\n")) != std::string::npos; ) req.replace(p, 4, "\r\n");
+  return true;
+}
+
+// Sends a request on a connection of its own and returns the response.
+std::string& request_send(uint16_t port, const std::string &req) {
+  const uint8_t ip[4] = {10, 0, 0, 2};
+  SimConn c = sim_connect(ip, port);
+  sim_write(c, req.data(), req.size());
+  // Call loop() every millisecond, as the Arduino core would, until the server has gone quiet.
+  for(uint32_t msEnd = sim_now() + 2000; sim_now() < msEnd; ) {
+    sim_runUntil(sim_now() + 1);
+    sim_call(loop);
+  }
+  sim_close(c);
+  sim_run();
+  return sim_received(c);
+}
+
+int request_check() {
+  int failed = 0;
+  for(uint i = 0; i < sizeof(request_checks) / sizeof(request_checks[0]); i++) {
+    std::string req;
+    request_read(request_checks[i].request, req);
+    std::string &resp = request_send(40000 + i, req);
+    if(resp.compare(0, strlen(request_checks[i].status), request_checks[i].status) != 0) {
+      printf("FAIL check %u: expected %s, got %.12s\n", i + 1, request_checks[i].status, resp.c_str());
+      failed++;
+    }
+  }
+  printf("%d of %d checks failed\n", failed, (int) (sizeof(request_checks) / sizeof(request_checks[0])));
+  return failed ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  bool check = false;
+  while((opt = getopt(argc, argv, SIM_OPTIONS "vtC:")) != -1) {
+    if(opt == 'v') simConfig.echoSerial = true;
+    else if(opt == 't') check = true;
+    else if(opt == 'C') request_cacheBudget = atoi(optarg);
+    else if(!sim_option(opt, optarg)) {
+      fprintf(stderr, "usage: %s [-v] [-t] [-C cache_budget] " SIM_USAGE " request ...\n", argv[0]);
+      return 2;
+    }
+  }
+  sim_reset();
+  sim_call(request_setup);
+  if(check) return request_check();
+
+  for(int i = optind; i < argc; i++) {
+    std::string req;
+    if(!request_read(argv[i], req)) {
+      fprintf(stderr, "can't read %s\n", argv[i] + 1);
+      return 1;
+    }
+    std::string &resp = request_send(40000 + i, req);
+    fwrite(resp.data(), 1, resp.size(), stdout);
+    if(i + 1 < argc) printf("\n");
+  }
+  fprintf(stderr, "%u sends, %u refused, heap %u bytes, peak %u\n",
+    simStats.sends, simStats.sendFails, sim_heapUsed(), sim_heapPeak());
+  return 0;
+}
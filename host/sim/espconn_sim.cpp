@@ -0,0 +1,552 @@
+// Simulated espconn network, os_timer and Arduino timing for host builds.
+//
+// Everything runs on virtual time. Client writes are cut into segments and
+// delivered to the server's recv callback after half a round trip; every
+// successful espconn_send is acknowledged (sent callback) after a full round
+// trip. The server may hold at most simConfig.sendBufLimit unacknowledged
+// bytes, and without ESPCONN_COPY only one send may be outstanding.
+
+#include <Arduino.h>
+#include <unistd.h>
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <algorithm>
+
+extern "C" {
+  #include "user_interface.h"
+  #include "osapi.h"
+  #include "espconn.h"
+}
+
+#include "host_sim.h"
+
+SimConfig simConfig = { 20, 1460, 0, 2920, 81920, false };
+SimStats simStats;
+const char* simDataDir = "../data";
+HardwareSerial Serial;
+EspClass ESP;
+
+namespace {
+
+enum EventType { EV_DELIVER, EV_ACK, EV_WRITE_FINISH, EV_DISCON, EV_CLIENT_CLOSE };
+
+struct Event {
+  uint32_t at;
+  uint64_t seq;
+  EventType type;
+  SimConn conn;
+  std::string data;
+  uint32_t len;
+};
+
+struct Conn {
+  espconn* pEspconn;
+  esp_tcp* pTcp;
+  bool open;          // Server side still sees the connection.
+  bool discon;        // Disconnect callback delivered.
+  bool held;          // espconn_recv_hold() in effect; deliveries wait.
+  uint8_t opts;
+  uint32_t unacked;   // Bytes sent by the server not yet acknowledged.
+  uint32_t pendingSends;
+  uint32_t msActive;
+  uint32_t idleS;     // Set by espconn_regist_time() for this connection alone, or 0.
+  std::string received;
+};
+
+espconn* listener = NULL;
+uint32_t idleTimeoutS = 0;
+uint8_t maxConAllow = 0xFF;
+uint32_t now = 0;
+uint64_t seq = 0;
+std::vector<Event> events;
+std::vector<Conn> conns;
+std::vector<os_timer_t*> timers;
+
+// Frees the connections still open at exit, so the leak checker of a sanitizer build only
+// reports the server's own leaks. Defined after conns, so it's destroyed first.
+struct ConnCleanup {
+  ~ConnCleanup() {
+    for(size_t i = 0; i < conns.size(); i++) {
+      delete conns[i].pTcp;
+      delete conns[i].pEspconn;
+    }
+  }
+} connCleanup;
+
+void push(const Event& e) {
+  events.push_back(e);
+  events.back().seq = seq++;
+}
+
+Conn* findConn(espconn* p) {
+  for(size_t i = 0; i < conns.size(); i++) {
+    if(conns[i].pEspconn == p) return &conns[i];
+  }
+  return NULL;
+}
+
+// Seconds the connection may be idle before it's dropped, or 0 for never.
+uint32_t idleTimeout(const Conn& c) {
+  return c.idleS ? c.idleS : idleTimeoutS;
+}
+
+void scheduleDiscon(SimConn c) {
+  Event e;
+  e.at = now;
+  e.type = EV_DISCON;
+  e.conn = c;
+  e.len = 0;
+  push(e);
+}
+
+// Finds the next thing to happen: a queued event, a timer or an idle timeout.
+// Returns false if nothing is pending.
+bool nextTime(uint32_t& at) {
+  bool found = false;
+  at = 0;
+  for(size_t i = 0; i < events.size(); i++) {
+    if(events[i].type == EV_DELIVER && conns[events[i].conn].held) continue;
+    if(!found || events[i].at < at) at = events[i].at;
+    found = true;
+  }
+  for(size_t i = 0; i < timers.size(); i++) {
+    if(!found || timers[i]->timer_expire < at) at = timers[i]->timer_expire;
+    found = true;
+  }
+  for(size_t i = 0; i < conns.size(); i++) {
+    if(!conns[i].open || !idleTimeout(conns[i])) continue;
+    uint32_t t = conns[i].msActive + idleTimeout(conns[i]) * 1000;
+    if(!found || t < at) at = t;
+    found = true;
+  }
+  return found;
+}
+
+// Runs a callback into the server.
+void callServer(void (*fn)(void*), void* arg) {
+  sim_inServer = true;
+  fn(arg);
+  sim_inServer = false;
+}
+
+void fire(Event e) {
+  Conn& c = conns[e.conn];
+  switch(e.type) {
+  case EV_DELIVER:
+    if(c.open && c.pEspconn->recv_callback) {
+      // Copy into a buffer that is deliberately not NUL-terminated, so reading past the end of
+      // a segment shows up.
+      char* seg = (char*) malloc(e.data.size() + 8);
+      memcpy(seg, e.data.data(), e.data.size());
+      memset(seg + e.data.size(), 'X', 8);
+      simStats.bytesToServer += e.data.size();
+      c.msActive = now;
+      sim_inServer = true;
+      c.pEspconn->recv_callback(c.pEspconn, seg, (unsigned short) e.data.size());
+      sim_inServer = false;
+      free(seg);
+    }
+    break;
+  case EV_ACK:
+    if(c.unacked >= e.len) c.unacked -= e.len;
+    else c.unacked = 0;
+    if(c.pendingSends) c.pendingSends--;
+    if(c.open && c.pEspconn->sent_callback) {
+      c.msActive = now;
+      callServer(c.pEspconn->sent_callback, c.pEspconn);
+    }
+    break;
+  case EV_WRITE_FINISH:
+    if(c.open && c.pTcp->write_finish_fn) callServer(c.pTcp->write_finish_fn, c.pEspconn);
+    break;
+  case EV_CLIENT_CLOSE:
+  case EV_DISCON:
+    if(!c.discon) {
+      c.open = false;
+      c.discon = true;
+      simStats.discons++;
+      // Like the SDK, report the disconnect on the listening espconn, carrying the
+      // remote address of the connection that closed.
+      if(listener && listener->proto.tcp->disconnect_callback) {
+        memcpy(listener->proto.tcp->remote_ip, c.pTcp->remote_ip, 4);
+        listener->proto.tcp->remote_port = c.pTcp->remote_port;
+        callServer(listener->proto.tcp->disconnect_callback, listener);
+      }
+    }
+    break;
+  }
+}
+
+bool step(uint32_t limit) {
+  uint32_t at;
+  if(!nextTime(at) || at > limit) return false;
+  if(at > now) now = at;
+  // Timers first, then events in order of time and sequence, then idle timeouts.
+  for(size_t i = 0; i < timers.size(); i++) {
+    os_timer_t* t = timers[i];
+    if(t->timer_expire > now) continue;
+    if(t->timer_period) t->timer_expire = now + t->timer_period;
+    else timers.erase(timers.begin() + i);
+    callServer(t->timer_func, t->timer_arg);
+    return true;
+  }
+  size_t best = events.size();
+  for(size_t i = 0; i < events.size(); i++) {
+    if(events[i].at > now) continue;
+    if(events[i].type == EV_DELIVER && conns[events[i].conn].held) continue;
+    if(best == events.size() || events[i].at < events[best].at ||
+      (events[i].at == events[best].at && events[i].seq < events[best].seq)) best = i;
+  }
+  if(best < events.size()) {
+    Event e = events[best];
+    events.erase(events.begin() + best);
+    fire(e);
+    return true;
+  }
+  for(size_t i = 0; i < conns.size(); i++) {
+    if(conns[i].open && idleTimeout(conns[i]) && conns[i].msActive + idleTimeout(conns[i]) * 1000 <= now) {
+      scheduleDiscon(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace
+
+/********************************************************
+   Arduino timing
+ ********************************************************/
+
+unsigned long millis() { return now; }
+unsigned long micros() { return (unsigned long) now * 1000; }
+void delay(unsigned long ms) { now += ms; }
+void yield() {}
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t, uint8_t) {}
+int digitalRead(uint8_t) { return 0; }
+
+size_t HardwareSerial::write(uint8_t c) {
+  SimSelf self;
+  if(simConfig.echoSerial) fputc(c, stderr);
+  return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t* buf, size_t size) {
+  SimSelf self;
+  if(simConfig.echoSerial) fwrite(buf, 1, size, stderr);
+  return size;
+}
+
+uint32_t EspClass::getFreeHeap() {
+  uint32_t used = sim_heapUsed();
+  return used < simConfig.heapSize ? simConfig.heapSize - used : 0;
+}
+
+uint32 system_get_free_heap_size(void) { return ESP.getFreeHeap(); }
+uint32 system_get_time(void) { return micros(); }
+
+/********************************************************
+   os_timer
+ ********************************************************/
+
+void os_timer_setfn(os_timer_t* ptimer, os_timer_func_t* pfunction, void* parg) {
+  os_timer_disarm(ptimer);
+  ptimer->timer_func = pfunction;
+  ptimer->timer_arg = parg;
+}
+
+void os_timer_arm(os_timer_t* ptimer, uint32_t msec, bool repeat_flag) {
+  SimSelf self;
+  os_timer_disarm(ptimer);
+  ptimer->timer_expire = now + msec;
+  ptimer->timer_period = repeat_flag ? (msec ? msec : 1) : 0;
+  timers.push_back(ptimer);
+}
+
+void os_timer_disarm(os_timer_t* ptimer) {
+  timers.erase(std::remove(timers.begin(), timers.end(), ptimer), timers.end());
+}
+
+/********************************************************
+   espconn
+ ********************************************************/
+
+sint8 espconn_accept(struct espconn* pEspconn) {
+  listener = pEspconn;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_send(struct espconn* pEspconn, uint8* psent, uint16 length) {
+  SimSelf self;
+  Conn* c = findConn(pEspconn);
+  if(!c || !c->open) return ESPCONN_ARG;
+  if(!(c->opts & ESPCONN_COPY) && c->pendingSends) {
+    simStats.sendFails++;
+    return ESPCONN_INPROGRESS;
+  }
+  // A send bigger than the whole buffer still goes once nothing is outstanding, or it never would.
+  if(c->unacked && c->unacked + length > simConfig.sendBufLimit) {
+    simStats.sendFails++;
+    return ESPCONN_MAXNUM;
+  }
+  c->received.append((const char*) psent, length);
+  c->unacked += length;
+  c->pendingSends++;
+  c->msActive = now;
+  simStats.sends++;
+  simStats.bytesToClient += length;
+  SimConn id = c - &conns[0];
+  Event e;
+  e.type = EV_ACK;
+  e.at = now + simConfig.rttMs;
+  e.conn = id;
+  e.len = length;
+  push(e);
+  if(c->opts & ESPCONN_COPY) {
+    e.type = EV_WRITE_FINISH;
+    e.at = now;
+    push(e);
+  }
+  return ESPCONN_OK;
+}
+
+sint8 espconn_sent(struct espconn* pEspconn, uint8* psent, uint16 length) {
+  return espconn_send(pEspconn, psent, length);
+}
+
+sint8 espconn_disconnect(struct espconn* pEspconn) {
+  SimSelf self;
+  Conn* c = findConn(pEspconn);
+  if(!c || !c->open) return ESPCONN_ARG;
+  scheduleDiscon(c - &conns[0]);
+  return ESPCONN_OK;
+}
+
+sint8 espconn_recv_hold(struct espconn* pEspconn) {
+  Conn* c = findConn(pEspconn);
+  if(!c) return ESPCONN_ARG;
+  c->held = true;
+  simStats.holds++;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_recv_unhold(struct espconn* pEspconn) {
+  Conn* c = findConn(pEspconn);
+  if(!c) return ESPCONN_ARG;
+  c->held = false;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_abort(struct espconn* pEspconn) {
+  return espconn_disconnect(pEspconn);
+}
+
+// A type_flag of 1 sets the timeout of the given connection alone, otherwise of them all.
+sint8 espconn_regist_time(struct espconn* pEspconn, uint32 interval, uint8 type_flag) {
+  Conn* c = type_flag == 1 ? findConn(pEspconn) : NULL;
+  if(type_flag == 1 && !c) return ESPCONN_ARG;
+  if(c) c->idleS = interval;
+  else idleTimeoutS = interval;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_regist_connectcb(struct espconn* pEspconn, espconn_connect_callback cb) {
+  pEspconn->proto.tcp->connect_callback = cb;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_regist_disconcb(struct espconn* pEspconn, espconn_connect_callback cb) {
+  pEspconn->proto.tcp->disconnect_callback = cb;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_regist_reconcb(struct espconn* pEspconn, espconn_reconnect_callback cb) {
+  pEspconn->proto.tcp->reconnect_callback = cb;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_regist_recvcb(struct espconn* pEspconn, espconn_recv_callback cb) {
+  pEspconn->recv_callback = cb;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_regist_sentcb(struct espconn* pEspconn, espconn_sent_callback cb) {
+  pEspconn->sent_callback = cb;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_regist_write_finish(struct espconn* pEspconn, espconn_connect_callback cb) {
+  pEspconn->proto.tcp->write_finish_fn = cb;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_set_opt(struct espconn* pEspconn, uint8 opt) {
+  Conn* c = findConn(pEspconn);
+  if(c) c->opts |= opt;
+  return ESPCONN_OK;
+}
+
+sint8 espconn_clear_opt(struct espconn* pEspconn, uint8 opt) {
+  Conn* c = findConn(pEspconn);
+  if(c) c->opts &= ~opt;
+  return ESPCONN_OK;
+}
+
+// Like the SDK, refuse connections to the server beyond this many.
+sint8 espconn_tcp_set_max_con_allow(struct espconn* pEspconn, uint8 num) {
+  (void) pEspconn;
+  maxConAllow = num;
+  return ESPCONN_OK;
+}
+
+static uint8 maxCon = 5;
+sint8 espconn_tcp_set_max_con(uint8 num) {
+  maxCon = num;
+  return ESPCONN_OK;
+}
+
+uint8 espconn_tcp_get_max_con(void) {
+  return maxCon;
+}
+
+/********************************************************
+   Client side
+ ********************************************************/
+
+bool sim_option(int opt, const char* arg) {
+  switch(opt) {
+  case 'r':
+    simConfig.rttMs = atoi(arg);
+    return true;
+  case 's':
+    simConfig.segmentSize = atoi(arg);
+    return simConfig.segmentSize > 0;
+  case 'b':
+    simConfig.sendBufLimit = atoi(arg);
+    return true;
+  case 'h':
+    simConfig.headSplit = atoi(arg);
+    return true;
+  case 'd':
+    simDataDir = arg;
+    return access(arg, R_OK) == 0;
+  }
+  return false;
+}
+
+void sim_fsReset(const char* root);
+
+void sim_reset() {
+  for(size_t i = 0; i < conns.size(); i++) {
+    delete conns[i].pTcp;
+    delete conns[i].pEspconn;
+  }
+  conns.clear();
+  events.clear();
+  timers.clear();
+  listener = NULL;
+  idleTimeoutS = 0;
+  maxConAllow = 0xFF;
+  now = 0;
+  seq = 0;
+  memset(&simStats, 0, sizeof(simStats));
+  sim_fsReset(simDataDir);
+}
+
+uint32_t sim_now() {
+  return now;
+}
+
+void sim_call(void (*fn)()) {
+  sim_inServer = true;
+  fn();
+  sim_inServer = false;
+}
+
+SimConn sim_connect(const uint8_t ip[4], uint16_t port) {
+  if(!listener) return -1;
+  Conn c;
+  c.pTcp = new esp_tcp(*listener->proto.tcp);
+  memcpy(c.pTcp->remote_ip, ip, 4);
+  c.pTcp->remote_port = port;
+  c.pEspconn = new espconn(*listener);
+  c.pEspconn->proto.tcp = c.pTcp;
+  c.pEspconn->state = ESPCONN_CONNECT;
+  c.pEspconn->reverse = NULL;
+  c.open = true;
+  c.discon = false;
+  c.held = false;
+  c.opts = 0;
+  c.unacked = 0;
+  c.pendingSends = 0;
+  c.msActive = now;
+  c.idleS = 0;
+  uint32_t open = 0;
+  for(size_t i = 0; i < conns.size(); i++) open += conns[i].open;
+  // A refused connection is closed from the start, and the server never hears of it.
+  if(open >= maxConAllow) {
+    c.open = false;
+    c.discon = true;
+  }
+  conns.push_back(c);
+  SimConn id = conns.size() - 1;
+  if(!c.open) return id;
+  simStats.connects++;
+  if(c.pTcp->connect_callback) callServer(c.pTcp->connect_callback, c.pEspconn);
+  return id;
+}
+
+void sim_write(SimConn id, const char* data, size_t len) {
+  uint32_t at = now + simConfig.rttMs / 2;
+  bool first = true;
+  while(len) {
+    size_t n = len < simConfig.segmentSize ? len : simConfig.segmentSize;
+    if(first && simConfig.headSplit && simConfig.headSplit < n) n = simConfig.headSplit;
+    first = false;
+    Event e;
+    e.type = EV_DELIVER;
+    e.at = at;
+    e.conn = id;
+    e.data.assign(data, n);
+    e.len = n;
+    push(e);
+    data += n;
+    len -= n;
+  }
+}
+
+void sim_close(SimConn id) {
+  Event e;
+  e.type = EV_CLIENT_CLOSE;
+  e.at = now + simConfig.rttMs / 2;
+  e.conn = id;
+  e.len = 0;
+  push(e);
+}
+
+bool sim_isOpen(SimConn id) {
+  return conns[id].open;
+}
+
+std::string& sim_received(SimConn id) {
+  return conns[id].received;
+}
+
+void sim_run() {
+  while(step(UINT32_MAX)) ;
+}
+
+void sim_runUntil(uint32_t msTime) {
+  while(step(msTime)) ;
+  if(now < msTime) now = msTime;
+}
+
+// Overridden by heap_sim.cpp when the allocator wrapper is linked in.
+__attribute__((weak)) bool sim_inServer;
+__attribute__((weak)) uint32_t sim_heapUsed() { return 0; }
+__attribute__((weak)) uint32_t sim_heapPeak() { return 0; }
+__attribute__((weak)) void sim_heapResetPeak() {}
+__attribute__((weak)) uint64_t sim_allocCount() { return 0; }
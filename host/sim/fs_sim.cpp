@@ -0,0 +1,228 @@
+// Directory-backed SPIFFS stand-in. SPIFFS file "/a/b.txt" maps to <root>/a/b.txt on the host;
+// directories are only an artifact of the mapping. The host's stdio buffers aren't counted as the
+// server's heap, so the calls are marked as the simulator's own work.
+
+#include <FS.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "host_sim.h"
+
+fs::FS SPIFFS;
+
+namespace {
+
+std::string fsRoot = "data";
+bool mounted = false;
+
+std::string hostPath(const char* path) {
+  std::string p = fsRoot;
+  if(path[0] != '/') p += '/';
+  return p + path;
+}
+
+void mkdirs(const std::string& file) {
+  for(size_t i = fsRoot.size() + 1; i < file.size(); i++) {
+    if(file[i] == '/') mkdir(file.substr(0, i).c_str(), 0755);
+  }
+}
+
+void walk(const std::string& dir, const std::string& prefix, std::vector<std::string>& names, std::vector<size_t>& sizes) {
+  DIR* d = opendir(dir.c_str());
+  if(!d) return;
+  std::vector<std::string> entries;
+  struct dirent* e;
+  while((e = readdir(d))) {
+    if(e->d_name[0] == '.') continue;
+    entries.push_back(e->d_name);
+  }
+  closedir(d);
+  std::sort(entries.begin(), entries.end());
+  for(size_t i = 0; i < entries.size(); i++) {
+    std::string full = dir + "/" + entries[i];
+    struct stat st;
+    if(stat(full.c_str(), &st) != 0) continue;
+    if(S_ISDIR(st.st_mode)) {
+      walk(full, prefix + entries[i] + "/", names, sizes);
+    } else {
+      names.push_back(prefix + entries[i]);
+      sizes.push_back(st.st_size);
+    }
+  }
+}
+
+} // namespace
+
+namespace fs {
+
+class FileImpl {
+public:
+  FILE* fp;
+  std::string name;
+  size_t length;
+  ~FileImpl() { if(fp) fclose(fp); }
+};
+
+size_t File::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t File::write(const uint8_t* buf, size_t size) {
+  SimSelf self;
+  if(!_p || !_p->fp) return 0;
+  size_t n = fwrite(buf, 1, size, _p->fp);
+  long pos = ftell(_p->fp);
+  if(pos > (long) _p->length) _p->length = pos;
+  return n;
+}
+
+int File::available() {
+  SimSelf self;
+  if(!_p || !_p->fp) return 0;
+  return (int) (_p->length - ftell(_p->fp));
+}
+
+int File::read() {
+  SimSelf self;
+  if(!_p || !_p->fp) return -1;
+  return fgetc(_p->fp);
+}
+
+int File::peek() {
+  SimSelf self;
+  if(!_p || !_p->fp) return -1;
+  int c = fgetc(_p->fp);
+  if(c >= 0) ungetc(c, _p->fp);
+  return c;
+}
+
+size_t File::read(uint8_t* buf, size_t size) {
+  SimSelf self;
+  if(!_p || !_p->fp) return 0;
+  return fread(buf, 1, size, _p->fp);
+}
+
+bool File::seek(uint32_t pos, SeekMode mode) {
+  SimSelf self;
+  if(!_p || !_p->fp) return false;
+  return fseek(_p->fp, pos, mode == SeekSet ? SEEK_SET : mode == SeekCur ? SEEK_CUR : SEEK_END) == 0;
+}
+
+size_t File::position() const {
+  SimSelf self;
+  if(!_p || !_p->fp) return 0;
+  return ftell(_p->fp);
+}
+
+size_t File::size() const {
+  return _p ? _p->length : 0;
+}
+
+void File::close() {
+  SimSelf self;
+  _p.reset();
+}
+
+File::operator bool() const {
+  return _p && _p->fp;
+}
+
+const char* File::name() const {
+  return _p ? _p->name.c_str() : "";
+}
+
+File Dir::openFile(const char* mode) {
+  return SPIFFS.open(_names[_i].c_str(), mode);
+}
+
+bool FS::begin() {
+  mounted = true;
+  return true;
+}
+
+void FS::end() {
+  mounted = false;
+}
+
+bool FS::format() {
+  return false;
+}
+
+bool FS::info(FSInfo& info) {
+  SimSelf self;
+  std::vector<std::string> names;
+  std::vector<size_t> sizes;
+  walk(fsRoot, "/", names, sizes);
+  memset(&info, 0, sizeof(info));
+  info.totalBytes = 3 * 1024 * 1024;
+  for(size_t i = 0; i < sizes.size(); i++) info.usedBytes += sizes[i];
+  info.blockSize = 8192;
+  info.pageSize = 256;
+  info.maxOpenFiles = 5;
+  info.maxPathLength = 32;
+  return true;
+}
+
+File FS::open(const char* path, const char* mode) {
+  SimSelf self;
+  if(!mounted) return File();
+  std::string hp = hostPath(path);
+  const char* m = "rb";
+  if(mode[0] == 'w') m = mode[1] == '+' ? "w+b" : "wb";
+  else if(mode[0] == 'a') m = mode[1] == '+' ? "a+b" : "ab";
+  else if(mode[1] == '+') m = "r+b";
+  if(mode[0] != 'r') mkdirs(hp);
+  FILE* fp = fopen(hp.c_str(), m);
+  if(!fp) return File();
+  FileImpl* impl = new FileImpl();
+  impl->fp = fp;
+  impl->name = path;
+  struct stat st;
+  impl->length = stat(hp.c_str(), &st) == 0 ? st.st_size : 0;
+  return File(FileImplPtr(impl));
+}
+
+bool FS::exists(const char* path) {
+  SimSelf self;
+  if(!mounted) return false;
+  struct stat st;
+  return stat(hostPath(path).c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+Dir FS::openDir(const char* path) {
+  SimSelf self;
+  std::vector<std::string> names;
+  std::vector<size_t> sizes;
+  walk(fsRoot, "/", names, sizes);
+  std::vector<std::string> n;
+  std::vector<size_t> s;
+  size_t l = strlen(path);
+  for(size_t i = 0; i < names.size(); i++) {
+    if(names[i].compare(0, l, path) == 0) {
+      n.push_back(names[i]);
+      s.push_back(sizes[i]);
+    }
+  }
+  return Dir(n, s);
+}
+
+bool FS::remove(const char* path) {
+  SimSelf self;
+  return unlink(hostPath(path).c_str()) == 0;
+}
+
+bool FS::rename(const char* pathFrom, const char* pathTo) {
+  SimSelf self;
+  std::string to = hostPath(pathTo);
+  mkdirs(to);
+  return ::rename(hostPath(pathFrom).c_str(), to.c_str()) == 0;
+}
+
+} // namespace fs
+
+void sim_fsReset(const char* root) {
+  fsRoot = root;
+  mounted = false;
+}
@@ -0,0 +1,132 @@
+// Heap accounting for host builds. The C allocator is wrapped so ESP.getFreeHeap() and the
+// benchmark's peak heap reflect what the server allocates. Each block has a header noting whether
+// it was allocated by server code, so the simulator's buffers aren't counted even when they are
+// allocated during a call from the server. It isn't linked into sanitizer builds, which have an
+// allocator of their own.
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "host_sim.h"
+
+extern "C" {
+  void* __libc_malloc(size_t size);
+  void* __libc_realloc(void* p, size_t size);
+  void __libc_free(void* p);
+}
+
+// Sits just before the memory handed out.
+struct SimBlock {
+  void* base;  // What __libc_malloc returned.
+  size_t size;
+  uint32_t server;
+  uint32_t magic;
+};
+// Room taken ahead of each block, keeping malloc's alignment.
+#define SIM_BLOCK_ROOM 32
+#define SIM_BLOCK_MAGIC 0x5EB10C
+
+bool sim_inServer;
+static uint64_t heapUsed;
+static uint64_t heapPeak;
+static uint64_t allocCount;
+
+static SimBlock* block(void* p) {
+  SimBlock* b = (SimBlock*) p - 1;
+  return b->magic == SIM_BLOCK_MAGIC ? b : NULL;
+}
+
+static void* allocAligned(size_t align, size_t size) {
+  if(size > SIZE_MAX - SIM_BLOCK_ROOM - align) return NULL;
+  char* base = (char*) __libc_malloc(size + SIM_BLOCK_ROOM + align);
+  if(!base) return NULL;
+  uintptr_t p = (uintptr_t) base + SIM_BLOCK_ROOM;
+  p = (p + align - 1) & ~(uintptr_t) (align - 1);
+  SimBlock* b = (SimBlock*) p - 1;
+  b->base = base;
+  b->size = size;
+  b->server = sim_inServer;
+  b->magic = SIM_BLOCK_MAGIC;
+  if(sim_inServer) {
+    heapUsed += size;
+    if(heapUsed > heapPeak) heapPeak = heapUsed;
+    allocCount++;
+  }
+  return (void*) p;
+}
+
+extern "C" void* malloc(size_t size) {
+  return allocAligned(16, size);
+}
+
+extern "C" void free(void* p) {
+  if(!p) return;
+  SimBlock* b = block(p);
+  if(!b) {
+    // Allocated before the wrapper was in place.
+    __libc_free(p);
+    return;
+  }
+  if(b->server) heapUsed -= b->size;
+  b->magic = 0;
+  __libc_free(b->base);
+}
+
+extern "C" void* calloc(size_t n, size_t size) {
+  if(size && n > SIZE_MAX / size) return NULL;
+  void* p = malloc(n * size);
+  if(p) memset(p, 0, n * size);
+  return p;
+}
+
+extern "C" void* realloc(void* old, size_t size) {
+  if(!old) return malloc(size);
+  SimBlock* b = block(old);
+  if(!b) return __libc_realloc(old, size);
+  if(size == 0) {
+    free(old);
+    return NULL;
+  }
+  void* p = malloc(size);
+  if(!p) return NULL;
+  memcpy(p, old, b->size < size ? b->size : size);
+  free(old);
+  return p;
+}
+
+extern "C" int posix_memalign(void** pp, size_t align, size_t size) {
+  if(align < sizeof(void*) || (align & (align - 1))) return EINVAL;
+  *pp = allocAligned(align < 16 ? 16 : align, size);
+  return *pp ? 0 : ENOMEM;
+}
+
+extern "C" void* aligned_alloc(size_t align, size_t size) {
+  return allocAligned(align < 16 ? 16 : align, size);
+}
+
+extern "C" void* memalign(size_t align, size_t size) {
+  return allocAligned(align < 16 ? 16 : align, size);
+}
+
+extern "C" size_t malloc_usable_size(void* p) {
+  SimBlock* b = p ? block(p) : NULL;
+  return b ? b->size : 0;
+}
+
+uint32_t sim_heapUsed() {
+  return (uint32_t) heapUsed;
+}
+
+uint32_t sim_heapPeak() {
+  return (uint32_t) heapPeak;
+}
+
+void sim_heapResetPeak() {
+  heapPeak = heapUsed;
+}
+
+uint64_t sim_allocCount() {
+  return allocCount;
+}
@@ -0,0 +1,75 @@
+#ifndef HOST_SIM_H
+#define HOST_SIM_H
+
+// Deterministic simulated network and flash for host builds of esp_httpd.
+//
+// The server sees the usual espconn callbacks. The client side is driven through the sim_*
+// functions below. Time is virtual and only moves on in sim_run() and sim_runUntil(), so a run
+// gives the same results every time.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+struct SimConfig {
+  uint32_t rttMs;         // Round trip time. A send is acknowledged after this long.
+  uint16_t segmentSize;   // Client data reaches httpd_recv in segments of at most this size.
+  uint16_t headSplit;     // If set, the first segment of each client write is cut after this many bytes.
+  uint32_t sendBufLimit;  // Bytes the server may have unacknowledged before espconn_send fails.
+  uint32_t heapSize;      // Heap the server starts with, as reported by ESP.getFreeHeap().
+  bool echoSerial;        // Copy Serial output to stderr.
+};
+
+struct SimStats {
+  uint32_t sends;         // Successful espconn_send calls.
+  uint32_t sendFails;     // espconn_send calls refused because the send buffer was full.
+  uint64_t bytesToClient;
+  uint64_t bytesToServer;
+  uint32_t connects;
+  uint32_t discons;
+  uint32_t holds;         // espconn_recv_hold calls.
+};
+
+typedef int SimConn;
+
+extern SimConfig simConfig;
+extern SimStats simStats;
+
+// Options common to the host programs, for getopt(): -r rtt, -s segment size, -b send buffer
+// limit, -h header split and -d the directory that stands in for SPIFFS.
+#define SIM_OPTIONS "r:s:b:h:d:"
+#define SIM_USAGE "[-r rtt_ms] [-s segment_size] [-b send_buffer] [-h header_split] [-d data_dir]"
+bool sim_option(int opt, const char* arg);
+
+// Resets the network and mounts the directory given with -d, ../data unless another was given.
+void sim_reset();
+uint32_t sim_now();
+// Runs server code, setup() or loop() for example, as the SDK would, with its allocations counted.
+void sim_call(void (*fn)());
+
+// Client side.
+SimConn sim_connect(const uint8_t ip[4], uint16_t port);
+void sim_write(SimConn c, const char* data, size_t len);
+void sim_close(SimConn c);
+bool sim_isOpen(SimConn c);
+std::string& sim_received(SimConn c);
+// Event loop: runs until there's nothing left to do, or until the given virtual time.
+void sim_run();
+void sim_runUntil(uint32_t msTime);
+
+// Heap accounting. Only what the server allocates is counted, not the simulator's own buffers.
+extern bool sim_inServer;
+uint32_t sim_heapUsed();
+uint32_t sim_heapPeak();
+void sim_heapResetPeak();
+uint64_t sim_allocCount();
+
+// Marks the simulator's own work done in a call from the server, so what it allocates isn't
+// counted as the server's.
+struct SimSelf {
+  bool was;
+  SimSelf() : was(sim_inServer) { sim_inServer = false; }
+  ~SimSelf() { sim_inServer = was; }
+};
+
+#endif
@@ -0,0 +1,7 @@
+// Stands in for lib/wifi on the host, where there's no WiFi to join.
+
+#include <wifi.h>
+
+bool initWifi() {
+  return true;
+}
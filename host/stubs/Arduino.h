@@ -0,0 +1,145 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// Minimal stand-in for the parts of the ESP8266 Arduino core used by esp_httpd.
+// Time is virtual and advanced by the simulated network (see espconn_sim.cpp).
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <sys/types.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t sint8;
+typedef int16_t sint16;
+typedef int32_t sint32;
+typedef bool boolean;
+
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RAM_ATTR
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strncasecmp_P strncasecmp
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+#define INPUT 0
+
+// The sketch's entry points, declared here as the core does.
+void setup();
+void loop();
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+class String {
+public:
+  String() : buf(NULL), len(0) {}
+  String(const char* s) : buf(NULL), len(0) { assign(s, s ? strlen(s) : 0); }
+  String(const String& s) : buf(NULL), len(0) { assign(s.buf, s.len); }
+  ~String() { free(buf); }
+  String& operator=(const String& s) { if(this != &s) assign(s.buf, s.len); return *this; }
+  const char* c_str() const { return buf ? buf : ""; }
+  unsigned int length() const { return len; }
+private:
+  void assign(const char* s, size_t l) {
+    char* p = (char*) malloc(l + 1);
+    if(l) memcpy(p, s, l);
+    p[l] = '\0';
+    free(buf);
+    buf = p;
+    len = l;
+  }
+  char* buf;
+  size_t len;
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buf, size_t size) {
+    size_t n = 0;
+    while(size--) n += write(*buf++);
+    return n;
+  }
+  size_t write(const char* s) { return s ? write((const uint8_t*) s, strlen(s)) : 0; }
+  size_t print(const char* s) { return write(s); }
+  size_t print(const String& s) { return write(s.c_str()); }
+  size_t print(char c) { return write((uint8_t) c); }
+  size_t print(int n) { return printf("%d", n); }
+  size_t print(unsigned int n) { return printf("%u", n); }
+  size_t print(long n) { return printf("%ld", n); }
+  size_t print(unsigned long n) { return printf("%lu", n); }
+  size_t print(double n) { return printf("%.2f", n); }
+  size_t println() { return write("\r\n"); }
+  template <typename T> size_t println(T v) { size_t n = print(v); return n + println(); }
+  size_t printf(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+    char tmp[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int l = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    if(l < 0) return 0;
+    if((size_t) l < sizeof(tmp)) return write((const uint8_t*) tmp, l);
+    char* big = (char*) malloc(l + 1);
+    va_start(ap, fmt);
+    vsnprintf(big, l + 1, fmt, ap);
+    va_end(ap);
+    size_t n = write((const uint8_t*) big, l);
+    free(big);
+    return n;
+  }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  virtual int peek() { return -1; }
+  size_t readBytes(char* buf, size_t len) {
+    size_t n = 0;
+    int c;
+    while(n < len && (c = read()) >= 0) buf[n++] = (char) c;
+    return n;
+  }
+};
+
+class HardwareSerial : public Stream {
+public:
+  void begin(unsigned long baud) { (void) baud; }
+  int available() { return 1; }
+  int availableForWrite() { return 128; }
+  size_t write(uint8_t c);
+  size_t write(const uint8_t* buf, size_t size);
+  using Print::write;
+};
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+  uint32_t getFreeHeap();
+};
+extern EspClass ESP;
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef HOST_FS_H
+#define HOST_FS_H
+
+// Directory-backed stand-in for the ESP8266 Arduino SPIFFS API. SPIFFS has a
+// flat namespace, so "/stars/stargold.gif" is a file name, not a directory.
+
+#include <Arduino.h>
+#include <memory>
+#include <vector>
+#include <string>
+
+namespace fs {
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+struct FSInfo {
+  size_t totalBytes;
+  size_t usedBytes;
+  size_t blockSize;
+  size_t pageSize;
+  size_t maxOpenFiles;
+  size_t maxPathLength;
+};
+
+class FileImpl;
+typedef std::shared_ptr<FileImpl> FileImplPtr;
+
+class File : public Stream {
+public:
+  File() {}
+  File(FileImplPtr p) : _p(p) {}
+  size_t write(uint8_t c);
+  size_t write(const uint8_t* buf, size_t size);
+  using Print::write;
+  int available();
+  int read();
+  int peek();
+  size_t read(uint8_t* buf, size_t size);
+  bool seek(uint32_t pos, SeekMode mode);
+  bool seek(uint32_t pos) { return seek(pos, SeekSet); }
+  size_t position() const;
+  size_t size() const;
+  void close();
+  operator bool() const;
+  const char* name() const;
+private:
+  FileImplPtr _p;
+};
+
+class Dir {
+public:
+  Dir() : _i(-1) {}
+  Dir(const std::vector<std::string>& names, const std::vector<size_t>& sizes) : _names(names), _sizes(sizes), _i(-1) {}
+  bool next() { return ++_i < (int) _names.size(); }
+  String fileName() const { return String(_names[_i].c_str()); }
+  size_t fileSize() const { return _sizes[_i]; }
+  File openFile(const char* mode);
+private:
+  std::vector<std::string> _names;
+  std::vector<size_t> _sizes;
+  int _i;
+};
+
+class FS {
+public:
+  bool begin();
+  void end();
+  bool format();
+  bool info(FSInfo& info);
+  File open(const char* path, const char* mode);
+  bool exists(const char* path);
+  Dir openDir(const char* path);
+  bool remove(const char* path);
+  bool rename(const char* pathFrom, const char* pathTo);
+};
+
+} // namespace fs
+
+using fs::FS;
+using fs::File;
+using fs::Dir;
+using fs::SeekMode;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
+using fs::FSInfo;
+
+extern fs::FS SPIFFS;
+
+#endif
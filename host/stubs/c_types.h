@@ -0,0 +1,14 @@
+#ifndef HOST_C_TYPES_H
+#define HOST_C_TYPES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t sint8;
+typedef int16_t sint16;
+typedef int32_t sint32;
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef HOST_OSAPI_H
+#define HOST_OSAPI_H
+
+#include "os_type.h"
+
+void os_timer_setfn(os_timer_t* ptimer, os_timer_func_t* pfunction, void* parg);
+void os_timer_arm(os_timer_t* ptimer, uint32_t msec, bool repeat_flag);
+void os_timer_disarm(os_timer_t* ptimer);
+
+#endif
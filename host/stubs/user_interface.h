@@ -0,0 +1,10 @@
+#ifndef HOST_USER_INTERFACE_H
+#define HOST_USER_INTERFACE_H
+
+#include "c_types.h"
+#include "os_type.h"
+
+uint32 system_get_free_heap_size(void);
+uint32 system_get_time(void);
+
+#endif
@@ -1,526 +1,3911 @@
+#define LOG_MODULE LOG_HTTPD
 #include "esp_httpd.h"
+#include <new>
 
 /********************************************************
    Global Variables
  ********************************************************/
 
-HttpRequest httpd_requests[MAX_HTTP_CONNECTIONS];
+// The reverse pointer of a bound espconn holds (gen << HTTPD_TAG_SLOT_BITS) | (slot + 1).
+#define HTTPD_TAG_SLOT_BITS 8
+#define HTTPD_TAG_SLOT_MASK 0xFF
+#define HTTPD_GEN_MASK 0xFFFFFF
+// Slots are also indexed by remote ip:port for the callbacks that don't get the connection's own espconn.
+#define HTTPD_PEER_HASH_BITS 6
+#define HTTPD_PEER_BUCKETS (1 << HTTPD_PEER_HASH_BITS)
+// Memory used by each slot, including the buffers it owns.
+#define HTTPD_SLOT_BUFFERS (HTTPD_HEAD_BUFFER_SIZE + HTTPD_TX_BUFFER_SIZE + HTTPD_ARENA_SIZE)
+#define HTTPD_SLOT_SIZE (sizeof(HttpRequest) + HTTPD_SLOT_BUFFERS)
+
+// Headers the server acts on itself, as identified by the request parser.
+enum HttpHeaderId { HDR_OTHER, HDR_CONTENT_LENGTH, HDR_AUTHORIZATION, HDR_CONNECTION, HDR_EXPECT };
+// A node of the compiled route trie. A node matches either a literal run of the URI (label)
+// or, if param is set, one :param segment. Routes whose uri ends at the node are chained from
+// exact, those ending in '*' at the node from prefix.
+struct HttpRouteNode {
+  const char* label;
+  uint8_t lenLabel;
+  bool param;
+  int16_t child;
+  int16_t sibling;
+  int16_t exact;
+  int16_t prefix;
+  uint16_t methods;  // Methods of all the routes at or below this node, as (1 << HTTPMethod) bits.
+};
+
+// A file held in RAM by the cache. Each entry is a single allocation: the struct, then the path,
+// the response header lines and the file's contents.
+struct HttpCacheEntry {
+  HttpCacheEntry* prev;  // The cache is kept in least recently used order, newest first.
+  HttpCacheEntry* next;
+  uint32_t hash;
+  uint32_t lenAlloc;
+  uint32_t lenBody;
+  uint16_t lenHead;
+  uint8_t lenPath;
+  uint32_t contentHash;  // For the ETag.
+  uint8_t refs;  // Responses being sent from the entry. It is only freed when there are none.
+  bool stale;    // Dropped from the cache while in use; freed when the last response finishes.
+};
+
+// The hash of a file's contents that its ETag is made from, remembered once the file has been hashed.
+struct HttpETag {
+  uint32_t pathHash;
+  uint32_t size;
+  uint32_t contentHash;
+};
+
+// Request latency is counted in buckets with these upper bounds, in milliseconds, and a last
+// bucket for the rest.
+#define HTTPD_LATENCY_BUCKETS 10
+const uint16_t httpd_latencyBounds[HTTPD_LATENCY_BUCKETS - 1] = {5, 10, 25, 50, 100, 250, 500, 1000, 2500};
+
+// The requests answered through a route, by how long they took from the first byte received to
+// the last byte acknowledged.
+struct HttpRouteStats {
+  uint32_t buckets[HTTPD_LATENCY_BUCKETS];
+  uint32_t msTotal;
+};
+
+struct HttpStatusCount {
+  uint16_t code;
+  uint32_t count;
+};
+
+// txFlags
+#define TX_RETRY 0x01      // A send was refused for lack of room and must be retried.
+#define TX_OWNS_BODY 0x02  // txBody was allocated by the server and is freed when sent.
+#define TX_CLOSE 0x04      // The response has gone and the connection is to be closed.
+#define TX_STREAM 0x08     // A streamed response is still being written.
+#define TX_CHUNKED 0x10    // The streamed response is framed as chunks (HTTP/1.1).
+#define TX_HASH 0x20       // The file being sent is hashed for its ETag as it is read.
+// Room kept in the outbound queue for a chunk's size line, and for the chunk's trailing CRLF plus
+// the final zero-length chunk.
+#define HTTPD_CHUNK_HEAD 6
+#define HTTPD_STREAM_TAIL 7
+
+// parseFlags
+#define PARSE_DROP_LINE 0x01  // The current header line didn't fit in head and is being dropped.
+#define PARSE_INDEXED 0x02    // httpd_getHeader() has indexed all the headers.
+#define PARSE_CONN_CLOSE 0x04       // The request had Connection: close.
+#define PARSE_CONN_KEEP_ALIVE 0x08  // The request had Connection: keep-alive.
+#define PARSE_EXPECT_CONTINUE 0x10  // The request had Expect: 100-continue.
+#define PARSE_LENGTH_DIGITS 0x20    // The Content-Length value being read has had a digit.
+#define PARSE_LENGTH_END 0x40       // And then whitespace, so it can have no more digits.
+
+// The interim response that tells a client waiting on Expect: 100-continue to send the body. It's
+// sent straight from here, so it's kept in RAM.
+const char httpd_continue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+#define HTTPD_STRINGIFY(x) #x
+#define HTTPD_TOSTRING(x) HTTPD_STRINGIFY(x)
+// The response to a connection turned away, made once, and sent straight from RAM like httpd_continue.
+const char httpd_busy[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: " HTTPD_TOSTRING(HTTPD_RETRY_AFTER_S)
+  "\r\nContent-Length: 0\r\nServer: " HTTPD_SERVER "\r\nConnection: close\r\n\r\n";
+
+// A connection without a slot that is being closed: turned away with a 503, or evicted to make room.
+// It's disconnected by httpd_closeConns(), once the 503 has been acknowledged if there is one,
+// and forgotten when the SDK reports it closed.
+struct HttpClosingConn {
+  espconn* pEspconn;  // NULL for an unused entry.
+  uint8_t remote_ip[4];
+  uint16_t remote_port;
+  uint8_t state;
+};
+#define CLOSING_SENDING 1       // Waiting for the 503 to be acknowledged.
+#define CLOSING_READY 2         // To be disconnected.
+#define CLOSING_DISCONNECTED 3  // Waiting for the disconnect callback.
+
+HttpRequest* httpd_requests;
+uint8_t httpd_slotCount;
+int8_t httpd_peerBuckets[HTTPD_PEER_BUCKETS];
+HttpClosingConn httpd_closing[HTTPD_SPARE_CONNS];
+bool httpd_fsMounted;
+os_timer_t httpd_retryTimer;
+os_timer_t httpd_closeTimer;
 HttpRoute* httpd_routes;
+uint16_t httpd_routeCount;
+HttpRouteNode* httpd_routeNodes;
+uint16_t httpd_routeNodeCount;
+int16_t* httpd_routeNext;  // Chains the routes that end at the same trie node, in table order.
+uint httpd_cacheBudget;  // Zero while the file cache is disabled.
+HttpCacheEntry* httpd_cacheNewest;
+HttpCacheEntry* httpd_cacheOldest;
+HttpCacheStats httpd_cacheCounters;
+HttpETag httpd_etags[HTTPD_ETAG_ENTRIES];
+uint8_t httpd_etagNext;  // The entry to be replaced next.
+HttpStats httpd_counters;
+// One for each route, and one more for the requests no route took.
+HttpRouteStats* httpd_routeStats;
+HttpStatusCount httpd_statusCounts[HTTPD_STATUS_CODES];
+uint32_t httpd_statusOther;  // Responses with a code there was no room for in httpd_statusCounts.
+// The listening connection is referenced by the SDK for as long as the server runs.
+espconn httpd_espconn;
+esp_tcp httpd_espTcp;
+
+// Closes connections from a timer, defined with the web functions.
+void httpd_closeConns(void* arg);
+// Outbound queue functions, defined with the send-related functions.
+void httpd_beginResponse(HttpRequest &httpd_request, uint lenHead, uint lenBody);
+void httpd_endResponse(HttpRequest &httpd_request);
+bool httpd_txDone(HttpRequest &httpd_request);
+void httpd_flush(HttpRequest &httpd_request);
+void httpd_retryTx(void* arg);
+void httpd_fillStream(HttpRequest &httpd_request);
+uint httpd_endHead(HttpRequest &httpd_request, char* buf);
+void httpd_sendBody(espconn* pEspconn, uint responseCode, const char* pMime, const char* pData, uint lData, bool copy);
+void httpd_cacheRelease(HttpCacheEntry* e);
+uint32_t httpd_hashBytes(uint32_t hash, const uint8_t* p, uint len);
+void httpd_etagRemember(uint32_t pathHash, uint size, uint32_t contentHash);
+const char* httpd_dirKey(bool json);
+bool httpd_dirList(espconn* pEspconn, HttpRequest &httpd_request, bool json);
+void httpd_metricsHeap();
+void httpd_metricsRecord(HttpRequest &httpd_request);
+void httpd_wsFeed(HttpRequest &httpd_request, const char* pData, uint len);
+void httpd_wsSent(HttpRequest &httpd_request);
+void httpd_wsEnd(HttpRequest &httpd_request);
+void httpd_sseSent(HttpRequest &httpd_request);
+void httpd_sseEnd(HttpRequest &httpd_request);
 
 /********************************************************
-   Web Functions
+   Routing Functions
  ********************************************************/
 
-void httpd_init(HttpRoute* pHttpRoutes, int port) {
-  SP("\nhttpd_init...");
+uint16_t httpd_methodBit(HTTPMethod method) {
+  return method == HTTP_ANY ? 0xFFFF : 1 << method;
+}
+
+bool httpd_isParamEnd(char c) {
+  return c == '/' || c == '?' || c == '*' || c == '\0';
+}
+
+int16_t httpd_newRouteNode(const char* label, uint8_t lenLabel, bool param) {
+  HttpRouteNode &node = httpd_routeNodes[httpd_routeNodeCount];
+  node.label = label;
+  node.lenLabel = lenLabel;
+  node.param = param;
+  node.child = NOT_FOUND;
+  node.sibling = NOT_FOUND;
+  node.exact = NOT_FOUND;
+  node.prefix = NOT_FOUND;
+  node.methods = 0;
+  return httpd_routeNodeCount++;
+}
+
+int16_t httpd_addRouteChild(int16_t parent, const char* label, uint8_t lenLabel, bool param) {
+  int16_t n = httpd_newRouteNode(label, lenLabel, param);
+  httpd_routeNodes[n].sibling = httpd_routeNodes[parent].child;
+  httpd_routeNodes[parent].child = n;
+  return n;
+}
+
+// Appends route i to a chain, keeping the chain in table order.
+void httpd_chainRoute(int16_t* pChain, int16_t i) {
+  while(*pChain != NOT_FOUND) pChain = &httpd_routeNext[*pChain];
+  *pChain = i;
+  httpd_routeNext[i] = NOT_FOUND;
+}
+
+void httpd_insertRoute(int16_t i) {
+  const char* uri = httpd_routes[i].uri;
+  uint16_t mask = httpd_methodBit(httpd_routes[i].method);
+  int16_t n = 0;
+  httpd_routeNodes[n].methods |= mask;
+  while(true) {
+    if(*uri == '\0') {
+      httpd_chainRoute(&httpd_routeNodes[n].exact, i);
+      return;
+    }
+    if(*uri == '*' && uri[1] == '\0') {
+      httpd_chainRoute(&httpd_routeNodes[n].prefix, i);
+      return;
+    }
+    int16_t c;
+    if(*uri == ':') {
+      // All :param segments at the same position share a node; the names are
+      // taken from the route itself when it is tried.
+      const char* name = uri + 1;
+      while(!httpd_isParamEnd(*name)) name++;
+      for(c = httpd_routeNodes[n].child; c != NOT_FOUND && !httpd_routeNodes[c].param; c = httpd_routeNodes[c].sibling) ;
+      if(c == NOT_FOUND) c = httpd_addRouteChild(n, uri, name - uri, true);
+      uri = name;
+    } else {
+      // A literal run lasts up to the next :param or trailing '*'.
+      const char* end = uri;
+      while(*end && *end != ':' && !(*end == '*' && end[1] == '\0') && end - uri < 255) end++;
+      for(c = httpd_routeNodes[n].child; c != NOT_FOUND; c = httpd_routeNodes[c].sibling) {
+        if(!httpd_routeNodes[c].param && httpd_routeNodes[c].label[0] == *uri) break;
+      }
+      if(c == NOT_FOUND) {
+        c = httpd_addRouteChild(n, uri, end - uri, false);
+        uri = end;
+      } else {
+        HttpRouteNode &child = httpd_routeNodes[c];
+        uint8_t k = 1;
+        while(k < child.lenLabel && uri + k < end && child.label[k] == uri[k]) k++;
+        if(k < child.lenLabel) {
+          // Split the child where this route diverges from it.
+          int16_t tail = httpd_newRouteNode(child.label + k, child.lenLabel - k, false);
+          HttpRouteNode &split = httpd_routeNodes[tail];
+          split.child = child.child;
+          split.exact = child.exact;
+          split.prefix = child.prefix;
+          split.methods = child.methods;
+          child.lenLabel = k;
+          child.child = tail;
+          child.exact = NOT_FOUND;
+          child.prefix = NOT_FOUND;
+        }
+        uri += k;
+      }
+    }
+    n = c;
+    httpd_routeNodes[n].methods |= mask;
+  }
+}
+
+void httpd_freeRoutes() {
+  free(httpd_routeNodes);
+  free(httpd_routeNext);
+  free(httpd_routeStats);
+  httpd_routeNodes = NULL;
+  httpd_routeNext = NULL;
+  httpd_routeStats = NULL;
+  httpd_routeCount = 0;
+}
+
+bool httpd_compileRoutes() {
+  // Each route adds at most two nodes per literal run and one per :param.
+  uint16_t routeCount = 0;
+  uint16_t maxNodes = 1;
+  for(; httpd_routes[routeCount].method != HTTP_NONE; routeCount++) {
+    uint16_t params = 0;
+    for(const char* p = httpd_routes[routeCount].uri; *p; p++) if(*p == ':') params++;
+    maxNodes += 3 * params + 2 + strlen(httpd_routes[routeCount].uri) / 255 * 2;
+  }
+  httpd_routeNodes = (HttpRouteNode*) malloc(maxNodes * sizeof(HttpRouteNode));
+  httpd_routeNext = (int16_t*) malloc((routeCount + 1) * sizeof(int16_t));
+  httpd_routeStats = (HttpRouteStats*) calloc(routeCount + 1, sizeof(HttpRouteStats));
+  if(!httpd_routeNodes || !httpd_routeNext || !httpd_routeStats) {
+    httpd_freeRoutes();
+    return false;
+  }
+  httpd_routeCount = routeCount;
+  httpd_routeNodeCount = 0;
+  httpd_newRouteNode("", 0, false);
+  for(int16_t i = 0; i < routeCount; i++) httpd_insertRoute(i);
+  LOGI("%d routes compiled to %d nodes", routeCount, httpd_routeNodeCount);
+  return true;
+}
+
+void httpd_addRouteMatches(int16_t i, HTTPMethod method, int16_t* matches, uint8_t &matchCount) {
+  for(; i != NOT_FOUND; i = httpd_routeNext[i]) {
+    if(httpd_routes[i].method != HTTP_ANY && httpd_routes[i].method != method) continue;
+    // Keep the matches in table order so they're tried in the same order as the table.
+    uint8_t m = matchCount;
+    if(m == HTTPD_MAX_ROUTE_MATCHES) {
+      if(matches[m - 1] < i) continue;
+      m--;
+    } else {
+      matchCount++;
+    }
+    for(; m > 0 && matches[m - 1] > i; m--) matches[m] = matches[m - 1];
+    matches[m] = i;
+  }
+}
+
+void httpd_matchRoutes(int16_t n, const char* uri, HTTPMethod method, int16_t* matches, uint8_t &matchCount) {
+  HttpRouteNode &node = httpd_routeNodes[n];
+  if(!(node.methods & httpd_methodBit(method))) return;
+  if(node.param) {
+    const char* end = uri;
+    while(*end && *end != '/' && *end != '?') end++;
+    if(end == uri) return;
+    uri = end;
+  } else {
+    if(strncmp(node.label, uri, node.lenLabel) != 0) return;
+    uri += node.lenLabel;
+  }
+  httpd_addRouteMatches(node.prefix, method, matches, matchCount);
+  if(*uri == '\0') httpd_addRouteMatches(node.exact, method, matches, matchCount);
+  for(int16_t c = node.child; c != NOT_FOUND; c = httpd_routeNodes[c].sibling) {
+    if(httpd_routeNodes[c].param || httpd_routeNodes[c].label[0] == *uri) httpd_matchRoutes(c, uri, method, matches, matchCount);
+  }
+}
 
-  // Zero the HTTP requests for good measure.
-  for(uint8_t r = 0; r < MAX_HTTP_CONNECTIONS; r++) {
-    memset(&httpd_requests[r], 0, sizeof(HttpRequest));
-    httpd_requests[r].method = HTTP_NONE; // Not really needed because HTTP_NONE = 0.
+// Fills in the request's PathParam's for the route about to be tried.
+void httpd_bindPathParams(HttpRequest &httpd_request, const char* pattern) {
+  httpd_request.paramCount = 0;
+  const char* uri = httpd_request.uri;
+  while(*pattern && !(*pattern == '*' && pattern[1] == '\0')) {
+    if(*pattern != ':') {
+      pattern++;
+      uri++;
+      continue;
+    }
+    const char* name = ++pattern;
+    while(!httpd_isParamEnd(*pattern)) pattern++;
+    const char* value = uri;
+    while(*uri && *uri != '/' && *uri != '?') uri++;
+    if(httpd_request.paramCount < HTTPD_MAX_PATH_PARAMS) {
+      PathParam &param = httpd_request.params[httpd_request.paramCount++];
+      param.name = name;
+      param.lenName = pattern - name;
+      param.value = value;
+      param.lenValue = uri - value;
+    }
   }
+}
+
+/********************************************************
+   Web Functions
+ ********************************************************/
+
+void httpd_init(HttpRoute* pHttpRoutes, int port, uint memBudget) {
+  LOGI("httpd_init...");
+
+  // Size the slot pool from the memory budget. Callers can pass a share of ESP.getFreeHeap()
+  // to scale the pool to the board; no budget gives DEFAULT_HTTP_CONNECTIONS slots.
+  uint slots = memBudget ? memBudget / HTTPD_SLOT_SIZE : DEFAULT_HTTP_CONNECTIONS;
+  if(slots < 1) slots = 1;
+  if(slots > MAX_HTTP_CONNECTIONS) slots = MAX_HTTP_CONNECTIONS;
 
   httpd_routes = pHttpRoutes;
+  if(!httpd_compileRoutes()) {
+    LOGE("Failed to compile routes; the web server is not started");
+    return;
+  }
+
+  // Value-initializing zeroes the HTTP requests, which leaves every slot as HTTP_NONE.
+  // The buffers each slot owns are carved from a single block.
+  httpd_requests = new (std::nothrow) HttpRequest[slots]();
+  char* buffers = (char*) malloc(slots * HTTPD_SLOT_BUFFERS);
+  if(!httpd_requests || !buffers) {
+    LOGE("Failed to allocate connection slots; the web server is not started");
+    delete[] httpd_requests;
+    httpd_requests = NULL;
+    free(buffers);
+    httpd_freeRoutes();
+    return;
+  }
+  httpd_slotCount = slots;
+  for(uint8_t r = 0; r < httpd_slotCount; r++) {
+    httpd_requests[r].head = buffers + r * HTTPD_SLOT_BUFFERS;
+    httpd_requests[r].txBuf = (uint8_t*) httpd_requests[r].head + HTTPD_HEAD_BUFFER_SIZE;
+    httpd_requests[r].arena = (char*) httpd_requests[r].txBuf + HTTPD_TX_BUFFER_SIZE;
+  }
+  for(uint8_t b = 0; b < HTTPD_PEER_BUCKETS; b++) httpd_peerBuckets[b] = NOT_FOUND;
+  LOGI("%d connection slots of %d bytes", httpd_slotCount, (int) HTTPD_SLOT_SIZE);
+  httpd_counters.heapLow = ESP.getFreeHeap();
+
+  // Mount the file system once, rather than for every file or chunk served.
+  httpd_fsMounted = SPIFFS.begin();
+  if(!httpd_fsMounted) LOGE("Failed to start SPIFFS");
+
+  os_timer_setfn(&httpd_retryTimer, httpd_retryTx, NULL);
+  os_timer_setfn(&httpd_closeTimer, httpd_closeConns, NULL);
 
-  espconn vEspconn;
-  esp_tcp espTcp;
   // Fill the connection structure, including "listen" port
-  vEspconn.type = ESPCONN_TCP;
-  vEspconn.state = ESPCONN_NONE;
-  vEspconn.proto.tcp = &espTcp;
-  vEspconn.proto.tcp->local_port = port;
-  vEspconn.recv_callback = NULL;
-  vEspconn.sent_callback = NULL;
+  httpd_espconn.type = ESPCONN_TCP;
+  httpd_espconn.state = ESPCONN_NONE;
+  httpd_espconn.proto.tcp = &httpd_espTcp;
+  httpd_espconn.proto.tcp->local_port = port;
+  httpd_espconn.recv_callback = NULL;
+  httpd_espconn.sent_callback = NULL;
+  httpd_espconn.reverse = NULL;
 
-  // Register the connection timeout(0=no timeout)
-  espconn_regist_time(&vEspconn, 5, 0);
+  // Register the connection timeout(0=no timeout). It closes idle keep-alive connections.
+  espconn_regist_time(&httpd_espconn, HTTPD_IDLE_TIMEOUT_S, 0);
 
   // Register connection callbacks
-  espconn_regist_connectcb(&vEspconn, httpd_connect);
-  espconn_regist_disconcb(&vEspconn, httpd_discon);
-  espconn_regist_reconcb(&vEspconn, httpd_recon);
-  espconn_regist_recvcb(&vEspconn, httpd_recv);
-  espconn_regist_sentcb(&vEspconn, httpd_sent);
-  espconn_regist_write_finish(&vEspconn, httpd_write_finish);
+  espconn_regist_connectcb(&httpd_espconn, httpd_connect);
+  espconn_regist_disconcb(&httpd_espconn, httpd_discon);
+  espconn_regist_reconcb(&httpd_espconn, httpd_recon);
+  espconn_regist_recvcb(&httpd_espconn, httpd_recv);
+  espconn_regist_sentcb(&httpd_espconn, httpd_sent);
+  espconn_regist_write_finish(&httpd_espconn, httpd_write_finish);
 
   // Start Listening for connections
-  espconn_accept(&vEspconn);
-  SPN("Web Server initialized");
+  espconn_accept(&httpd_espconn);
+
+  // Let the SDK accept as many connections as there are slots, and a few more to turn away with a
+  // 503 rather than leave unanswered.
+  uint8_t maxCon = httpd_slotCount + HTTPD_SPARE_CONNS;
+  if(espconn_tcp_get_max_con() < maxCon) espconn_tcp_set_max_con(maxCon);
+  espconn_tcp_set_max_con_allow(&httpd_espconn, maxCon);
+  LOGI("Web Server initialized");
+}
+
+uint8_t httpd_peerHash(const uint8_t* remote_ip, uint remote_port) {
+  uint32_t h = ((uint32_t) remote_ip[0] << 24 | remote_ip[1] << 16 | remote_ip[2] << 8 | remote_ip[3]) ^ remote_port;
+  return (h * 2654435761u) >> (32 - HTTPD_PEER_HASH_BITS);
+}
+
+void httpd_peerUnlink(uint8_t r) {
+  int8_t* pLink = &httpd_peerBuckets[httpd_peerHash(httpd_requests[r].remote_ip, httpd_requests[r].remote_port)];
+  while(*pLink != NOT_FOUND) {
+    if(*pLink == r) {
+      *pLink = httpd_requests[r].peerNext;
+      return;
+    }
+    pLink = &httpd_requests[*pLink].peerNext;
+  }
+}
+
+// Returns the slot to the pool, releasing anything it holds.
+void httpd_freeHttpReq(uint8_t r) {
+  if(httpd_requests[r].ws) httpd_wsEnd(httpd_requests[r]);
+  if(httpd_requests[r].sse) httpd_sseEnd(httpd_requests[r]);
+  if(httpd_requests[r].pEspconn) httpd_peerUnlink(r);
+  httpd_requests[r].pEspconn = NULL;
+  httpd_requests[r].method = HTTP_NONE;
+  // uri and auth point into the slot's head buffer, data and args into its arena.
+  httpd_requests[r].uri = NULL;
+  httpd_requests[r].auth = NULL;
+  httpd_requests[r].data = NULL;
+  httpd_requests[r].args = NULL;
+  httpd_requests[r].argCount = 0;
+  httpd_requests[r].argsParsed = 0;
+  httpd_requests[r].argIndex = NULL;
+  httpd_requests[r].argUnindexed = false;
+  httpd_requests[r].json = NULL;
+  httpd_requests[r].jsonCount = 0;
+  free(httpd_requests[r].rxPending);
+  httpd_requests[r].rxPending = NULL;
+  httpd_requests[r].lenRxPending = 0;
+  httpd_endResponse(httpd_requests[r]);
+  httpd_requests[r].arenaUsed = 0;
+}
+
+// Readies a bound slot for the next request on its connection.
+void httpd_nextRequest(uint8_t r) {
+  httpd_requests[r].method = HTTP_ANY;
+  httpd_requests[r].parseState = PARSE_METHOD;
+  httpd_requests[r].parseFlags = 0;
+  httpd_requests[r].lenHead = 0;
+  httpd_requests[r].headerCount = 0;
+  httpd_requests[r].uri = NULL;
+  httpd_requests[r].auth = NULL;
+  httpd_requests[r].lenData = 0;   // Size of incoming or outgoing data.
+  httpd_requests[r].lenSoFar = 0;  // Length of data received or sent so far.
+  // Everything the last request allocated goes at once.
+  httpd_requests[r].data = NULL;
+  httpd_requests[r].args = NULL;
+  httpd_requests[r].argCount = 0;
+  httpd_requests[r].argsParsed = 0;
+  httpd_requests[r].argIndex = NULL;
+  httpd_requests[r].argUnindexed = false;
+  httpd_requests[r].json = NULL;
+  httpd_requests[r].jsonCount = 0;
+  httpd_requests[r].arenaUsed = 0;
+  httpd_requests[r].paramCount = 0;
+  httpd_requests[r].rxBody = NULL;
+  httpd_requests[r].route = NOT_FOUND;
+  httpd_requests[r].status = 0;
+}
+
+// Disconnects the connections whose last response has gone. The SDK doesn't allow
+// espconn_disconnect() from within its callbacks, so this runs from a timer.
+void httpd_closeConns(void* arg) {
+  for(uint8_t r = 0; r < httpd_slotCount; r++) {
+    if(!(httpd_requests[r].txFlags & TX_CLOSE)) continue;
+    httpd_requests[r].txFlags &= ~TX_CLOSE;
+    LOGD("Closing connection %d", r);
+    // The slot is freed by the disconnect callback.
+    if(httpd_requests[r].pEspconn) espconn_disconnect(httpd_requests[r].pEspconn);
+  }
+  for(uint8_t c = 0; c < HTTPD_SPARE_CONNS; c++) {
+    if(!httpd_closing[c].pEspconn || httpd_closing[c].state != CLOSING_READY) continue;
+    httpd_closing[c].state = CLOSING_DISCONNECTED;
+    espconn_disconnect(httpd_closing[c].pEspconn);
+  }
+}
+
+// Finds a connection being closed without a slot by its remote ip:port, which is all the
+// disconnect callback has to go on.
+int8_t httpd_findClosing(espconn* pEspconn) {
+  for(uint8_t c = 0; c < HTTPD_SPARE_CONNS; c++) {
+    if(httpd_closing[c].pEspconn &&
+      httpd_closing[c].remote_port == pEspconn->proto.tcp->remote_port &&
+      memcmp(httpd_closing[c].remote_ip, pEspconn->proto.tcp->remote_ip, 4) == 0) return c;
+  }
+  return NOT_FOUND;
+}
+
+// Takes note of a connection to be closed without a slot. Returns false if there's no room to.
+bool httpd_addClosing(espconn* pEspconn, uint8_t state) {
+  for(uint8_t c = 0; c < HTTPD_SPARE_CONNS; c++) {
+    if(httpd_closing[c].pEspconn) continue;
+    httpd_closing[c].pEspconn = pEspconn;
+    memcpy(httpd_closing[c].remote_ip, pEspconn->proto.tcp->remote_ip, 4);
+    httpd_closing[c].remote_port = pEspconn->proto.tcp->remote_port;
+    httpd_closing[c].state = state;
+    if(state == CLOSING_READY) os_timer_arm(&httpd_closeTimer, 0, false);
+    return true;
+  }
+  LOGW("No room to close a connection");
+  return false;
 }
 
 int8_t httpd_findAvailHttpReq() {
   uint msNow = millis();
-  for(uint8_t r = 0; r < MAX_HTTP_CONNECTIONS; r++) {
+  for(uint8_t r = 0; r < httpd_slotCount; r++) {
     if(httpd_requests[r].method == HTTP_NONE) return r;
-    if(msNow - httpd_requests[r].msLast > CONNECTION_EXPIRE_MS) return r;
+  }
+  // No free slot, so reclaim one that has expired. Its connection's callbacks will no
+  // longer find it because the generation changes when it is bound again. A WebSocket or an event
+  // stream may well be quiet for longer, and has an idle timeout of its own.
+  for(uint8_t r = 0; r < httpd_slotCount; r++) {
+    if(httpd_requests[r].method >= HTTP_WEBSOCKET) continue;
+    if(msNow - httpd_requests[r].msLast > CONNECTION_EXPIRE_MS) {
+      LOGD("Reclaiming expired connection %d", r);
+      httpd_freeHttpReq(r);
+      return r;
+    }
   }
   return NOT_FOUND;
 }
 
+// Closes the least recently active idle keep-alive connection, of the client at remote_ip or of
+// any client if it's NULL, to make room for a new connection. Returns the slot it had, now free,
+// or NOT_FOUND if there's no such connection. A connection is idle once its last response has
+// been acknowledged and nothing of the next request has arrived.
+int8_t httpd_evictIdle(const uint8_t* remote_ip) {
+  uint msNow = millis();
+  int8_t lru = NOT_FOUND;
+  for(uint8_t r = 0; r < httpd_slotCount; r++) {
+    HttpRequest &httpd_request = httpd_requests[r];
+    if(httpd_request.method != HTTP_ANY || !httpd_request.requestCount || httpd_request.lenHead ||
+      httpd_request.txInFlight || httpd_request.txPos != httpd_request.txLen || httpd_request.lenRxPending) continue;
+    if(remote_ip && memcmp(httpd_request.remote_ip, remote_ip, 4) != 0) continue;
+    if(lru == NOT_FOUND || msNow - httpd_request.msLast > msNow - httpd_requests[lru].msLast) lru = r;
+  }
+  if(lru == NOT_FOUND || !httpd_addClosing(httpd_requests[lru].pEspconn, CLOSING_READY)) return NOT_FOUND;
+  LOGD("Evicting idle connection %d", lru);
+  httpd_freeHttpReq(lru);
+  httpd_counters.evicted++;
+  return lru;
+}
+
+// Finds a slot for a new connection, or returns NOT_FOUND if it's to be turned away. A client that
+// already has its share of the slots only gets one in place of an idle connection of its own.
+int8_t httpd_admit(espconn* pEspconn) {
+  const uint8_t* remote_ip = pEspconn->proto.tcp->remote_ip;
+  uint8_t held = 0;
+  for(uint8_t r = 0; r < httpd_slotCount; r++) {
+    if(httpd_requests[r].method != HTTP_NONE && memcmp(httpd_requests[r].remote_ip, remote_ip, 4) == 0) held++;
+  }
+  uint8_t share = httpd_slotCount > 1 ? httpd_slotCount - 1 : 1;
+  if(share > HTTPD_MAX_CONNS_PER_CLIENT) share = HTTPD_MAX_CONNS_PER_CLIENT;
+  if(held >= share) {
+    int8_t r = httpd_evictIdle(remote_ip);
+    if(r == NOT_FOUND) {
+      LOGW("%d.%d.%d.%d has %d connections", remote_ip[0], remote_ip[1], remote_ip[2], remote_ip[3], held);
+      httpd_counters.clientLimited++;
+    }
+    return r;
+  }
+  int8_t r = httpd_findAvailHttpReq();
+  if(r == NOT_FOUND) r = httpd_evictIdle(NULL);
+  if(r == NOT_FOUND) {
+    LOGE("No connection recs avail");
+    httpd_counters.rejected++;
+  }
+  return r;
+}
+
+// Answers a connection that has been turned away with a 503, and closes it once that has gone.
+void httpd_reject(espconn* pEspconn) {
+  if(!httpd_addClosing(pEspconn, CLOSING_SENDING)) return;
+  if(espconn_send(pEspconn, (uint8_t*) httpd_busy, sizeof(httpd_busy) - 1) == ESPCONN_OK) {
+    httpd_counters.bytesOut += sizeof(httpd_busy) - 1;
+  } else {
+    httpd_closing[httpd_findClosing(pEspconn)].state = CLOSING_READY;
+    os_timer_arm(&httpd_closeTimer, 0, false);
+  }
+}
+
 void httpd_connect(void* arg) {
-  SPN("\n*** httpd_connected");
+  LOGD("*** httpd_connected");
   espconn* pEspconn = (espconn*) arg;
   httpd_dumpEspconn(pEspconn);
 
-  espconn_set_opt(pEspconn, ESPCONN_REUSEADDR);
-  int8_t r = httpd_findAvailHttpReq();
+  // ESPCONN_COPY lets the SDK accept more data before the previous send is acknowledged,
+  // which is what allows HTTPD_TX_WINDOW segments in flight.
+  espconn_set_opt(pEspconn, HTTPD_TX_WINDOW > 1 ? ESPCONN_REUSEADDR | ESPCONN_COPY : ESPCONN_REUSEADDR);
+  pEspconn->reverse = NULL;
+  int8_t r = httpd_admit(pEspconn);
   if(r == NOT_FOUND) {
-    SPN("No connection recs avail");
-    // status = STATUS_ERR;
+    httpd_reject(pEspconn);
     return;
   }
-  SPF("Using connection %d at %p\n", r, &httpd_requests[r]);
+  LOGD("Using connection %d at %p", r, &httpd_requests[r]);
+  // Bind the slot and the connection to each other.
+  httpd_requests[r].gen = (httpd_requests[r].gen + 1) & HTTPD_GEN_MASK;
+  httpd_requests[r].pEspconn = pEspconn;
+  pEspconn->reverse = (void*) (((uintptr_t) httpd_requests[r].gen << HTTPD_TAG_SLOT_BITS) | (r + 1));
   memcpy(httpd_requests[r].remote_ip, pEspconn->proto.tcp->remote_ip, 4);
   httpd_requests[r].remote_port = pEspconn->proto.tcp->remote_port;
-  httpd_requests[r].method = HTTP_ANY;
+  uint8_t b = httpd_peerHash(httpd_requests[r].remote_ip, httpd_requests[r].remote_port);
+  httpd_requests[r].peerNext = httpd_peerBuckets[b];
+  httpd_peerBuckets[b] = r;
   httpd_requests[r].msLast = millis();
-  httpd_requests[r].uri = NULL;
-  httpd_requests[r].auth = NULL;
-  httpd_requests[r].lenData = 0;   // Size of incoming or outgoing data.
-  httpd_requests[r].lenSoFar = 0;  // Length of data received or sent so far.
-  httpd_requests[r].data = NULL;
-  httpd_requests[r].argCount = 0;
-  // httpd_requests[r].args = (void *) NULL;
+  httpd_requests[r].requestCount = 0;
+  httpd_requests[r].txInFlight = 0;
+  httpd_nextRequest(r);
+
+  httpd_counters.connections++;
+  uint8_t inUse = 0;
+  for(uint8_t i = 0; i < httpd_slotCount; i++) {
+    if(httpd_requests[i].method != HTTP_NONE) inUse++;
+  }
+  if(inUse > httpd_counters.slotsPeak) httpd_counters.slotsPeak = inUse;
+  httpd_metricsHeap();
 }
 
 int8_t httpd_findHttpReq(espconn* pEspconn) {
-  for(uint8_t r = 0; r < MAX_HTTP_CONNECTIONS; r++) {
+  // The connection's reverse pointer leads straight to its slot, as long as the slot
+  // is still bound to this connection and hasn't been reused since.
+  uintptr_t tag = (uintptr_t) pEspconn->reverse;
+  if(tag) {
+    uint8_t r = (tag & HTTPD_TAG_SLOT_MASK) - 1;
+    if(r < httpd_slotCount &&
+      httpd_requests[r].pEspconn == pEspconn &&
+      httpd_requests[r].gen == (tag >> HTTPD_TAG_SLOT_BITS)) return r;
+    return NOT_FOUND;
+  }
+  // The SDK calls the disconnect and reconnect callbacks with the listening espconn, holding
+  // the remote ip:port of the connection concerned, so those are looked up by address.
+  int8_t r = httpd_peerBuckets[httpd_peerHash(pEspconn->proto.tcp->remote_ip, pEspconn->proto.tcp->remote_port)];
+  while(r != NOT_FOUND) {
     if(httpd_requests[r].remote_port == pEspconn->proto.tcp->remote_port &&
-      httpd_requests[r].remote_ip[0] == pEspconn->proto.tcp->remote_ip[0] &&
-      httpd_requests[r].remote_ip[1] == pEspconn->proto.tcp->remote_ip[1] &&
-      httpd_requests[r].remote_ip[2] == pEspconn->proto.tcp->remote_ip[2] &&
-      httpd_requests[r].remote_ip[3] == pEspconn->proto.tcp->remote_ip[3]) return r;
+      memcmp(httpd_requests[r].remote_ip, pEspconn->proto.tcp->remote_ip, 4) == 0) return r;
+    r = httpd_requests[r].peerNext;
   }
   return NOT_FOUND;
 }
 
 void httpd_discon(void* arg) {
-  SPN("\n*** httpd_disconnected");
+  LOGD("*** httpd_disconnected");
   espconn* pEspconn = (espconn*) arg;
   httpd_dumpEspconn(pEspconn);
 
   int8_t r = httpd_findHttpReq(pEspconn);
   if(r == NOT_FOUND) {
-    SPN("Connection rec not found");
+    int8_t c = httpd_findClosing(pEspconn);
+    if(c != NOT_FOUND) {
+      httpd_closing[c].pEspconn = NULL;
+      return;
+    }
+    LOGE("Connection rec not found");
     // status = STATUS_ERR;
     return;
   }
-  SPF("Freeing connection %d\n", r);
-  httpd_requests[r].method = HTTP_NONE;
-  free(httpd_requests[r].uri);
-  httpd_requests[r].uri = NULL;
-  free(httpd_requests[r].data);
-  httpd_requests[r].data = NULL;
-  if(httpd_requests[r].argCount > 0) {
-    free(httpd_requests[r].args);
-    httpd_requests[r].argCount = 0;
-  }
+  LOGD("Freeing connection %d", r);
+  httpd_freeHttpReq(r);
   httpd_dumpHttpReq(httpd_requests[r]);
 }
 
 void httpd_recon(void* arg, int8_t err) {
-  SPN("\n*** httpd_recon");
+  LOGD("*** httpd_recon");
   espconn* pEspconn = (espconn*) arg;
   httpd_dumpEspconn(pEspconn);
+  // A connection being closed without a slot that fails instead gets no disconnect callback.
+  int8_t c = httpd_findClosing(pEspconn);
+  if(c != NOT_FOUND) httpd_closing[c].pEspconn = NULL;
 }
 
-void httpd_recv(void* arg, char* pData, unsigned short len) {
-  SPN("\n*** httpd_recv");
-  espconn* pEspconn = (espconn*) arg;
-  httpd_dumpEspconn(pEspconn);
+HTTPMethod httpd_parseMethod(const char* method, uint8_t len) {
+  // The length narrows it down to one or two candidates, so each method costs at most two compares.
+  switch(len) {
+  case 3:
+    if(memcmp(method, "GET", 3) == 0) return HTTP_GET;
+    if(memcmp(method, "PUT", 3) == 0) return HTTP_PUT;
+    break;
+  case 4:
+    if(memcmp(method, "POST", 4) == 0) return HTTP_POST;
+    break;
+  case 5:
+    if(memcmp(method, "PATCH", 5) == 0) return HTTP_PATCH;
+    break;
+  case 6:
+    if(memcmp(method, "DELETE", 6) == 0) return HTTP_DELETE;
+    break;
+  }
+  return HTTP_NONE;
+}
 
-  int8_t r = httpd_findHttpReq(pEspconn);
-  if(r == NOT_FOUND) {
-    SPN("Connection rec not found");
-    // status = STATUS_ERR;
-    return;
+uint8_t httpd_headerId(const char* name, uint8_t len) {
+  switch(len) {
+  case 6:
+    if(strcasecmp(name, "Expect") == 0) return HDR_EXPECT;
+    break;
+  case 10:
+    if(strcasecmp(name, "Connection") == 0) return HDR_CONNECTION;
+    break;
+  case 13:
+    if(strcasecmp(name, "Authorization") == 0) return HDR_AUTHORIZATION;
+    break;
+  case 14:
+    if(strcasecmp(name, "Content-Length") == 0) return HDR_CONTENT_LENGTH;
+    break;
   }
-  SPF("Using connection %d\n", r);
+  return HDR_OTHER;
+}
 
-  if(httpd_requests[r].method == HTTP_ANY) {  // This is the first recv for this connection so this is assumed to be the header.
-    // First line of the header is assumed to have the following format:
-    // METHOD <space> URI <space> HTTP...
-    // We look for the two spaces first.
-    char* space1 = strchr(pData, ' ');
-    if(!space1) {
-      SPN("Invalid request 1");
-      return;
+void httpd_parseFail(HttpRequest &httpd_request, uint16_t responseCode) {
+  LOGW("Invalid request: %d", responseCode);
+  httpd_request.parseState = PARSE_ERROR;
+  httpd_request.parseError = responseCode;
+}
+
+// Feeds request header bytes to the parser. The parser's state is kept in the HttpRequest so
+// it picks up where it left off when the next segment arrives. Returns the number of bytes
+// consumed; anything after the end of the header is the start of the body.
+uint httpd_parseHead(HttpRequest &httpd_request, const char* pData, uint len) {
+  char* head = httpd_request.head;
+  uint i = 0;
+  while(i < len && httpd_request.parseState < PARSE_BODY) {
+    char c = pData[i++];
+    switch(httpd_request.parseState) {
+    case PARSE_METHOD:
+      if(c == ' ') {
+        HTTPMethod method = httpd_parseMethod(head, httpd_request.lenHead);
+        if(method == HTTP_NONE) {
+          httpd_parseFail(httpd_request, 501);
+          break;
+        }
+        httpd_request.method = method;
+        httpd_request.lenHead = 0;
+        httpd_request.uri = head;
+        httpd_request.parseState = PARSE_URI;
+      } else if(c == '\r' || c == '\n') {
+        // Stray line breaks ahead of the request line are ignored.
+        if(httpd_request.lenHead) httpd_parseFail(httpd_request, 400);
+      } else if(httpd_request.lenHead < 7) {
+        head[httpd_request.lenHead++] = c;
+      } else {
+        httpd_parseFail(httpd_request, 501);
+      }
+      break;
+    case PARSE_URI:
+      if(c == ' ') {
+        head[httpd_request.lenHead++] = '\0';
+        httpd_request.headersAt = httpd_request.lenHead;
+        httpd_request.parsePos = 0;
+        httpd_request.parseState = PARSE_VERSION;
+      } else if(c == '\r' || c == '\n') {
+        httpd_parseFail(httpd_request, 400);
+      } else if(httpd_request.lenHead < HTTPD_HEAD_BUFFER_SIZE - 1) {
+        head[httpd_request.lenHead++] = c;
+      } else {
+        httpd_parseFail(httpd_request, 414);
+      }
+      break;
+    case PARSE_VERSION:
+      // The version isn't stored, just checked against "HTTP/1.x" as it goes by.
+      if(c == '\r') break;
+      if(c == '\n') {
+        if(httpd_request.parsePos != 8) {
+          httpd_parseFail(httpd_request, 400);
+          break;
+        }
+        httpd_request.lineStart = httpd_request.lenHead;
+        httpd_request.parseState = PARSE_NAME;
+      } else if(httpd_request.parsePos < 7 && c == "HTTP/1."[httpd_request.parsePos]) {
+        httpd_request.parsePos++;
+      } else if(httpd_request.parsePos == 7 && c >= '0' && c <= '9') {
+        httpd_request.httpVersion = 10 + c - '0';
+        httpd_request.parsePos++;
+      } else {
+        httpd_parseFail(httpd_request, 400);
+      }
+      break;
+    case PARSE_NAME:
+      if(c == '\r') break;
+      if(c == '\n') {
+        if(httpd_request.lenHead != httpd_request.lineStart || httpd_request.parseFlags & PARSE_DROP_LINE) {
+          httpd_parseFail(httpd_request, 400);  // A header line without a colon.
+          break;
+        }
+        // An empty line ends the header.
+        httpd_request.parseState = PARSE_BODY;
+      } else if(c == ':') {
+        uint8_t lenName = httpd_request.lenHead - httpd_request.lineStart;
+        if(httpd_request.parseFlags & PARSE_DROP_LINE) {
+          httpd_request.headerId = HDR_OTHER;
+        } else {
+          head[httpd_request.lenHead++] = '\0';
+          httpd_request.headerId = httpd_headerId(head + httpd_request.lineStart, lenName);
+          if(httpd_request.headerId == HDR_CONTENT_LENGTH) {
+            httpd_request.lenData = 0;
+            httpd_request.parseFlags &= ~(PARSE_LENGTH_DIGITS | PARSE_LENGTH_END);
+          }
+        }
+        httpd_request.parsePos = httpd_request.lenHead;
+        httpd_request.parseState = PARSE_VALUE;
+      } else if(!(httpd_request.parseFlags & PARSE_DROP_LINE)) {
+        // Leave room for the name's and the value's terminators.
+        if(httpd_request.lenHead < HTTPD_HEAD_BUFFER_SIZE - 2) head[httpd_request.lenHead++] = c;
+        else httpd_request.parseFlags |= PARSE_DROP_LINE;
+      }
+      break;
+    case PARSE_VALUE:
+      if(c == '\r') break;
+      if(c == '\n') {
+        if(httpd_request.headerId == HDR_CONTENT_LENGTH && !(httpd_request.parseFlags & PARSE_LENGTH_DIGITS)) {
+          httpd_parseFail(httpd_request, 400);  // An empty Content-Length.
+          break;
+        }
+        if(httpd_request.parseFlags & PARSE_DROP_LINE) {
+          LOGW("Dropped a header that didn't fit");
+          httpd_request.lenHead = httpd_request.lineStart;
+          httpd_request.parseFlags &= ~PARSE_DROP_LINE;
+        } else {
+          // Trim trailing whitespace and terminate the value.
+          while(httpd_request.lenHead > httpd_request.parsePos &&
+            (head[httpd_request.lenHead - 1] == ' ' || head[httpd_request.lenHead - 1] == '\t')) httpd_request.lenHead--;
+          head[httpd_request.lenHead++] = '\0';
+          if(httpd_request.headerId == HDR_AUTHORIZATION) httpd_request.auth = head + httpd_request.parsePos;
+          if(httpd_request.headerId == HDR_CONNECTION) {
+            if(httpd_hasToken(head + httpd_request.parsePos, "close")) httpd_request.parseFlags |= PARSE_CONN_CLOSE;
+            if(httpd_hasToken(head + httpd_request.parsePos, "keep-alive")) httpd_request.parseFlags |= PARSE_CONN_KEEP_ALIVE;
+          }
+          if(httpd_request.headerId == HDR_EXPECT && strcasecmp(head + httpd_request.parsePos, "100-continue") == 0) {
+            httpd_request.parseFlags |= PARSE_EXPECT_CONTINUE;
+          }
+        }
+        httpd_request.lineStart = httpd_request.lenHead;
+        httpd_request.parseState = PARSE_NAME;
+        break;
+      }
+      // Skip leading whitespace.
+      if((c == ' ' || c == '\t') && httpd_request.lenHead == httpd_request.parsePos) break;
+      // Content-Length is accumulated as it arrives, so it survives even if the line is dropped.
+      // Whitespace after the digits is trimmed with the line.
+      if(httpd_request.headerId == HDR_CONTENT_LENGTH && (c == ' ' || c == '\t')) {
+        httpd_request.parseFlags |= PARSE_LENGTH_END;
+      } else if(httpd_request.headerId == HDR_CONTENT_LENGTH) {
+        if(c < '0' || c > '9' || httpd_request.parseFlags & PARSE_LENGTH_END) {
+          httpd_parseFail(httpd_request, 400);
+          break;
+        }
+        // A length that doesn't fit would wrap, and the rest of the body be read as the next request.
+        if(httpd_request.lenData > (UINT32_MAX - (c - '0')) / 10) {
+          httpd_parseFail(httpd_request, 413);
+          break;
+        }
+        httpd_request.lenData = httpd_request.lenData * 10 + c - '0';
+        httpd_request.parseFlags |= PARSE_LENGTH_DIGITS;
+      }
+      if(!(httpd_request.parseFlags & PARSE_DROP_LINE)) {
+        if(httpd_request.lenHead < HTTPD_HEAD_BUFFER_SIZE - 1) head[httpd_request.lenHead++] = c;
+        else httpd_request.parseFlags |= PARSE_DROP_LINE;
+      }
+      break;
+    default:
+      break;
     }
-    char* space2 = strchr(space1 + 1, ' ');
-    if(!space2) {
-      SPN("Invalid request 2");
+  }
+  return i;
+}
+
+// Decides, once the header is in, where the request body is to go: to the first matching route's
+// BodyFunc if it has one, otherwise into data, which is sized from Content-Length. A body that can't
+// be taken fails the request with a 413. It happens before a client that sent Expect: 100-continue
+// has sent the body, so the client is told to go ahead or not to bother.
+void httpd_startBody(HttpRequest &httpd_request) {
+  int16_t matches[HTTPD_MAX_ROUTE_MATCHES];
+  uint8_t matchCount = 0;
+  httpd_matchRoutes(0, httpd_request.uri, httpd_request.method, matches, matchCount);
+  if(matchCount && httpd_routes[matches[0]].bodyFunc) {
+    LOGD("Body goes to route %d", matches[0]);
+    httpd_request.route = matches[0];
+    httpd_bindPathParams(httpd_request, httpd_routes[matches[0]].uri);
+    httpd_request.rxBody = httpd_routes[matches[0]].bodyFunc;
+    httpd_request.rxBodyArg = httpd_routes[matches[0]].handlerArg;
+  } else {
+    httpd_request.data = (char*) httpd_arenaAlloc(httpd_request, httpd_request.lenData + 1);
+    if(!httpd_request.data) {
+      httpd_parseFail(httpd_request, 413);
       return;
     }
-    // Compare the start of the string to the available methods.
-    if(strncmp("GET", pData, 3) == 0) httpd_requests[r].method = HTTP_GET;
-    else if(strncmp(pData, "POST", 4) == 0) httpd_requests[r].method = HTTP_POST;
-    else if(strncmp(pData, "PUT", 3) == 0) httpd_requests[r].method = HTTP_PUT;
-    else if(strncmp(pData, "PATCH", 5) == 0) httpd_requests[r].method = HTTP_PATCH;
-    else if(strncmp(pData, "DELETE", 6) == 0) httpd_requests[r].method = HTTP_DELETE;
-    else {
-      SPN("Invalid method");
-      return;
+    httpd_request.data[0] = '\0';
+  }
+  // HTTP/1.0 clients don't know about interim responses.
+  if((httpd_request.parseFlags & PARSE_EXPECT_CONTINUE) && httpd_request.httpVersion >= 11) {
+    // Nothing else is being sent while a request is being read, so this can go straight out.
+    if(espconn_send(httpd_request.pEspconn, (uint8_t*) httpd_continue, sizeof(httpd_continue) - 1) == ESPCONN_OK) {
+      httpd_request.txInFlight++;
+    } else {
+      LOGE("Failed to send 100 Continue");  // The client sends the body anyway after a while.
     }
+  }
+}
+
+// Appends a segment of the request body to the request's data buffer.
+void httpd_recvBody(HttpRequest &httpd_request, const char* pData, uint len) {
+  memcpy(httpd_request.data + httpd_request.lenSoFar, pData, len);
+  httpd_request.lenSoFar += len;
+  httpd_request.data[httpd_request.lenSoFar] = '\0';
+}
+
+// Keeps data that arrived while the previous response was still being sent, and stops the SDK
+// delivering any more until it has been dealt with.
+void httpd_holdRecv(uint8_t r, const char* pData, uint len) {
+  HttpRequest &httpd_request = httpd_requests[r];
+  char* newPtr = NULL;
+  if(httpd_request.lenRxPending + len <= 0xFFFF) {
+    newPtr = (char*) realloc(httpd_request.rxPending, httpd_request.lenRxPending + len);
+  }
+  if(!newPtr) {
+    LOGW("Failed to hold pipelined data");
+    // Close the connection after the response rather than lose part of a request.
+    httpd_request.keepAlive = false;
+    return;
+  }
+  httpd_request.rxPending = newPtr;
+  memcpy(newPtr + httpd_request.lenRxPending, pData, len);
+  httpd_request.lenRxPending += len;
+  espconn_recv_hold(httpd_request.pEspconn);
+  LOGD("Holding %d bytes until the response has gone", httpd_request.lenRxPending);
+}
 
-    // Allocate memory for the URI and associate it with the HTTP request.
-    httpd_requests[r].uri = (char*) malloc(space2 - space1);
-    if(!httpd_requests[r].uri) {
-      SPN("Failed to malloc");
+// Feeds data received on a connection to the request being read in its slot. Data beyond the
+// end of the request is held until the response to it has gone.
+void httpd_feed(uint8_t r, const char* pData, uint len) {
+  HttpRequest &httpd_request = httpd_requests[r];
+  if(httpd_request.method == HTTP_WEBSOCKET) {
+    httpd_wsFeed(httpd_request, pData, len);
+    return;
+  }
+  // An event stream goes one way; anything the client sends is ignored.
+  if(httpd_request.method == HTTP_EVENTS) return;
+  if(httpd_request.parseState >= PARSE_DONE) {
+    // The connection closes after the response if keepAlive is clear, so anything more is dropped.
+    if(httpd_request.keepAlive) httpd_holdRecv(r, pData, len);
+    return;
+  }
+  if(httpd_request.parseState == PARSE_METHOD && httpd_request.lenHead == 0) httpd_request.msStart = millis();
+
+  uint used = 0;
+  if(httpd_request.parseState < PARSE_BODY) {
+    used = httpd_parseHead(httpd_request, pData, len);
+    if(httpd_request.parseState == PARSE_BODY && httpd_request.lenData) httpd_startBody(httpd_request);
+    if(httpd_request.parseState == PARSE_ERROR) {
+      // There's no telling where the next request would start, so the connection is closed.
+      httpd_request.keepAlive = false;
+      httpd_request.parseState = PARSE_DONE;
+      httpd_send(httpd_request.pEspconn, httpd_request.parseError);
       return;
     }
-    // Copy the URI to the HTTP request.
-    memcpy(httpd_requests[r].uri, space1 + 1, space2 - space1 - 1);
-    httpd_requests[r].uri[space2 - space1 - 1] = '\0';
-    SPF("uri:%s<\n", httpd_requests[r].uri);
-
-    // Loop through the remainder of the header, line by line,
-    // looking for headers of interest.
-    char* ptrFrom = strstr(space2 + 2, "\r\n");
-    char* ptrTo;
-    while(ptrTo = strstr(ptrFrom, "\r\n")) {
-      // SPF("ptrFrom: %d ptrTo: %d\n", ptrFrom, ptrTo);
-      if(strncmp("Content-Length:", ptrFrom, 15) == 0) {
-        SPF("Content-Length: %s\n", ptrFrom + 15);
-        httpd_requests[r].lenData = atoi(ptrFrom + 15);
-        SPF("lenData: %d\n", httpd_requests[r].lenData);
-      } else if(strncmp("Authorization: ", ptrFrom, 15) == 0) {
-        // Assuming there is a space after the :.
-        httpd_requests[r].auth = (char*) malloc(ptrTo - ptrFrom - 15 + 1);
-        if(!httpd_requests[r].auth) {
-          SPN("Failed to malloc");
-          return;
-        }
-        // Copy the auth string to the HTTP request.
-        memcpy(httpd_requests[r].auth, ptrFrom + 15, ptrTo - ptrFrom - 15);
-        httpd_requests[r].auth[ptrTo - ptrFrom - 15] = '\0';
-        SPF("auth:%s<\n", httpd_requests[r].auth);
-      }
-      ptrFrom = ptrTo + 2;
-    }
-  } else {
-    // This is not the first chunk so we assume it is data, either the initial data
-    // or a continuation of the data.
-    if(httpd_requests[r].data) {
-      // More data - append it to the data buffer.
-      char* newPtr = (char*) realloc(httpd_requests[r].data, httpd_requests[r].lenSoFar + len + 1);
-      if(!newPtr) {
-        SPN("Failed to realloc");
-        return;
-      }
-      memcpy(newPtr + httpd_requests[r].lenSoFar, pData, len);
-      httpd_requests[r].data = newPtr;
-      httpd_requests[r].lenSoFar += len;
-      httpd_requests[r].data[httpd_requests[r].lenSoFar] = '\0';
-    } else {
-      // Initial data - copy it to the data buffer.
-      char* newPtr = (char*) malloc(len + 1);
-      if(!newPtr) {
-        SPN("Failed to malloc");
-        return;
-      }
-      strcpy(newPtr, pData);
-      httpd_requests[r].data = newPtr;
-      httpd_requests[r].lenSoFar = len;
-      httpd_requests[r].data[len] = '\0';
+    // Wait for the rest of the header.
+    if(httpd_request.parseState != PARSE_BODY) return;
+    LOGD("uri:%s< version: %d", httpd_request.uri, httpd_request.httpVersion);
+    // HTTP/1.1 connections persist unless the client says otherwise, HTTP/1.0 ones only if it asks.
+    if(httpd_request.httpVersion >= 11) httpd_request.keepAlive = !(httpd_request.parseFlags & PARSE_CONN_CLOSE);
+    else httpd_request.keepAlive = httpd_request.parseFlags & PARSE_CONN_KEEP_ALIVE;
+    if(++httpd_request.requestCount >= HTTPD_KEEPALIVE_MAX_REQUESTS) httpd_request.keepAlive = false;
+  }
+
+  // Whatever follows the header is data, either the initial data or a continuation of the data.
+  uint lenBody = len - used;
+  if(lenBody > httpd_request.lenData - httpd_request.lenSoFar) lenBody = httpd_request.lenData - httpd_request.lenSoFar;
+  if(lenBody && httpd_request.rxBody) {
+    httpd_request.parseError = 500;
+    if(!httpd_request.rxBody(httpd_request, pData + used, lenBody, httpd_request.rxBodyArg)) {
+      LOGW("Body refused");
+      // The rest of the body would be taken for the next request, so the connection is closed.
+      httpd_request.keepAlive = false;
+      httpd_request.parseState = PARSE_DONE;
+      httpd_send(httpd_request.pEspconn, httpd_request.parseError);
+      return;
     }
+    httpd_request.lenSoFar += lenBody;
+  } else if(lenBody) {
+    httpd_recvBody(httpd_request, pData + used, lenBody);
   }
+  used += lenBody;
 
-  httpd_dumpHttpReq(httpd_requests[r]);
+  httpd_dumpHttpReq(httpd_request);
 
-  if(httpd_requests[r].lenSoFar == httpd_requests[r].lenData) {
+  if(httpd_request.lenSoFar == httpd_request.lenData) {
     // All the data has been received.
-    SPN("All the data has been received");
+    LOGD("All the data has been received");
+    httpd_request.parseState = PARSE_DONE;
 
     // Call the httpd_router
-    httpd_router(pEspconn, httpd_requests[r]);
+    httpd_router(httpd_request.pEspconn, httpd_request);
+
+    // Anything left over is the start of the next request.
+    if(used < len) httpd_feed(r, pData + used, len - used);
+  }
+}
+
+void httpd_recv(void* arg, char* pData, unsigned short len) {
+  LOGD("*** httpd_recv");
+  espconn* pEspconn = (espconn*) arg;
+  httpd_dumpEspconn(pEspconn);
+
+  int8_t r = httpd_findHttpReq(pEspconn);
+  if(r == NOT_FOUND) {
+    LOGE("Connection rec not found");
+    // status = STATUS_ERR;
+    return;
+  }
+  LOGD("Using connection %d", r);
+  httpd_requests[r].msLast = millis();
+  httpd_counters.bytesIn += len;
+  httpd_metricsHeap();
+  httpd_feed(r, pData, len);
+}
+
+// Called when the response to a request has gone. The connection is either readied for the next
+// request, starting with any that have already arrived, or closed.
+void httpd_responseDone(uint8_t r) {
+  HttpRequest &httpd_request = httpd_requests[r];
+  httpd_metricsRecord(httpd_request);
+  if(!httpd_request.keepAlive) {
+    httpd_request.txFlags |= TX_CLOSE;
+    os_timer_arm(&httpd_closeTimer, 0, false);
+    return;
   }
+  httpd_nextRequest(r);
+  char* pending = httpd_request.rxPending;
+  if(!pending) return;
+  httpd_request.rxPending = NULL;
+  uint lenPending = httpd_request.lenRxPending;
+  httpd_request.lenRxPending = 0;
+  httpd_feed(r, pending, lenPending);
+  free(pending);
+  // Carry on receiving unless the next response is already holding more back.
+  if(!httpd_request.rxPending && httpd_request.pEspconn) espconn_recv_unhold(httpd_request.pEspconn);
 }
 
 void httpd_sent(void* arg) {
-  SPN("\n*** httpd_sent");
+  LOGD("*** httpd_sent");
   espconn* pEspconn = (espconn*) arg;
   httpd_dumpEspconn(pEspconn);
 
   int8_t r = httpd_findHttpReq(pEspconn);
   if(r == NOT_FOUND) {
-    SPN("Connection rec not found");
+    // A 503 has gone, so the connection it turned away can be closed.
+    int8_t c = httpd_findClosing(pEspconn);
+    if(c != NOT_FOUND) {
+      if(httpd_closing[c].state == CLOSING_SENDING) httpd_closing[c].state = CLOSING_READY;
+      os_timer_arm(&httpd_closeTimer, 0, false);
+      return;
+    }
+    LOGE("Connection rec not found");
     // status = STATUS_ERR;
     return;
   }
-  SPF("Using connection %d\n", r);
+  LOGD("Using connection %d", r);
+  httpd_requests[r].msLast = millis();
 
+  // A segment has been acknowledged, so there's room in the window for another.
+  if(httpd_requests[r].txInFlight) httpd_requests[r].txInFlight--;
   if(httpd_requests[r].method == HTTP_SENDING) {
-    if(httpd_requests[r].lenSoFar < httpd_requests[r].lenData) {
-       // There is more data to send so we assume it is a file and return control to the httpd_fileHandler
-       // to pick up where it left off.
-      httpd_fileHandler(pEspconn, httpd_requests[r], NULL);
-    } else {
-      // All data has been sent so we set the method to HTTP_NONE, effectively returning the
-      // httpd_requests to the pool.
-      httpd_requests[r].method = HTTP_NONE;
+    httpd_flush(httpd_requests[r]);
+    if(httpd_txDone(httpd_requests[r])) {
+      LOGD("Response sent");
+      httpd_responseDone(r);
     }
+  } else if(httpd_requests[r].method == HTTP_WEBSOCKET) {
+    httpd_wsSent(httpd_requests[r]);
+  } else if(httpd_requests[r].method == HTTP_EVENTS) {
+    httpd_sseSent(httpd_requests[r]);
   }
 }
 
-// The purpose of this callback is unclear.
-// I have not seen it called in all of my testing.
+// Called when the SDK has moved data sent with ESPCONN_COPY on to TCP, freeing room in its buffer.
 void httpd_write_finish(void* arg) {
-  SPN("\n*** httpd_write_finish");
+  LOGD("*** httpd_write_finish");
   espconn* pEspconn = (espconn*) arg;
-  httpd_dumpEspconn(pEspconn);
+
+  int8_t r = httpd_findHttpReq(pEspconn);
+  if(r == NOT_FOUND) return;
+  if(httpd_requests[r].txFlags & TX_RETRY) httpd_flush(httpd_requests[r]);
 }
 
 /********************************************************
    Send-related functions
  ********************************************************/
 
-void httpd_router(espconn* pEspconn, HttpRequest &httpd_request) {
-  SPN("\n*** httpd_router");
-  httpd_dumpEspconn(pEspconn);
+// Response headers are built by appending to a buffer with the httpd_head functions below. Each
+// returns the new end of the header, so they chain without sprintf or strlen. The caller makes
+// sure there's room; a header always fits in the outbound queue.
 
-  int8_t i = 0;
-  //Look up URI in the routing table.
-  while(httpd_routes[i].method != HTTP_NONE) {
-    // Is this route the correct method?
-    if(httpd_routes[i].method == HTTP_ANY || httpd_routes[i].method == httpd_request.method) {
-      if(
-        // See if there's a literal match...
-        strcmp(httpd_routes[i].uri, httpd_request.uri) == 0 ||
-        // See if there's a wildcard match...
-        (
-          httpd_routes[i].uri[strlen(httpd_routes[i].uri) - 1] == '*' &&
-          strncmp(httpd_routes[i].uri, httpd_request.uri, strlen(httpd_routes[i].uri) - 1) == 0
-        )
-      ) {
-        SPF("Routing to handler: %d, method: %s, uri: %s...\n", i, httpd_methodToString(httpd_routes[i].method), httpd_routes[i].uri);
-        if(httpd_routes[i].handlerFunc(pEspconn, httpd_request, httpd_routes[i].handlerArg)) break;
-        SPF("Route %d's handler didn't handle it after all.\n", i);
-      }
-    }
-    i++;
-  }
-  if(httpd_routes[i].method == HTTP_NONE) {
-      // Dang, we're at the end of the URI table.
-      // Generate a built-in 404 to handle this.
-      SPF("\n%s not found. 404!\n", httpd_request.uri);
-      httpd_send(pEspconn, 404);
-  }
+char* httpd_headStr(char* p, const char* s) {
+  while(*s) *p++ = *s++;
+  return p;
 }
 
-void httpd_send(espconn* pEspconn, uint responseCode) {
-  httpd_send(pEspconn, responseCode, NULL, NULL, 0);
+char* httpd_headMem_P(char* p, PGM_P s, uint len) {
+  memcpy_P(p, s, len);
+  return p + len;
 }
 
-void httpd_send(espconn* pEspconn, uint responseCode, const char* pMime, const char* pData) {
-  httpd_send(pEspconn, responseCode, pMime, pData, strlen(pData));
+char* httpd_headUint(char* p, uint n) {
+  char digits[10];
+  uint8_t i = 0;
+  do {
+    digits[i++] = '0' + n % 10;
+    n /= 10;
+  } while(n);
+  while(i) *p++ = digits[--i];
+  return p;
 }
 
-void httpd_send(espconn* pEspconn, uint responseCode, const char* pMime, const char* pData, uint lData) {
-  SPN("\n*** httpd_send");
-  // SPF("Sending - code: %d, mime: %s, len: %d, data:\n%s\n", responseCode, pMime, lData, pData);
-
-  char* pBuf = NULL;
-  char httphead[256];
-  memset(httphead, 0, 256);
+// Appends n in lower case hex, with leading zeros to make at least minDigits digits.
+char* httpd_headHex(char* p, uint32_t n, uint8_t minDigits) {
+  uint8_t digits = 1;
+  while(digits < 8 && n >> (4 * digits)) digits++;
+  if(digits < minDigits) digits = minDigits;
+  for(int8_t i = digits - 1; i >= 0; i--) *p++ = "0123456789abcdef"[(n >> (4 * i)) & 0xF];
+  return p;
+}
 
-  sprintf(httphead,
-    "HTTP/1.0 %d %s\r\nContent-Length: %d\r\nServer: %s\r\nAccess-Control-Allow-Origin: *\r\n",
-    responseCode,
-    httpd_responseCodeToString(responseCode),
-    lData,
-    HTTPD_SERVER
-  );
+// Appends a "name: value" header line.
+char* httpd_headField(char* p, const char* name, const char* value) {
+  p = httpd_headStr(p, name);
+  *p++ = ':';
+  *p++ = ' ';
+  p = httpd_headStr(p, value);
+  *p++ = '\r';
+  *p++ = '\n';
+  return p;
+}
 
-  if(pData) {
-    sprintf(httphead + strlen(httphead),
-      "Content-type: %s\r\nExpires: Fri, 10 Apr 2015 14:00:00 GMT\r\nPragma: no-cache\r\n\r\n", pMime);
-    uint lHead = strlen(httphead);
-    pBuf = (char*) malloc(lData + lHead + 1);
-    memcpy(pBuf, httphead, lHead);
-    memcpy(pBuf + lHead, pData, lData);
-    *(pBuf + lHead + lData) = '\0';
-    espconn_send(pEspconn, (uint8 *)pBuf, lData + lHead);
-    SPF("Sent:\n%s\n", pBuf);
-  } else {
-    sprintf(httphead + strlen(httphead), "\r\n");
-    espconn_send(pEspconn, (uint8 *)httphead, strlen(httphead));
-    SPF("Sent:\n%s\n", httphead);
-  }
+char* httpd_headUintField(char* p, const char* name, uint value) {
+  p = httpd_headStr(p, name);
+  *p++ = ':';
+  *p++ = ' ';
+  p = httpd_headUint(p, value);
+  *p++ = '\r';
+  *p++ = '\n';
+  return p;
+}
 
-  if(pBuf) {
-    free(pBuf);
-  }
+char* httpd_headStatus(char* p, uint responseCode) {
+  p = httpd_headStr(p, "HTTP/1.1 ");
+  p = httpd_headUint(p, responseCode);
+  *p++ = ' ';
+  p = httpd_headStr(p, httpd_responseCodeToString(responseCode));
+  *p++ = '\r';
+  *p++ = '\n';
+  return p;
 }
 
-/********************************************************
-   File Handling Functions
- ********************************************************/
+// Header lines that go in every response made by httpd_send() and httpd_beginStream().
+#define HTTPD_COMMON_HEAD "Server: " HTTPD_SERVER "\r\nAccess-Control-Allow-Origin: *\r\n"
+
+// Responses without a body that are common enough to be kept ready-made in flash, up to the
+// Connection header that httpd_endHead() adds.
+#define HTTPD_FIXED_HEAD "Content-Length: 0\r\n" HTTPD_COMMON_HEAD
+const char httpd_fixed200[] PROGMEM = "HTTP/1.1 200 OK\r\n" HTTPD_FIXED_HEAD;
+const char httpd_fixed404[] PROGMEM = "HTTP/1.1 404 Not Found\r\n" HTTPD_FIXED_HEAD;
+const char httpd_fixed500[] PROGMEM = "HTTP/1.1 500 Internal Server Error\r\n" HTTPD_FIXED_HEAD;
+
+struct HttpFixedResponse {
+  uint16_t responseCode;
+  PGM_P head;
+  uint8_t lenHead;
+};
+
+const HttpFixedResponse httpd_fixedResponses[] = {
+  {200, httpd_fixed200, sizeof(httpd_fixed200) - 1},
+  {404, httpd_fixed404, sizeof(httpd_fixed404) - 1},
+  {500, httpd_fixed500, sizeof(httpd_fixed500) - 1},
+};
+
+// Starts a response. The header is formatted into the outbound queue by the caller, and lenBody
+// bytes of body are to follow it from the file or txBody. Call httpd_flush() to start sending.
+void httpd_beginResponse(HttpRequest &httpd_request, uint lenHead, uint lenBody) {
+  // Every header starts with the status line, so the code is read back from there for the metrics.
+  const uint8_t* code = httpd_request.txBuf + 9;
+  httpd_request.status = (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+  httpd_metricsHeap();
+  httpd_request.txPos = 0;
+  httpd_request.txLen = lenHead;
+  httpd_request.lenData = lenBody;
+  httpd_request.lenSoFar = 0;
+  httpd_request.method = HTTP_SENDING;
+}
 
-bool httpd_fileHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg) {
-  SPN("\nFile Handler");
-  char* uri;
-  if(handlerArg) {
-    uri = (char*) handlerArg;
-  } else {
-    uri = httpd_request.uri;
-  }
-  if(strcmp(uri, "/") == 0) {
-    uri = (char*) "/dirlist.htm";
-  }
-  SPF("uri: %s\n", uri);
+// Releases whatever the response being sent holds.
+void httpd_endResponse(HttpRequest &httpd_request) {
+  httpd_request.file.close();
+  if(httpd_request.txFlags & TX_OWNS_BODY) free((void*) httpd_request.txBody);
+  if(httpd_request.txCache) httpd_cacheRelease(httpd_request.txCache);
+  httpd_request.txBody = NULL;
+  httpd_request.txCache = NULL;
+  httpd_request.txChunk = 0;
+  httpd_request.txGenerator = NULL;
+  httpd_request.txFlags = 0;
+}
 
-  if (!SPIFFS.begin()) {
-    SPN("Failed to start SPIFFS");
-    return false;
-  }
+// Ends a response header with the headers that depend on the connection, and the blank line.
+// Returns the number of bytes added.
+uint httpd_endHead(HttpRequest &httpd_request, char* buf) {
+  return httpd_headStr(buf, httpd_request.keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n") - buf;
+}
 
-  if(!SPIFFS.exists(uri)) {
-    SPN("file not found");
-    return false;
-  }
+bool httpd_txDone(HttpRequest &httpd_request) {
+  return httpd_request.txPos == httpd_request.txLen && httpd_request.lenSoFar == httpd_request.lenData &&
+    !(httpd_request.txFlags & TX_STREAM);
+}
 
-  File f = SPIFFS.open(uri, "r");
-  if(!f) {
-    SPN("file open failed");
-    return false;
-  }
+// Bytes kept ahead of a chunk being written for its size line. A response streamed to an HTTP/1.0
+// client isn't chunked; the end of the response is marked by closing the connection instead.
+uint httpd_chunkHead(HttpRequest &httpd_request) {
+  return httpd_request.txFlags & TX_CHUNKED ? HTTPD_CHUNK_HEAD : 0;
+}
 
-  if(httpd_request.method != HTTP_SENDING) {
-    const char* mime = httpd_mimetype(uri);
-    SPF("Mime type: %s\n", mime);
+// Moves what is still to be sent, and any chunk being written, to the front of the outbound queue.
+void httpd_compactTx(HttpRequest &httpd_request) {
+  if(!httpd_request.txPos) return;
+  uint lenMove = httpd_request.txLen - httpd_request.txPos;
+  if(httpd_request.txFlags & TX_STREAM) lenMove += httpd_chunkHead(httpd_request) + httpd_request.txChunk;
+  memmove(httpd_request.txBuf, httpd_request.txBuf + httpd_request.txPos, lenMove);
+  httpd_request.txLen -= httpd_request.txPos;
+  httpd_request.txPos = 0;
+}
 
-    httpd_request.lenData = f.size();
-    httpd_request.lenSoFar = 0;
-    char httphead[128];
-    memset(httphead, 0, 128);
+// Tops up the outbound queue from the response body.
+void httpd_fillTx(HttpRequest &httpd_request) {
+  httpd_compactTx(httpd_request);
+  uint lenFill = HTTPD_TX_BUFFER_SIZE - httpd_request.txLen;
+  if(lenFill > httpd_request.lenData - httpd_request.lenSoFar) lenFill = httpd_request.lenData - httpd_request.lenSoFar;
+  if(httpd_request.file) {
+    lenFill = httpd_request.file.read(httpd_request.txBuf + httpd_request.txLen, lenFill);
+    if(lenFill == 0) {
+      LOGE("file read failed");
+      // Give up on the rest of the body; the client will see a short response.
+      httpd_request.lenData = httpd_request.lenSoFar;
+      httpd_request.txFlags &= ~TX_HASH;
+    }
+    if(httpd_request.txFlags & TX_HASH) {
+      httpd_request.txHash = httpd_hashBytes(httpd_request.txHash, httpd_request.txBuf + httpd_request.txLen, lenFill);
+    }
+  } else if(httpd_request.txBody) {
+    // Just enough to make up a full segment; the rest is sent straight from txBody.
+    if(lenFill > (uint) (FILE_BUFFER_SIZE - httpd_request.txLen)) lenFill = FILE_BUFFER_SIZE - httpd_request.txLen;
+    memcpy(httpd_request.txBuf + httpd_request.txLen, httpd_request.txBody + httpd_request.lenSoFar, lenFill);
+  } else {
+    lenFill = 0;
+    httpd_request.lenData = httpd_request.lenSoFar;
+  }
+  httpd_request.txLen += lenFill;
+  httpd_request.lenSoFar += lenFill;
+  if(httpd_request.lenSoFar == httpd_request.lenData) {
+    // The whole file has been read, so the next response for it can have an ETag.
+    if(httpd_request.txFlags & TX_HASH) httpd_etagRemember(httpd_request.txHashPath, httpd_request.lenData, httpd_request.txHash);
+    httpd_endResponse(httpd_request);
+  }
+}
+
+// Sends queued data until the window is full or the response is all sent. Once the queue is empty
+// a body held in memory is sent from where it is rather than copied. A send refused because the
+// SDK's buffer is full is retried when the next segment is acknowledged, or by a timer if none
+// are outstanding.
+void httpd_flush(HttpRequest &httpd_request) {
+  httpd_request.txFlags &= ~TX_RETRY;
+  while(httpd_request.txInFlight < HTTPD_TX_WINDOW) {
+    uint lenQueued = httpd_request.txLen - httpd_request.txPos;
+    if(httpd_request.txFlags & TX_STREAM) {
+      if(lenQueued < FILE_BUFFER_SIZE) {
+        httpd_fillStream(httpd_request);
+        lenQueued = httpd_request.txLen - httpd_request.txPos;
+      }
+    } else if(lenQueued < FILE_BUFFER_SIZE && httpd_request.lenSoFar < httpd_request.lenData && (lenQueued || !httpd_request.txBody)) {
+      httpd_fillTx(httpd_request);
+      lenQueued = httpd_request.txLen - httpd_request.txPos;
+    }
+    uint8_t* pSend = httpd_request.txBuf + httpd_request.txPos;
+    uint lenToSend = lenQueued;
+    if(lenToSend == 0) {
+      if((httpd_request.txFlags & TX_STREAM) && httpd_request.txInFlight == 0) {
+        // The generator had nothing to write yet, and no sent callback is coming to ask it again.
+        httpd_request.txFlags |= TX_RETRY;
+        os_timer_arm(&httpd_retryTimer, HTTPD_TX_RETRY_MS, false);
+        return;
+      }
+      if(!httpd_request.txBody || httpd_request.lenSoFar == httpd_request.lenData) return;
+      pSend = (uint8_t*) httpd_request.txBody + httpd_request.lenSoFar;
+      lenToSend = httpd_request.lenData - httpd_request.lenSoFar;
+    }
+    if(lenToSend > FILE_BUFFER_SIZE) lenToSend = FILE_BUFFER_SIZE;
+    sint8 err = espconn_send(httpd_request.pEspconn, pSend, lenToSend);
+    if(err == ESPCONN_INPROGRESS || err == ESPCONN_MAXNUM) {
+      LOGW("espconn_send busy: %d", err);
+      httpd_counters.sendBusy++;
+      httpd_request.txFlags |= TX_RETRY;
+      if(httpd_request.txInFlight == 0) os_timer_arm(&httpd_retryTimer, HTTPD_TX_RETRY_MS, false);
+      return;
+    }
+    if(err != ESPCONN_OK) {
+      LOGE("espconn_send failed: %d", err);
+      httpd_counters.sendFailures++;
+      httpd_endResponse(httpd_request);
+      httpd_request.txPos = httpd_request.txLen;
+      httpd_request.lenSoFar = httpd_request.lenData;
+      return;
+    }
+    httpd_request.txInFlight++;
+    httpd_counters.bytesOut += lenToSend;
+    if(lenQueued) {
+      LOGD("Sent %d of %d queued", lenToSend, lenQueued);
+      httpd_request.txPos += lenToSend;
+    } else {
+      LOGD("Sent %d from memory", lenToSend);
+      httpd_request.lenSoFar += lenToSend;
+      if(httpd_request.lenSoFar == httpd_request.lenData) httpd_endResponse(httpd_request);
+    }
+  }
+}
+
+void httpd_retryTx(void* arg) {
+  for(uint8_t r = 0; r < httpd_slotCount; r++) {
+    if(httpd_requests[r].txFlags & TX_RETRY) httpd_flush(httpd_requests[r]);
+  }
+}
+
+void httpd_router(espconn* pEspconn, HttpRequest &httpd_request) {
+  LOGD("*** httpd_router");
+  httpd_dumpEspconn(pEspconn);
+
+  // Look up URI in the compiled routing table. Matching routes come back in table order.
+  int16_t matches[HTTPD_MAX_ROUTE_MATCHES];
+  uint8_t matchCount = 0;
+  httpd_matchRoutes(0, httpd_request.uri, httpd_request.method, matches, matchCount);
+  for(uint8_t m = 0; m < matchCount; m++) {
+    int16_t i = matches[m];
+    LOGD("Routing to handler: %d, method: %s, uri: %s...", i, httpd_methodToString(httpd_routes[i].method), httpd_routes[i].uri);
+    httpd_bindPathParams(httpd_request, httpd_routes[i].uri);
+    // Set first, for a handler that finishes the request itself, as httpd_wsHandler() does.
+    httpd_request.route = i;
+    if(httpd_routes[i].handlerFunc(pEspconn, httpd_request, httpd_routes[i].handlerArg)) {
+      // Start sending whatever a streaming handler has written.
+      if(httpd_request.txFlags & TX_STREAM) httpd_flush(httpd_request);
+      return;
+    }
+    LOGW("Route %d's handler didn't handle it after all.", i);
+  }
+  // Dang, we're at the end of the URI table.
+  // Generate a built-in 404 to handle this.
+  httpd_request.route = NOT_FOUND;
+  LOGD("%s not found. 404!", httpd_request.uri);
+  httpd_send(pEspconn, 404);
+}
+
+void httpd_send(espconn* pEspconn, uint responseCode) {
+  httpd_send(pEspconn, responseCode, NULL, NULL, 0);
+}
+
+void httpd_send(espconn* pEspconn, uint responseCode, const char* pMime, const char* pData) {
+  httpd_send(pEspconn, responseCode, pMime, pData, strlen(pData));
+}
+
+void httpd_send(espconn* pEspconn, uint responseCode, const char* pMime, const char* pData, uint lData) {
+  httpd_sendBody(pEspconn, responseCode, pMime, pData, lData, true);
+}
+
+void httpd_sendStatic(espconn* pEspconn, uint responseCode, const char* pMime, const char* pData) {
+  httpd_sendBody(pEspconn, responseCode, pMime, pData, strlen(pData), false);
+}
+
+void httpd_sendStatic(espconn* pEspconn, uint responseCode, const char* pMime, const char* pData, uint lData) {
+  httpd_sendBody(pEspconn, responseCode, pMime, pData, lData, false);
+}
+
+// Formats the header of a response sent by httpd_sendBody() into buf. Returns its length.
+uint httpd_sendHead(HttpRequest &httpd_request, char* buf, uint responseCode, const char* pMime, const char* pData, uint lData) {
+  char* p = NULL;
+  if(!pData) {
+    for(uint8_t i = 0; i < sizeof(httpd_fixedResponses) / sizeof(httpd_fixedResponses[0]); i++) {
+      if(httpd_fixedResponses[i].responseCode == responseCode) {
+        p = httpd_headMem_P(buf, httpd_fixedResponses[i].head, httpd_fixedResponses[i].lenHead);
+        break;
+      }
+    }
+  }
+  if(!p) {
+    p = httpd_headStatus(buf, responseCode);
+    p = httpd_headUintField(p, "Content-Length", lData);
+    p = httpd_headStr(p, HTTPD_COMMON_HEAD);
+    if(pData) {
+      p = httpd_headField(p, "Content-type", pMime);
+      p = httpd_headStr(p, "Cache-Control: no-cache\r\n");
+    }
+  }
+  return p - buf + httpd_endHead(httpd_request, p);
+}
+
+// Sends a response held in memory. With copy false the caller guarantees pData stays put until the
+// response has gone, so it's sent from where it is; only as much as fills out the header's segment
+// is copied. Otherwise a body that doesn't fit in the outbound queue with the header is copied.
+void httpd_sendBody(espconn* pEspconn, uint responseCode, const char* pMime, const char* pData, uint lData, bool copy) {
+  LOGD("*** httpd_send");
+  // SPF("Sending - code: %d, mime: %s, len: %d, data:\n%s\n", responseCode, pMime, lData, pData);
+
+  int8_t r = httpd_findHttpReq(pEspconn);
+  if(r == NOT_FOUND) {
+    LOGE("Connection rec not found");
+    return;
+  }
+  HttpRequest &httpd_request = httpd_requests[r];
+  httpd_endResponse(httpd_request);
+
+  // The header is built straight into the outbound queue.
+  if(!pData) lData = 0;
+  uint lHead = httpd_sendHead(httpd_request, (char*) httpd_request.txBuf, responseCode, pMime, pData, lData);
+
+  char* pCopy = NULL;
+  if(copy && lData > HTTPD_TX_BUFFER_SIZE - lHead) {
+    // The caller's data may not outlive this call, so keep a copy to send from. It goes in the
+    // arena if there's room, which lasts until the response has gone.
+    pCopy = (char*) httpd_arenaAlloc(httpd_request, lData);
+    if(!pCopy) {
+      pCopy = (char*) malloc(lData);
+      if(pCopy) httpd_request.txFlags |= TX_OWNS_BODY;
+    }
+    if(pCopy) {
+      memcpy(pCopy, pData, lData);
+    } else {
+      // Nothing has gone yet, so the header is replaced rather than promise a body that can't follow.
+      LOGE("Failed to malloc");
+      lData = 0;
+      lHead = httpd_sendHead(httpd_request, (char*) httpd_request.txBuf, 500, NULL, NULL, 0);
+    }
+  }
+  LOGD("Sending a %d byte header", lHead);
+  httpd_beginResponse(httpd_request, lHead, lData);
+
+  if(pCopy) {
+    httpd_request.txBody = pCopy;
+  } else if(!copy) {
+    httpd_request.txBody = pData;
+  } else if(lData) {
+    // The body fits in the queue along with the header.
+    memcpy(httpd_request.txBuf + lHead, pData, lData);
+    httpd_request.txLen += lData;
+    httpd_request.lenSoFar = lData;
+  }
+  httpd_flush(httpd_request);
+}
+
+// Starts a streamed response, for when the size of the response isn't known in advance. After
+// this the handler writes the body with httpd_write(), httpd_print() and httpd_printf(). It then
+// either calls httpd_endStream(), or leaves generator to be called for more as the data goes out.
+// The body is sent with chunked transfer encoding, a chunk each time the outbound queue drains.
+void httpd_beginStream(espconn* pEspconn, uint responseCode, const char* pMime, GeneratorFunc generator, void* generatorArg) {
+  LOGD("*** httpd_beginStream");
+  int8_t r = httpd_findHttpReq(pEspconn);
+  if(r == NOT_FOUND) {
+    LOGE("Connection rec not found");
+    return;
+  }
+  HttpRequest &httpd_request = httpd_requests[r];
+  httpd_endResponse(httpd_request);
+
+  // HTTP/1.0 clients don't understand chunks, so their responses end when the connection closes.
+  bool chunked = httpd_request.httpVersion >= 11;
+  if(!chunked) httpd_request.keepAlive = false;
+  char* httphead = (char*) httpd_request.txBuf;
+  char* p = httpd_headStatus(httphead, responseCode);
+  if(chunked) p = httpd_headStr(p, "Transfer-Encoding: chunked\r\n");
+  p = httpd_headStr(p, HTTPD_COMMON_HEAD);
+  p = httpd_headField(p, "Content-type", pMime);
+  p = httpd_headStr(p, "Cache-Control: no-cache\r\n");
+  uint lHead = p - httphead;
+  lHead += httpd_endHead(httpd_request, p);
+  httpd_beginResponse(httpd_request, lHead, 0);
+  httpd_request.txFlags |= chunked ? TX_STREAM | TX_CHUNKED : TX_STREAM;
+  httpd_request.txGenerator = generator;
+  httpd_request.txGeneratorArg = generatorArg;
+}
+
+// Returns the number of bytes that can be written to a streamed response before the outbound
+// queue is full. A generator should write no more than this each time it is called.
+uint httpd_writeRoom(HttpRequest &httpd_request) {
+  if(!(httpd_request.txFlags & TX_STREAM)) return 0;
+  uint used = httpd_request.txLen - httpd_request.txPos + httpd_chunkHead(httpd_request) + httpd_request.txChunk + HTTPD_STREAM_TAIL;
+  return used < HTTPD_TX_BUFFER_SIZE ? HTTPD_TX_BUFFER_SIZE - used : 0;
+}
+
+// Returns where the next byte written to a streamed response goes, after making as much room as
+// the outbound queue has.
+char* httpd_writePos(HttpRequest &httpd_request) {
+  httpd_compactTx(httpd_request);
+  return (char*) httpd_request.txBuf + httpd_request.txLen + httpd_chunkHead(httpd_request) + httpd_request.txChunk;
+}
+
+// Writes to a streamed response. Returns the number of bytes written, which is less than lData
+// if the outbound queue is full.
+uint httpd_write(HttpRequest &httpd_request, const void* pData, uint lData) {
+  if(!(httpd_request.txFlags & TX_STREAM)) return 0;
+  char* pos = httpd_writePos(httpd_request);
+  uint room = httpd_writeRoom(httpd_request);
+  if(lData > room) {
+    LOGW("Stream full, dropped %d bytes", lData - room);
+    lData = room;
+  }
+  memcpy(pos, pData, lData);
+  httpd_request.txChunk += lData;
+  return lData;
+}
+
+uint httpd_print(HttpRequest &httpd_request, const char* pStr) {
+  return httpd_write(httpd_request, pStr, strlen(pStr));
+}
+
+// Formats straight into the outbound queue. Output that doesn't fit is cut short.
+uint httpd_printf(HttpRequest &httpd_request, const char* format, ...) {
+  if(!(httpd_request.txFlags & TX_STREAM)) return 0;
+  char* pos = httpd_writePos(httpd_request);
+  uint room = httpd_writeRoom(httpd_request);
+  va_list args;
+  va_start(args, format);
+  // The room kept for the tail leaves space for vsnprintf's terminator.
+  uint len = vsnprintf(pos, room + 1, format, args);
+  va_end(args);
+  if(len > room) {
+    LOGW("Stream full, dropped %d bytes", len - room);
+    len = room;
+  }
+  httpd_request.txChunk += len;
+  return len;
+}
+
+// Queues what has been written to a streamed response as a chunk.
+void httpd_closeChunk(HttpRequest &httpd_request) {
+  if(!httpd_request.txChunk) return;
+  char* chunk = (char*) httpd_request.txBuf + httpd_request.txLen;
+  if(httpd_request.txFlags & TX_CHUNKED) {
+    // The size line is a fixed four hex digits, leading zeros and all, so it can be written last.
+    httpd_headHex(chunk, httpd_request.txChunk, 4);
+    memcpy(chunk + 4, "\r\n", 2);
+    memcpy(chunk + HTTPD_CHUNK_HEAD + httpd_request.txChunk, "\r\n", 2);
+    httpd_request.txLen += HTTPD_CHUNK_HEAD + 2;
+  }
+  httpd_request.txLen += httpd_request.txChunk;
+  httpd_request.txChunk = 0;
+}
+
+// Queues the end of a streamed response.
+void httpd_finishStream(HttpRequest &httpd_request) {
+  httpd_closeChunk(httpd_request);
+  if(httpd_request.txFlags & TX_CHUNKED) {
+    memcpy(httpd_request.txBuf + httpd_request.txLen, "0\r\n\r\n", 5);
+    httpd_request.txLen += 5;
+  }
+  httpd_request.txFlags &= ~(TX_STREAM | TX_CHUNKED);
+  httpd_request.txGenerator = NULL;
+}
+
+// Tops up the outbound queue of a streamed response, from its generator if it has one.
+void httpd_fillStream(HttpRequest &httpd_request) {
+  if(httpd_request.txGenerator && httpd_writeRoom(httpd_request)) {
+    if(!httpd_request.txGenerator(httpd_request, httpd_request.txGeneratorArg)) {
+      httpd_finishStream(httpd_request);
+      return;
+    }
+  }
+  httpd_closeChunk(httpd_request);
+  if(!httpd_request.txGenerator) httpd_finishStream(httpd_request);
+}
+
+// Ends a streamed response once everything written to it has been sent.
+void httpd_endStream(HttpRequest &httpd_request) {
+  if(!(httpd_request.txFlags & TX_STREAM)) return;
+  httpd_finishStream(httpd_request);
+  httpd_flush(httpd_request);
+}
+
+/********************************************************
+   File Cache Functions
+ ********************************************************/
+
+// Enables the file cache, which keeps small, frequently requested files in RAM along with their
+// response header so they are served without touching flash. budget is the number of bytes it may
+// hold; zero disables it. Least recently used files are evicted to make room.
+void httpd_cacheInit(uint budget) {
+  httpd_cacheInvalidate(NULL);
+  httpd_cacheBudget = budget;
+}
+
+const HttpCacheStats& httpd_cacheStats() {
+  return httpd_cacheCounters;
+}
+
+#define HTTPD_FNV_BASIS 2166136261u
+
+uint32_t httpd_cacheHash(const char* path) {
+  // FNV-1a
+  uint32_t hash = HTTPD_FNV_BASIS;
+  while(*path) {
+    hash ^= (uint8_t) *path++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+uint32_t httpd_hashBytes(uint32_t hash, const uint8_t* p, uint len) {
+  while(len--) {
+    hash ^= *p++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Finds the remembered hash of the contents of the file with the given path hash and size.
+bool httpd_etagFind(uint32_t pathHash, uint size, uint32_t &contentHash) {
+  for(uint8_t i = 0; i < HTTPD_ETAG_ENTRIES; i++) {
+    if(httpd_etags[i].pathHash == pathHash && httpd_etags[i].size == size) {
+      contentHash = httpd_etags[i].contentHash;
+      return true;
+    }
+  }
+  return false;
+}
+
+void httpd_etagRemember(uint32_t pathHash, uint size, uint32_t contentHash) {
+  HttpETag &etag = httpd_etags[httpd_etagNext];
+  httpd_etagNext = (httpd_etagNext + 1) % HTTPD_ETAG_ENTRIES;
+  etag.pathHash = pathHash;
+  etag.size = size;
+  etag.contentHash = contentHash;
+  LOGD("Hashed %08x: %08x", pathHash, contentHash);
+}
+
+// Gets the hash of a file's contents for its ETag. A file of up to HTTPD_ETAG_HASH_MAX bytes is
+// read the first time it is served and left at its start; a larger one isn't, and false is
+// returned until it has been hashed as it was sent. buf is scratch space of HTTPD_TX_BUFFER_SIZE
+// bytes.
+bool httpd_fileHash(const char* path, File &f, uint8_t* buf, uint32_t &contentHash) {
+  uint32_t pathHash = httpd_cacheHash(path);
+  if(httpd_etagFind(pathHash, f.size(), contentHash)) return true;
+  if(f.size() > HTTPD_ETAG_HASH_MAX) return false;
+  contentHash = HTTPD_FNV_BASIS;
+  uint n;
+  while((n = f.read(buf, HTTPD_TX_BUFFER_SIZE)) > 0) contentHash = httpd_hashBytes(contentHash, buf, n);
+  f.seek(0, SeekSet);
+  httpd_etagRemember(pathHash, f.size(), contentHash);
+  return true;
+}
+
+// Formats an ETag, quotes included, into buf, which must have room for 20 characters.
+void httpd_formatETag(char* buf, uint size, uint32_t contentHash) {
+  char* p = buf;
+  *p++ = '"';
+  p = httpd_headHex(p, size, 1);
+  *p++ = '-';
+  p = httpd_headHex(p, contentHash, 8);
+  *p++ = '"';
+  *p = 0;
+}
+
+char* httpd_cachePath(HttpCacheEntry* e) {
+  return (char*) (e + 1);
+}
+
+char* httpd_cacheHead(HttpCacheEntry* e) {
+  return httpd_cachePath(e) + e->lenPath + 1;
+}
+
+char* httpd_cacheBody(HttpCacheEntry* e) {
+  return httpd_cacheHead(e) + e->lenHead;
+}
+
+void httpd_cacheUnlink(HttpCacheEntry* e) {
+  if(e->prev) e->prev->next = e->next; else httpd_cacheNewest = e->next;
+  if(e->next) e->next->prev = e->prev; else httpd_cacheOldest = e->prev;
+  e->prev = e->next = NULL;
+}
+
+void httpd_cachePushFront(HttpCacheEntry* e) {
+  e->prev = NULL;
+  e->next = httpd_cacheNewest;
+  if(httpd_cacheNewest) httpd_cacheNewest->prev = e; else httpd_cacheOldest = e;
+  httpd_cacheNewest = e;
+}
+
+// Removes an entry from the cache. An entry still being sent from is freed when the send finishes.
+void httpd_cacheDrop(HttpCacheEntry* e) {
+  httpd_cacheUnlink(e);
+  httpd_cacheCounters.bytes -= e->lenAlloc;
+  httpd_cacheCounters.entries--;
+  if(e->refs) {
+    e->stale = true;
+  } else {
+    free(e);
+  }
+}
+
+void httpd_cacheRelease(HttpCacheEntry* e) {
+  if(--e->refs == 0 && e->stale) free(e);
+}
+
+HttpCacheEntry* httpd_cacheFind(const char* path) {
+  uint32_t hash = httpd_cacheHash(path);
+  for(HttpCacheEntry* e = httpd_cacheNewest; e; e = e->next) {
+    if(e->hash == hash && strcmp(httpd_cachePath(e), path) == 0) return e;
+  }
+  return NULL;
+}
+
+// Drops the named file from the cache and forgets its ETag, or every file's if path is NULL. The
+// cached directory listings go too. Anything that writes to SPIFFS must call this.
+void httpd_cacheInvalidate(const char* path) {
+  uint32_t pathHash = path ? httpd_cacheHash(path) : 0;
+  for(uint8_t i = 0; i < HTTPD_ETAG_ENTRIES; i++) {
+    if(!path || httpd_etags[i].pathHash == pathHash) httpd_etags[i].pathHash = 0;
+  }
+  if(!path) {
+    while(httpd_cacheNewest) httpd_cacheDrop(httpd_cacheNewest);
+    return;
+  }
+  HttpCacheEntry* e = httpd_cacheFind(path);
+  if(e) httpd_cacheDrop(e);
+  // Any change to the file system changes the directory listings.
+  for(uint8_t json = 0; json < 2; json++) {
+    e = httpd_cacheFind(httpd_dirKey(json));
+    if(e) httpd_cacheDrop(e);
+  }
+}
+
+// Returns the cached copy of a file, making it the most recently used. Misses are counted when a
+// file is read from flash instead, so looking for files that don't exist isn't counted.
+HttpCacheEntry* httpd_cacheLookup(const char* path) {
+  if(!httpd_cacheBudget) return NULL;
+  HttpCacheEntry* e = httpd_cacheFind(path);
+  if(!e) return NULL;
+  httpd_cacheCounters.hits++;
+  if(e != httpd_cacheNewest) {
+    httpd_cacheUnlink(e);
+    httpd_cachePushFront(e);
+  }
+  return e;
+}
+
+// Makes room for an entry with lenBody bytes of body and allocates it, filling in everything but
+// the body. The caller fills in the body and adds the entry with httpd_cacheInsert(). Evicts the
+// least recently used entries to make room. Returns NULL if the entry can't be cached.
+HttpCacheEntry* httpd_cacheAlloc(const char* path, const char* head, uint lenHead, uint lenBody, uint32_t contentHash) {
+  if(!httpd_cacheBudget || lenBody > HTTPD_CACHE_MAX_FILE) return NULL;
+  uint lenPath = strlen(path);
+  if(lenPath > 0xFF) return NULL;
+  uint lenAlloc = sizeof(HttpCacheEntry) + lenPath + 1 + lenHead + lenBody;
+  if(lenAlloc > httpd_cacheBudget) return NULL;
+
+  // Entries being sent from can't be evicted, so check there will be room before evicting any.
+  uint lenFree = httpd_cacheBudget - httpd_cacheCounters.bytes;
+  for(HttpCacheEntry* e = httpd_cacheOldest; e && lenFree < lenAlloc; e = e->prev) {
+    if(!e->refs) lenFree += e->lenAlloc;
+  }
+  if(lenFree < lenAlloc) return NULL;
+  HttpCacheEntry* e = httpd_cacheOldest;
+  while(httpd_cacheBudget - httpd_cacheCounters.bytes < lenAlloc) {
+    HttpCacheEntry* prev = e->prev;
+    if(!e->refs) {
+      LOGD("Cache evicting: %s", httpd_cachePath(e));
+      httpd_cacheDrop(e);
+      httpd_cacheCounters.evictions++;
+    }
+    e = prev;
+  }
+
+  e = (HttpCacheEntry*) malloc(lenAlloc);
+  if(!e) return NULL;
+  memset(e, 0, sizeof(HttpCacheEntry));
+  e->hash = httpd_cacheHash(path);
+  e->lenAlloc = lenAlloc;
+  e->lenBody = lenBody;
+  e->contentHash = contentHash;
+  e->lenHead = lenHead;
+  e->lenPath = lenPath;
+  memcpy(httpd_cachePath(e), path, lenPath + 1);
+  memcpy(httpd_cacheHead(e), head, lenHead);
+  return e;
+}
+
+void httpd_cacheInsert(HttpCacheEntry* e) {
+  httpd_cachePushFront(e);
+  httpd_cacheCounters.bytes += e->lenAlloc;
+  httpd_cacheCounters.entries++;
+  LOGD("Cached: %s, %d bytes", httpd_cachePath(e), e->lenAlloc);
+}
+
+// Reads an open file into the cache along with its response header. Returns NULL, leaving the
+// file as it was, if the file can't be cached.
+HttpCacheEntry* httpd_cacheAdd(const char* path, File &f, const char* head, uint lenHead, uint32_t contentHash) {
+  HttpCacheEntry* e = httpd_cacheAlloc(path, head, lenHead, f.size(), contentHash);
+  if(!e) return NULL;
+  if(f.read((uint8_t*) httpd_cacheBody(e), e->lenBody) != e->lenBody) {
+    LOGE("Cache read failed");
+    free(e);
+    f.seek(0, SeekSet);
+    return NULL;
+  }
+  f.close();
+  httpd_cacheInsert(e);
+  return e;
+}
+
+/********************************************************
+   File Handling Functions
+ ********************************************************/
+
+// Longest path SPIFFS allows, including the terminator: SPIFFS_OBJ_NAME_LEN.
+#define HTTPD_FS_PATH 32
+
+// Formats the header lines of a response serving len bytes, starting at from, of a file of size
+// bytes, without the blank line that ends the header. Returns their length. Anything less than the
+// whole file is a 206 Partial Content. The type is that of uri, which for a gzipped copy is the
+// name of the original file. etag is left out if it is empty.
+uint httpd_fileHead(char* buf, const char* uri, uint from, uint len, uint size, bool gzip, const char* etag) {
+  const char* mime = httpd_mimetype(uri);
+  LOGD("Mime type: %s", mime);
+  char* p = httpd_headStatus(buf, len == size ? 200 : 206);
+  p = httpd_headUintField(p, "Content-Length", len);
+  if(len != size) {
+    p = httpd_headStr(p, "Content-Range: bytes ");
+    p = httpd_headUint(p, from);
+    *p++ = '-';
+    p = httpd_headUint(p, from + len - 1);
+    *p++ = '/';
+    p = httpd_headUint(p, size);
+    p = httpd_headStr(p, "\r\n");
+  }
+  p = httpd_headStr(p, "Server: " HTTPD_SERVER "\r\n");
+  p = httpd_headField(p, "Content-type", mime);
+  p = httpd_headStr(p, "Accept-Ranges: bytes\r\n");
+  if(etag[0]) p = httpd_headField(p, "ETag", etag);
+  if(gzip) p = httpd_headStr(p, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
+  return p - buf;
+}
+
+// Reads the digits of a byte position, returning false if there are none. Positions too big
+// for a uint are clamped, which leaves them past the end of any file.
+bool httpd_parseBytePos(const char* &p, uint &pos) {
+  if(*p < '0' || *p > '9') return false;
+  pos = 0;
+  while(*p >= '0' && *p <= '9') {
+    uint digit = *p++ - '0';
+    pos = pos > (UINT32_MAX - digit) / 10 ? UINT32_MAX : pos * 10 + digit;
+  }
+  return true;
+}
+
+// Interprets a Range header for a file of size bytes. Returns 206 with from and len set to a
+// satisfiable range, or 416 if the range is beyond the end of the file. Returns 200 if the whole
+// file should be sent: the range covers it, can't be parsed, or is more than one range, which
+// the server doesn't support.
+uint httpd_parseRange(const char* range, uint size, uint &from, uint &len) {
+  if(strncasecmp(range, "bytes=", 6) != 0) return 200;
+  const char* p = range + 6;
+  while(*p == ' ') p++;
+  uint first;
+  uint last = size - 1;
+  if(*p == '-') {
+    // A suffix range, the last n bytes.
+    p++;
+    uint n;
+    if(!httpd_parseBytePos(p, n)) return 200;
+    if(n == 0 || size == 0) return 416;
+    first = n < size ? size - n : 0;
+  } else {
+    if(!httpd_parseBytePos(p, first) || *p++ != '-') return 200;
+    uint pos;
+    if(httpd_parseBytePos(p, pos)) {
+      if(pos < first) return 200;
+      if(pos < last) last = pos;
+    }
+    if(first >= size) return 416;
+  }
+  while(*p == ' ') p++;
+  if(*p) return 200;
+  from = first;
+  len = last - first + 1;
+  return len == size ? 200 : 206;
+}
+
+// Returns true if an If-None-Match header value lists etag. The comparison is the weak one
+// RFC 7232 asks for, so W/"x" matches "x".
+bool httpd_etagMatches(const char* list, const char* etag) {
+  uint lenETag = strlen(etag);
+  const char* p = list;
+  while(*p) {
+    while(*p == ' ' || *p == '\t' || *p == ',') p++;
+    if(*p == '*') return true;
+    if(p[0] == 'W' && p[1] == '/') p += 2;
+    const char* start = p;
+    // Entity tags are quoted and can't contain quotes, but may contain commas.
+    if(*p == '"') {
+      p++;
+      while(*p && *p != '"') p++;
+      if(*p) p++;
+    }
+    if((uint) (p - start) == lenETag && memcmp(start, etag, lenETag) == 0) return true;
+    while(*p && *p != ',') p++;
+  }
+  return false;
+}
+
+// Returns true if the request's Accept-Encoding header allows a gzip encoded response.
+bool httpd_acceptsGzip(HttpRequest &httpd_request) {
+  const char* p = httpd_getHeader(httpd_request, "Accept-Encoding");
+  if(!p) return false;
+  // A comma separated list of codings, each optionally followed by parameters such as ;q=0.5.
+  while(*p) {
+    while(*p == ' ' || *p == ',') p++;
+    const char* coding = p;
+    while(*p && *p != ',' && *p != ';' && *p != ' ') p++;
+    uint lenCoding = p - coding;
+    bool gzip = (lenCoding == 4 && strncasecmp(coding, "gzip", 4) == 0) ||
+                (lenCoding == 6 && strncasecmp(coding, "x-gzip", 6) == 0) ||
+                (lenCoding == 1 && *coding == '*');
+    bool refused = false;
+    while(*p && *p != ',') {
+      if(*p == ';') {
+        p++;
+        while(*p == ' ') p++;
+        if((*p == 'q' || *p == 'Q') && p[1] == '=') {
+          // A quality of zero, however written, means the coding is not acceptable.
+          p += 2;
+          while(*p == '0' || *p == '.') p++;
+          refused = !(*p >= '1' && *p <= '9');
+        }
+      } else {
+        p++;
+      }
+    }
+    if(gzip) return !refused;
+  }
+  return false;
+}
+
+// Serves the file at path from the cache or SPIFFS, with the header of a file named uri. Returns
+// false if there is no such file.
+bool httpd_serveFile(HttpRequest &httpd_request, const char* path, const char* uri, bool gzip) {
+  char* httphead = (char*) httpd_request.txBuf;
+  uint lenHead;
+  char etag[20] = "";
+  uint32_t contentHash = 0;
+  File f;
+  HttpCacheEntry* e = httpd_cacheLookup(path);
+  if(e) {
+    LOGD("Cache hit: %s", path);
+    httpd_endResponse(httpd_request);
+    contentHash = e->contentHash;
+    httpd_formatETag(etag, e->lenBody, contentHash);
+  } else {
+    // Opening the file is also the existence check. Unless the file can be cached it stays open
+    // in the HttpRequest until the transfer finishes or the connection goes away.
+    f = SPIFFS.open(path, "r");
+    if(!f) {
+      LOGD("file not found: %s", path);
+      return false;
+    }
+    if(httpd_cacheBudget) httpd_cacheCounters.misses++;
+    httpd_endResponse(httpd_request);
+    if(httpd_fileHash(path, f, httpd_request.txBuf, contentHash)) httpd_formatETag(etag, f.size(), contentHash);
+  }
+
+  // If the client already has this version of the file it only needs to be told so.
+  const char* ifNoneMatch = httpd_getHeader(httpd_request, "If-None-Match");
+  if(etag[0] && ifNoneMatch && httpd_etagMatches(ifNoneMatch, etag)) {
+    LOGD("Not modified: %s", etag);
+    char* p = httpd_headStr(httphead, "HTTP/1.1 304 Not Modified\r\nServer: " HTTPD_SERVER "\r\n");
+    p = httpd_headField(p, "ETag", etag);
+    if(gzip) p = httpd_headStr(p, "Vary: Accept-Encoding\r\n");
+    lenHead = p - httphead;
+    lenHead += httpd_endHead(httpd_request, p);
+    httpd_beginResponse(httpd_request, lenHead, 0);
+    httpd_flush(httpd_request);
+    return true;
+  }
+
+  uint size = e ? e->lenBody : f.size();
+  uint from = 0;
+  uint len = size;
+  uint responseCode = 200;
+  const char* range = httpd_request.method == HTTP_GET ? httpd_getHeader(httpd_request, "Range") : NULL;
+  if(range) {
+    // If-Range asks for the range only if the file is still the version the client has part of.
+    const char* ifRange = httpd_getHeader(httpd_request, "If-Range");
+    if(!ifRange || (etag[0] && strcmp(ifRange, etag) == 0)) responseCode = httpd_parseRange(range, size, from, len);
+  }
+  if(responseCode == 416) {
+    LOGD("Range not satisfiable: %s", range);
+    char* p = httpd_headStr(httphead, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\nContent-Range: bytes */");
+    p = httpd_headUint(p, size);
+    p = httpd_headStr(p, "\r\nServer: " HTTPD_SERVER "\r\n");
+    lenHead = p - httphead;
+    lenHead += httpd_endHead(httpd_request, p);
+    httpd_beginResponse(httpd_request, lenHead, 0);
+    httpd_flush(httpd_request);
+    return true;
+  }
+  if(responseCode == 206) {
+    // The body is sent from the range's offset, in the cached copy or the file.
+    LOGD("Range: %d bytes from %d", len, from);
+    lenHead = httpd_fileHead(httphead, uri, from, len, size, gzip, etag);
+    lenHead += httpd_endHead(httpd_request, httphead + lenHead);
+    httpd_beginResponse(httpd_request, lenHead, len);
+    if(e) {
+      httpd_request.txBody = httpd_cacheBody(e) + from;
+      httpd_request.txCache = e;
+      e->refs++;
+    } else {
+      f.seek(from, SeekSet);
+      httpd_request.file = f;
+    }
+    httpd_flush(httpd_request);
+    return true;
+  }
+
+  if(e) {
+    lenHead = e->lenHead;
+    memcpy(httphead, httpd_cacheHead(e), lenHead);
+  } else {
+    lenHead = httpd_fileHead(httphead, uri, 0, size, size, gzip, etag);
+    e = etag[0] ? httpd_cacheAdd(path, f, httphead, lenHead, contentHash) : NULL;
+    if(!e) {
+      lenHead += httpd_endHead(httpd_request, httphead + lenHead);
+      LOGD("lenData: %d queueing header: %d", (int) f.size(), lenHead);
+      // The header is sent along with the start of the file.
+      httpd_beginResponse(httpd_request, lenHead, f.size());
+      httpd_request.file = f;
+      if(!etag[0]) {
+        httpd_request.txFlags |= TX_HASH;
+        httpd_request.txHash = HTTPD_FNV_BASIS;
+        httpd_request.txHashPath = httpd_cacheHash(path);
+      }
+      httpd_flush(httpd_request);
+      return true;
+    }
+  }
+
+  lenHead += httpd_endHead(httpd_request, httphead + lenHead);
+  LOGD("lenData: %d from cache, queueing header: %d", e->lenBody, lenHead);
+  httpd_beginResponse(httpd_request, lenHead, e->lenBody);
+  httpd_request.txBody = httpd_cacheBody(e);
+  httpd_request.txCache = e;
+  e->refs++;
+  httpd_flush(httpd_request);
+  return true;
+}
+
+bool httpd_fileHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg) {
+  LOGD("File Handler");
+  char* uri;
+  if(handlerArg) {
+    uri = (char*) handlerArg;
+  } else {
+    uri = httpd_request.uri;
+  }
+  LOGD("uri: %s", uri);
+
+  if(!httpd_fsMounted) return false;
+  // There's no file at the root; it gets the listing.
+  if(strcmp(uri, "/") == 0) return httpd_dirList(pEspconn, httpd_request, false);
+
+  // A gzipped copy of the file, stored alongside it as <name>.gz, is preferred if the client takes it.
+  // There can't be one if its name would be too long for SPIFFS.
+  if(strlen(uri) + 3 < HTTPD_FS_PATH && httpd_acceptsGzip(httpd_request)) {
+    char gzPath[HTTPD_FS_PATH];
+    strcpy(gzPath, uri);
+    strcat(gzPath, ".gz");
+    if(httpd_serveFile(httpd_request, gzPath, uri, true)) return true;
+  }
+  return httpd_serveFile(httpd_request, uri, uri, false);
+}
+
+// Gets the name a directory entry is listed under, and its size. Gzipped files are listed under the
+// name they are requested by, once. Returns false if the entry isn't listed.
+bool httpd_dirName(Dir &dir, char* fn, uint &size) {
+  String name = dir.fileName();
+  uint lenFn = name.length();
+  if(lenFn >= HTTPD_DIR_NAME) return false;
+  memcpy(fn, name.c_str(), lenFn + 1);
+  size = dir.fileSize();
+  if(lenFn > 3 && strcmp(fn + lenFn - 3, ".gz") == 0) {
+    fn[lenFn - 3] = '\0';
+    if(SPIFFS.exists(fn)) return false;
+  }
+  return true;
+}
+
+// Appends a file name, escaped for HTML or a JSON string. Names can come from uploads, so they
+// can't be trusted to be harmless.
+char* httpd_dirEscape(char* p, const char* s, bool json) {
+  for(; *s; s++) {
+    if(json) {
+      if(*s == '"' || *s == '\\') *p++ = '\\';
+      if((uint8_t) *s < ' ') continue;
+      *p++ = *s;
+    } else if(*s == '&') p = httpd_headStr(p, "&amp;");
+    else if(*s == '<') p = httpd_headStr(p, "&lt;");
+    else if(*s == '>') p = httpd_headStr(p, "&gt;");
+    else if(*s == '"') p = httpd_headStr(p, "&quot;");
+    else *p++ = *s;
+  }
+  return p;
+}
+
+// Formats one file's entry in a listing into buf, which has room for HTTPD_DIR_ENTRY_MAX
+// characters. Returns its length.
+uint httpd_dirEntry(char* buf, const char* fn, uint size, bool json, bool first) {
+  char* p = buf;
+  if(json) {
+    p = httpd_headStr(p, first ? "{\"name\":\"" : ",\n{\"name\":\"");
+    p = httpd_dirEscape(p, fn, true);
+    p = httpd_headStr(p, "\",\"size\":");
+    p = httpd_headUint(p, size);
+    *p++ = '}';
+  } else {
+    p = httpd_headStr(p, "<a href=\"");
+    p = httpd_dirEscape(p, fn, false);
+    p = httpd_headStr(p, "\">");
+    p = httpd_dirEscape(p, fn, false);
+    p = httpd_headStr(p, "</a><br>\n");
+  }
+  return p - buf;
+}
+
+const char* httpd_dirStart(bool json) {
+  return json ? "[\n" : "<html>\n<body>\n";
+}
+
+const char* httpd_dirEnd(bool json) {
+  return json ? "\n]\n" : "</body>\n</html>\n";
+}
+
+// The listings are cached under names no request path can have.
+const char* httpd_dirKey(bool json) {
+  return json ? "dirlist.json" : "dirlist.htm";
+}
+
+// Adds a piece of a listing being built, to its length and hash and, once out is set, to out.
+void httpd_dirAppend(char* out, uint &len, uint32_t &hash, const char* p, uint lenP) {
+  if(out) memcpy(out + len, p, lenP);
+  len += lenP;
+  hash = httpd_hashBytes(hash, (const uint8_t*) p, lenP);
+}
+
+// Writes the listing to out, or with out NULL just works out its length and hash.
+uint httpd_dirBuild(bool json, char* out, uint32_t &hash) {
+  char fn[HTTPD_DIR_NAME];
+  char entry[HTTPD_DIR_ENTRY_MAX];
+  uint size;
+  uint len = 0;
+  bool first = true;
+  hash = HTTPD_FNV_BASIS;
+  httpd_dirAppend(out, len, hash, httpd_dirStart(json), strlen(httpd_dirStart(json)));
+  Dir dir = SPIFFS.openDir("/");
+  while(dir.next()) {
+    if(!httpd_dirName(dir, fn, size)) continue;
+    httpd_dirAppend(out, len, hash, entry, httpd_dirEntry(entry, fn, size, json, first));
+    first = false;
+  }
+  httpd_dirAppend(out, len, hash, httpd_dirEnd(json), strlen(httpd_dirEnd(json)));
+  return len;
+}
+
+// Builds a listing into the file cache, where it stays until the file system changes. The
+// directory is read twice, to size the entry and then to fill it. scratch is used for the header.
+HttpCacheEntry* httpd_dirCache(bool json, char* scratch) {
+  uint32_t hash;
+  uint len = httpd_dirBuild(json, NULL, hash);
+  char etag[20];
+  httpd_formatETag(etag, len, hash);
+  uint lenHead = httpd_fileHead(scratch, json ? "/dirlist.json" : "/dirlist.htm", 0, len, len, false, etag);
+  HttpCacheEntry* e = httpd_cacheAlloc(httpd_dirKey(json), scratch, lenHead, len, hash);
+  if(!e) return NULL;
+  // Nothing can change the file system between the two passes, so the listing is the same again.
+  httpd_dirBuild(json, httpd_cacheBody(e), hash);
+  httpd_cacheInsert(e);
+  return e;
+}
+
+// Where a streamed listing is up to, kept in the arena.
+struct HttpDirList {
+  uint16_t next;  // Directory entries already listed or skipped.
+  bool json;
+  bool started;
+  bool written;   // An entry has been written, so the next one needs a separator.
+};
+
+// Streams a listing as it is sent. A Dir can't be kept from one call to the next, so each call
+// reads the directory again and skips the entries already listed.
+bool httpd_dirGenerate(HttpRequest &httpd_request, void* generatorArg) {
+  HttpDirList* list = (HttpDirList*) generatorArg;
+  if(!list->started) {
+    httpd_print(httpd_request, httpd_dirStart(list->json));
+    list->started = true;
+  }
+  Dir dir = SPIFFS.openDir("/");
+  for(uint16_t i = 0; i < list->next; i++) dir.next();
+  char fn[HTTPD_DIR_NAME];
+  char entry[HTTPD_DIR_ENTRY_MAX];
+  uint size;
+  while(httpd_writeRoom(httpd_request) >= HTTPD_DIR_ENTRY_MAX + strlen(httpd_dirEnd(list->json))) {
+    if(!dir.next()) {
+      httpd_print(httpd_request, httpd_dirEnd(list->json));
+      return false;
+    }
+    list->next++;
+    if(!httpd_dirName(dir, fn, size)) continue;
+    httpd_write(httpd_request, entry, httpd_dirEntry(entry, fn, size, list->json, !list->written));
+    list->written = true;
+  }
+  return true;
+}
+
+// Lists the files, as HTML links or JSON. The listing is served from the file cache if it's on,
+// with an ETag like any file, and is only rebuilt once the file system has changed. Otherwise it
+// is streamed from the directory as it is sent.
+bool httpd_dirList(espconn* pEspconn, HttpRequest &httpd_request, bool json) {
+  if(!httpd_fsMounted) return false;
+  if(httpd_cacheFind(httpd_dirKey(json)) || httpd_dirCache(json, (char*) httpd_request.txBuf)) {
+    return httpd_serveFile(httpd_request, httpd_dirKey(json), json ? "/dirlist.json" : "/dirlist.htm", false);
+  }
+  HttpDirList* list = (HttpDirList*) httpd_arenaAlloc(httpd_request, sizeof(HttpDirList));
+  if(!list) return false;
+  memset(list, 0, sizeof(HttpDirList));
+  list->json = json;
+  httpd_beginStream(pEspconn, 200, json ? "application/json" : "text/html", httpd_dirGenerate, list);
+  return true;
+}
+
+bool httpd_dirHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg) {
+  LOGD("Dir Handler");
+  return httpd_dirList(pEspconn, httpd_request, false);
+}
+
+bool httpd_dirJsonHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg) {
+  LOGD("Dir JSON Handler");
+  return httpd_dirList(pEspconn, httpd_request, true);
+}
+
+/********************************************************
+   Upload Functions
+ ********************************************************/
+
+// Where the multipart/form-data parser is within the body.
+enum HttpUploadState { UP_PREAMBLE, UP_BOUNDARY, UP_CLOSE, UP_HEADERS, UP_DATA, UP_DONE };
+
+// Longest boundary allowed by RFC 2046, and the longest part header line kept; the rest of a
+// longer line is dropped.
+#define HTTPD_UPLOAD_BOUNDARY 70
+#define HTTPD_UPLOAD_LINE 128
+// Longest path SPIFFS allows, including the terminator.
+#define HTTPD_UPLOAD_PATH 32
+
+// The state of an upload, kept in the arena and pointed to by data.
+struct HttpUpload {
+  uint8_t state;
+  uint8_t lenDelim;
+  uint8_t match;     // Bytes of the delimiter matched so far.
+  uint8_t lenLine;
+  uint8_t files;
+  uint16_t lenBuf;
+  uint32_t bytes;
+  uint32_t hash;     // Of the file data written so far, for the file's ETag.
+  char delim[4 + HTTPD_UPLOAD_BOUNDARY];  // CRLF, "--" and the boundary, which ends each part.
+  char line[HTTPD_UPLOAD_LINE];
+  char path[HTTPD_UPLOAD_PATH];  // The file being written, if the part is one.
+  uint8_t buf[HTTPD_UPLOAD_BUFFER_SIZE];
+};
+
+// Reads the boundary from a multipart/form-data Content-Type into the delimiter that ends each part.
+bool httpd_uploadBoundary(HttpUpload* up, const char* contentType) {
+  if(!contentType || strncasecmp(contentType, "multipart/form-data", 19) != 0) return false;
+  const char* p = contentType + 19;
+  while((p = strchr(p, ';'))) {
+    p++;
+    while(*p == ' ' || *p == '\t') p++;
+    if(strncasecmp(p, "boundary=", 9) != 0) continue;
+    p += 9;
+    bool quoted = *p == '"';
+    if(quoted) p++;
+    uint8_t len = 0;
+    while(p[len] && (quoted ? p[len] != '"' : p[len] != ';' && p[len] != ' ')) {
+      if(++len > HTTPD_UPLOAD_BOUNDARY) return false;
+    }
+    if(len == 0) return false;
+    memcpy(up->delim, "\r\n--", 4);
+    memcpy(up->delim + 4, p, len);
+    up->lenDelim = 4 + len;
+    return true;
+  }
+  return false;
+}
+
+// Picks the filename out of a part's Content-Disposition line, and makes it the path of a file in
+// dir. Any directories in the name are dropped. Returns false if there is no usable filename.
+bool httpd_uploadPath(HttpUpload* up, const char* dir) {
+  if(strncasecmp(up->line, "Content-Disposition:", 20) != 0) return false;
+  const char* p = up->line + 20;
+  const char* name = NULL;
+  while((p = strchr(p, ';'))) {
+    p++;
+    while(*p == ' ' || *p == '\t') p++;
+    if(strncasecmp(p, "filename=\"", 10) == 0) {
+      name = p + 10;
+      break;
+    }
+  }
+  if(!name) return false;
+  const char* end = strchr(name, '"');
+  if(!end) return false;
+  for(const char* q = name; q < end; q++) {
+    if(*q == '/' || *q == '\\') name = q + 1;
+  }
+  uint lenDir = strlen(dir);
+  if(end == name || lenDir + (end - name) >= HTTPD_UPLOAD_PATH) return false;
+  memcpy(up->path, dir, lenDir);
+  memcpy(up->path + lenDir, name, end - name);
+  up->path[lenDir + (end - name)] = '\0';
+  return true;
+}
+
+// Writes the buffered file data to flash.
+bool httpd_uploadFlush(HttpRequest &httpd_request, HttpUpload* up) {
+  if(!up->lenBuf) return true;
+  bool ok = httpd_request.file.write(up->buf, up->lenBuf) == up->lenBuf;
+  up->hash = httpd_hashBytes(up->hash, up->buf, up->lenBuf);
+  up->bytes += up->lenBuf;
+  up->lenBuf = 0;
+  return ok;
+}
+
+bool httpd_uploadData(HttpRequest &httpd_request, HttpUpload* up, const char* pData, uint len) {
+  if(!httpd_request.file) return true;  // A form field rather than a file; it's ignored.
+  while(len) {
+    uint lenCopy = HTTPD_UPLOAD_BUFFER_SIZE - up->lenBuf;
+    if(lenCopy > len) lenCopy = len;
+    memcpy(up->buf + up->lenBuf, pData, lenCopy);
+    up->lenBuf += lenCopy;
+    pData += lenCopy;
+    len -= lenCopy;
+    if(up->lenBuf == HTTPD_UPLOAD_BUFFER_SIZE && !httpd_uploadFlush(httpd_request, up)) return false;
+  }
+  return true;
+}
+
+// Finishes the file a part was written to. The file cache may hold an older version of it.
+bool httpd_uploadEndPart(HttpRequest &httpd_request, HttpUpload* up) {
+  if(!httpd_request.file) return true;
+  bool ok = httpd_uploadFlush(httpd_request, up);
+  uint size = httpd_request.file.size();
+  httpd_request.file.close();
+  httpd_cacheInvalidate(up->path);
+  if(!ok) return false;
+  // It has just been hashed, so it won't need to be when it's served.
+  httpd_etagRemember(httpd_cacheHash(up->path), size, up->hash);
+  LOGI("Uploaded %s", up->path);
+  up->files++;
+  up->path[0] = '\0';
+  return true;
+}
+
+// Abandons an upload, removing the file it was part way through.
+bool httpd_uploadFail(HttpRequest &httpd_request, HttpUpload* up, uint16_t responseCode) {
+  LOGW("Upload failed: %d", responseCode);
+  if(httpd_request.file) {
+    httpd_request.file.close();
+    SPIFFS.remove(up->path);
+    httpd_cacheInvalidate(up->path);
+  }
+  httpd_request.parseError = responseCode;
+  return false;
+}
+
+// Takes a multipart/form-data body as it arrives and writes each file in it to SPIFFS, in the
+// directory given as the route's handlerArg ("/" if none). The body is searched for the boundaries
+// between parts a byte at a time, so a boundary may be split across any number of segments, and
+// file data goes to flash through a small buffer. Form fields other than files are ignored.
+bool httpd_uploadBody(HttpRequest &httpd_request, const char* pData, uint len, void* handlerArg) {
+  HttpUpload* up = (HttpUpload*) httpd_request.data;
+  if(httpd_request.lenSoFar == 0) {
+    if(!httpd_fsMounted) return false;
+    up = (HttpUpload*) httpd_arenaAlloc(httpd_request, sizeof(HttpUpload));
+    if(!up) return false;
+    memset(up, 0, offsetof(HttpUpload, buf));
+    if(!httpd_uploadBoundary(up, httpd_getHeader(httpd_request, "Content-Type"))) {
+      httpd_request.parseError = 415;
+      return false;
+    }
+    // The first boundary isn't preceded by a line break, unless there's a preamble.
+    up->match = 2;
+    httpd_request.data = (char*) up;
+  }
+  const char* dir = handlerArg ? (const char*) handlerArg : "/";
+
+  const char* run = pData;  // Start of the file data not yet buffered.
+  for(uint i = 0; i < len; i++) {
+    char c = pData[i];
+    switch(up->state) {
+    case UP_PREAMBLE:
+    case UP_DATA:
+      if(c == up->delim[up->match]) {
+        if(++up->match < up->lenDelim) break;
+        // The boundary is complete. What came before it, less the part that matched, is data.
+        if(up->state == UP_DATA) {
+          const char* runEnd = pData + i + 1 - up->lenDelim;
+          if(runEnd > run && !httpd_uploadData(httpd_request, up, run, runEnd - run)) return httpd_uploadFail(httpd_request, up, 507);
+          if(!httpd_uploadEndPart(httpd_request, up)) return httpd_uploadFail(httpd_request, up, 507);
+        }
+        up->match = 0;
+        up->state = UP_BOUNDARY;
+        break;
+      }
+      if(up->match) {
+        // What looked like the start of a boundary wasn't. The bytes matched are data after all.
+        // Those held back from earlier segments go ahead of the run, which holds the rest.
+        if(up->state == UP_DATA) {
+          uint inRun = pData + i - run;
+          if(up->match > inRun) {
+            if(!httpd_uploadData(httpd_request, up, up->delim, up->match - inRun)) return httpd_uploadFail(httpd_request, up, 507);
+            if(inRun && !httpd_uploadData(httpd_request, up, run, inRun)) return httpd_uploadFail(httpd_request, up, 507);
+            run = pData + i;
+          }
+        }
+        // A CR can only start a boundary; it appears nowhere else in one.
+        up->match = c == '\r' ? 1 : 0;
+      }
+      break;
+    case UP_BOUNDARY:
+      // "--" after a boundary ends the body; otherwise the part's headers follow the line break.
+      if(c == '-') up->state = UP_CLOSE;
+      else if(c == '\n') {
+        up->state = UP_HEADERS;
+        up->lenLine = 0;
+      } else if(c != '\r' && c != ' ' && c != '\t') return httpd_uploadFail(httpd_request, up, 400);
+      break;
+    case UP_CLOSE:
+      if(c != '-') return httpd_uploadFail(httpd_request, up, 400);
+      up->state = UP_DONE;
+      break;
+    case UP_HEADERS:
+      if(c == '\r') break;
+      if(c != '\n') {
+        if(up->lenLine < HTTPD_UPLOAD_LINE - 1) up->line[up->lenLine++] = c;
+        break;
+      }
+      if(up->lenLine) {
+        up->line[up->lenLine] = '\0';
+        up->lenLine = 0;
+        if(httpd_uploadPath(up, dir)) LOGD("Upload to %s", up->path);
+        break;
+      }
+      // A blank line ends the part's headers.
+      if(up->path[0]) {
+        httpd_request.file = SPIFFS.open(up->path, "w");
+        if(!httpd_request.file) return httpd_uploadFail(httpd_request, up, 500);
+        up->hash = HTTPD_FNV_BASIS;
+      }
+      up->state = UP_DATA;
+      run = pData + i + 1;
+      break;
+    case UP_DONE:
+      // Anything after the last boundary is ignored.
+      return true;
+    }
+  }
+  // Data up to a possible boundary is buffered; the bytes that may be one are held back until
+  // the next segment shows whether they are.
+  if(up->state == UP_DATA) {
+    uint inRun = pData + len - run;
+    if(inRun > up->match && !httpd_uploadData(httpd_request, up, run, inRun - up->match)) return httpd_uploadFail(httpd_request, up, 507);
+  }
+  return true;
+}
+
+// Answers an upload once httpd_uploadBody() has had all of it. Route POSTs to it with
+// httpd_uploadBody as the body function.
+bool httpd_uploadHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg) {
+  LOGD("Upload Handler");
+  HttpUpload* up = (HttpUpload*) httpd_request.data;
+  if(!up || up->state != UP_DONE) {
+    // The body ended part way through.
+    if(up) httpd_uploadFail(httpd_request, up, 400);
+    httpd_send(pEspconn, 400);
+    return true;
+  }
+  uint8_t files = up->files;
+  uint32_t bytes = up->bytes;
+  httpd_beginStream(pEspconn, 200, "text/plain");
+  httpd_printf(httpd_request, "%u files, %u bytes uploaded\n", files, bytes);
+  httpd_endStream(httpd_request);
+  return true;
+}
+
+/********************************************************
+   JSON Functions
+ ********************************************************/
+
+// httpd_parseJson() tokenizes a JSON body where it lies in data, in the manner of jsmn: nothing is
+// copied, and each value becomes a JsonToken giving its place in the body. The tokens go in what's
+// left of the arena, so neither the body nor its tokens take any heap. A token is 8 bytes, and there
+// is one for every value and every key, so the tokens of a configuration of many short values take
+// more room than the body.
+
+// JsonToken flags
+#define JSON_OPEN 0x01     // An object or array not yet ended. Meanwhile next holds its parent.
+#define JSON_ESCAPED 0x02  // A string with backslash escapes still in it.
+#define JSON_KEY 0x04      // A string that's the key of an object member.
+
+// What the tokenizer may find next, besides white space.
+#define JSON_EXPECT_VALUE 0x01
+#define JSON_EXPECT_KEY 0x02
+#define JSON_EXPECT_COLON 0x04
+#define JSON_EXPECT_COMMA 0x08
+#define JSON_EXPECT_CLOSE 0x10
+
+// What may follow a value in the given container. Nothing may follow the outermost value.
+uint8_t httpd_jsonAfterValue(int16_t parent) {
+  return parent == NOT_FOUND ? 0 : JSON_EXPECT_COMMA | JSON_EXPECT_CLOSE;
+}
+
+// Checks the text of a number, true, false or null.
+bool httpd_jsonPrimitive(const char* p, uint len) {
+  if((len == 4 && memcmp(p, "true", 4) == 0) || (len == 5 && memcmp(p, "false", 5) == 0) || (len == 4 && memcmp(p, "null", 4) == 0)) return true;
+  if(*p != '-' && !isdigit((uint8_t) *p)) return false;
+  for(uint i = 0; i < len; i++) {
+    if(!isdigit((uint8_t) p[i]) && p[i] != '-' && p[i] != '+' && p[i] != '.' && p[i] != 'e' && p[i] != 'E') return false;
+  }
+  return true;
+}
+
+// Tokenizes the request body as JSON. Returns the number of tokens, or a JSON_ERROR code. Call it
+// before starting the response, which reuses lenData. The first token is the outermost value.
+int16_t httpd_parseJson(HttpRequest &httpd_request) {
+  httpd_request.json = NULL;
+  httpd_request.jsonCount = 0;
+  if(!httpd_request.data) return JSON_ERROR_PARTIAL;
+  // Take the rest of the arena for the tokens, and give back what isn't used once they're known.
+  uint16_t arenaUsed = httpd_request.arenaUsed;
+  uint16_t room = (HTTPD_ARENA_SIZE - arenaUsed) / sizeof(JsonToken);
+  JsonToken* tokens = room ? (JsonToken*) httpd_arenaAlloc(httpd_request, room * sizeof(JsonToken)) : NULL;
+  if(!tokens) return JSON_ERROR_NOMEM;
+
+  const char* json = httpd_request.data;
+  uint len = httpd_request.lenData;
+  uint16_t count = 0;
+  int16_t parent = NOT_FOUND;
+  uint8_t expect = JSON_EXPECT_VALUE;
+  int16_t error = 0;
+  for(uint pos = 0; pos < len && !error; pos++) {
+    char c = json[pos];
+    if(c == ' ' || c == '\t' || c == '\r' || c == '\n') continue;
+    if(c == '}' || c == ']') {
+      if(!(expect & JSON_EXPECT_CLOSE) || tokens[parent].type != (c == '}' ? JSON_OBJECT : JSON_ARRAY)) {
+        error = JSON_ERROR_INVALID;
+        break;
+      }
+      JsonToken &t = tokens[parent];
+      parent = t.next;
+      t.next = count;
+      t.len = pos + 1 - t.start;
+      t.flags &= ~JSON_OPEN;
+      expect = httpd_jsonAfterValue(parent);
+      continue;
+    }
+    if(c == ':' || c == ',') {
+      if(!(expect & (c == ':' ? JSON_EXPECT_COLON : JSON_EXPECT_COMMA))) {
+        error = JSON_ERROR_INVALID;
+      } else {
+        expect = c == ':' || tokens[parent].type == JSON_ARRAY ? JSON_EXPECT_VALUE : JSON_EXPECT_KEY;
+      }
+      continue;
+    }
+    // Anything else starts a value, or a key.
+    if(!(expect & (c == '"' ? JSON_EXPECT_VALUE | JSON_EXPECT_KEY : JSON_EXPECT_VALUE))) {
+      error = JSON_ERROR_INVALID;
+      break;
+    }
+    if(count == room) {
+      error = JSON_ERROR_NOMEM;
+      break;
+    }
+    JsonToken &t = tokens[count];
+    t.flags = 0;
+    if(c == '{' || c == '[') {
+      t.type = c == '{' ? JSON_OBJECT : JSON_ARRAY;
+      t.start = pos;
+      t.flags = JSON_OPEN;
+      t.next = parent;
+      parent = count++;
+      expect = (c == '{' ? JSON_EXPECT_KEY : JSON_EXPECT_VALUE) | JSON_EXPECT_CLOSE;
+      continue;
+    }
+    t.type = c == '"' ? JSON_STRING : JSON_PRIMITIVE;
+    if(c == '"') {
+      t.start = ++pos;
+      for(; pos < len && json[pos] != '"'; pos++) {
+        if((uint8_t) json[pos] < 0x20) {
+          error = JSON_ERROR_INVALID;
+          break;
+        }
+        if(json[pos] != '\\') continue;
+        t.flags |= JSON_ESCAPED;
+        if(++pos == len) break;
+        if(json[pos] == 'u') {
+          for(uint8_t i = 0; i < 4; i++) {
+            if(++pos == len) break;
+            if(!isxdigit((uint8_t) json[pos])) error = JSON_ERROR_INVALID;
+          }
+        } else if(!json[pos] || !strchr("\"\\/bfnrt", json[pos])) {
+          error = JSON_ERROR_INVALID;
+        }
+      }
+      if(pos >= len && !error) error = JSON_ERROR_PARTIAL;
+      if(error) break;
+      t.len = pos - t.start;
+      if(expect & JSON_EXPECT_KEY) t.flags |= JSON_KEY;
+    } else {
+      t.start = pos;
+      while(pos < len && json[pos] && !strchr(" \t\r\n,:]}", json[pos])) pos++;
+      t.len = pos - t.start;
+      if(!httpd_jsonPrimitive(json + t.start, t.len)) {
+        error = JSON_ERROR_INVALID;
+        break;
+      }
+      // The character that ended it is looked at next time round.
+      pos--;
+    }
+    t.next = ++count;
+    expect = t.flags & JSON_KEY ? JSON_EXPECT_COLON : httpd_jsonAfterValue(parent);
+  }
+  if(!error && (parent != NOT_FOUND || count == 0)) error = JSON_ERROR_PARTIAL;
+  httpd_request.arenaUsed = arenaUsed;
+  if(error) {
+    LOGW("JSON body not parsed: %d", error);
+    return error;
+  }
+  httpd_request.json = (JsonToken*) httpd_arenaAlloc(httpd_request, count * sizeof(JsonToken));
+  httpd_request.jsonCount = count;
+  return count;
+}
+
+uint8_t httpd_hexDigit(char c) {
+  return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+uint16_t httpd_hex4(const char* p) {
+  return httpd_hexDigit(p[0]) << 12 | httpd_hexDigit(p[1]) << 8 | httpd_hexDigit(p[2]) << 4 | httpd_hexDigit(p[3]);
+}
+
+// Decodes the escapes in a string token where it lies, as UTF-8. What an escape stands for is
+// always shorter than the escape, so the string just gets shorter.
+void httpd_jsonUnescape(HttpRequest &httpd_request, JsonToken &t) {
+  if(!(t.flags & JSON_ESCAPED)) return;
+  char* in = httpd_request.data + t.start;
+  const char* end = in + t.len;
+  char* out = in;
+  while(in < end) {
+    if(*in != '\\') {
+      *out++ = *in++;
+      continue;
+    }
+    in++;
+    char c = *in++;
+    if(c != 'u') {
+      const char* p = strchr("b\bf\fn\nr\rt\t", c);
+      *out++ = p ? p[1] : c;
+      continue;
+    }
+    uint32_t cp = httpd_hex4(in);
+    in += 4;
+    // A character beyond the Basic Multilingual Plane comes as a pair of surrogates.
+    if(cp >= 0xD800 && cp < 0xDC00 && end - in >= 6 && in[0] == '\\' && in[1] == 'u') {
+      uint16_t low = httpd_hex4(in + 2);
+      if(low >= 0xDC00 && low < 0xE000) {
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        in += 6;
+      }
+    }
+    if(cp < 0x80) {
+      *out++ = cp;
+    } else if(cp < 0x800) {
+      *out++ = 0xC0 | cp >> 6;
+      *out++ = 0x80 | (cp & 0x3F);
+    } else if(cp < 0x10000) {
+      *out++ = 0xE0 | cp >> 12;
+      *out++ = 0x80 | ((cp >> 6) & 0x3F);
+      *out++ = 0x80 | (cp & 0x3F);
+    } else {
+      *out++ = 0xF0 | cp >> 18;
+      *out++ = 0x80 | ((cp >> 12) & 0x3F);
+      *out++ = 0x80 | ((cp >> 6) & 0x3F);
+      *out++ = 0x80 | (cp & 0x3F);
+    }
+  }
+  t.len = out - (httpd_request.data + t.start);
+  t.flags &= ~JSON_ESCAPED;
+}
+
+// Returns the token of the value at path within the object or array token parent, 0 for the
+// whole body. A path is keys and array indexes separated by dots, as in "config.pins.2". Returns
+// NOT_FOUND if there's nothing there. Keys with escapes are unescaped where they lie to compare them.
+int16_t httpd_jsonFind(HttpRequest &httpd_request, int16_t parent, const char* path) {
+  JsonToken* tokens = httpd_request.json;
+  if(parent < 0 || parent >= httpd_request.jsonCount) return NOT_FOUND;
+  int16_t t = parent;
+  while(*path) {
+    const char* end = strchr(path, '.');
+    if(!end) end = path + strlen(path);
+    uint lenKey = end - path;
+    int16_t found = NOT_FOUND;
+    if(tokens[t].type == JSON_OBJECT) {
+      // Members are a key and a value, so each step skips the value and all that's in it.
+      for(int16_t k = t + 1; k < tokens[t].next; k = tokens[k + 1].next) {
+        httpd_jsonUnescape(httpd_request, tokens[k]);
+        if(tokens[k].len == lenKey && memcmp(httpd_request.data + tokens[k].start, path, lenKey) == 0) {
+          found = k + 1;
+          break;
+        }
+      }
+    } else if(tokens[t].type == JSON_ARRAY && lenKey && isdigit((uint8_t) *path)) {
+      uint index = strtoul(path, NULL, 10);
+      for(int16_t e = t + 1; e < tokens[t].next; e = tokens[e].next) {
+        if(index-- == 0) {
+          found = e;
+          break;
+        }
+      }
+    }
+    if(found == NOT_FOUND) return NOT_FOUND;
+    t = found;
+    path = *end ? end + 1 : end;
+  }
+  return t;
+}
+
+// Returns a string or primitive as a C-string in place: a string is unescaped, and the character
+// after the value in the body is overwritten with the terminator. Returns NULL for an object or
+// array, or NOT_FOUND.
+char* httpd_jsonValue(HttpRequest &httpd_request, int16_t token) {
+  if(token < 0 || token >= httpd_request.jsonCount) return NULL;
+  JsonToken &t = httpd_request.json[token];
+  if(t.type != JSON_STRING && t.type != JSON_PRIMITIVE) return NULL;
+  httpd_jsonUnescape(httpd_request, t);
+  char* p = httpd_request.data + t.start;
+  p[t.len] = '\0';
+  return p;
+}
+
+// Returns the value at path as a C-string, or NULL. See httpd_jsonValue().
+char* httpd_jsonGet(HttpRequest &httpd_request, const char* path) {
+  return httpd_jsonValue(httpd_request, httpd_jsonFind(httpd_request, 0, path));
+}
+
+// Returns the number at path, or dflt if there isn't one.
+long httpd_jsonInt(HttpRequest &httpd_request, const char* path, long dflt) {
+  int16_t t = httpd_jsonFind(httpd_request, 0, path);
+  if(t == NOT_FOUND || httpd_request.json[t].type != JSON_PRIMITIVE) return dflt;
+  const char* p = httpd_jsonValue(httpd_request, t);
+  return *p == '-' || isdigit((uint8_t) *p) ? strtol(p, NULL, 10) : dflt;
+}
 
-    sprintf(httphead,
-      "HTTP/1.0 200 OK\r\nContent-Length: %d\r\nServer: %s\r\nContent-type: %s\r\n\r\n",
-      httpd_request.lenData,
-      HTTPD_SERVER,
-      mime
-    );
+// Returns the true or false at path, or dflt if there isn't one.
+bool httpd_jsonBool(HttpRequest &httpd_request, const char* path, bool dflt) {
+  const char* p = httpd_jsonValue(httpd_request, httpd_jsonFind(httpd_request, 0, path));
+  if(p && strcmp(p, "true") == 0) return true;
+  if(p && strcmp(p, "false") == 0) return false;
+  return dflt;
+}
+
+/********************************************************
+   WebSocket Functions
+ ********************************************************/
+
+// A route to httpd_wsHandler() upgrades its connection to a WebSocket (RFC 6455). The connection
+// keeps its slot, whose outbound queue then carries frames, and frames are parsed as they arrive
+// however they are split across segments. Messages are put together from their fragments in the
+// arena, pings are answered and a close from the client is echoed before the connection is closed.
+
+// Appended to the client's key for the accept key, which shows the client it's talking WebSocket.
+#define HTTPD_WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define HTTPD_WS_KEY 24
+// Longest frame header: 2 bytes, an 8 byte length and a 4 byte mask.
+#define HTTPD_WS_HEAD_MAX 14
+// Most a control frame (close, ping or pong) may carry.
+#define HTTPD_WS_CONTROL_MAX 125
+
+// The state of a WebSocket connection, kept in its arena and pointed to by ws.
+struct HttpWsConn {
+  HttpWebSocket* socket;
+  uint8_t head[HTTPD_WS_HEAD_MAX];  // The header of the frame being read, as far as it has come.
+  uint8_t lenHead;
+  bool inPayload;
+  bool fin;          // The frame being read is the last of its message.
+  bool closing;      // A close frame has been sent, or the connection has gone; nothing more is sent.
+  uint8_t opcode;    // Of the frame being read.
+  uint8_t msgOpcode; // Of the message being put together, or WS_CONTINUATION between messages.
+  uint8_t mask[4];
+  uint32_t lenPayload;
+  uint32_t payloadPos;
+  uint16_t lenMessage;
+  char control[HTTPD_WS_CONTROL_MAX + 1];  // The payload of a control frame, which may come between fragments.
+  char message[HTTPD_WS_MAX_MESSAGE + 1];
+};
+
+uint32_t httpd_rol(uint32_t x, uint8_t n) {
+  return x << n | x >> (32 - n);
+}
+
+// Adds a 64 byte block to a SHA-1 hash. The message schedule is kept to 16 words, to spare the stack.
+void httpd_sha1Block(uint32_t* h, const uint8_t* block) {
+  uint32_t w[16];
+  for(uint8_t i = 0; i < 16; i++) {
+    w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 | (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+  }
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+  for(uint8_t i = 0; i < 80; i++) {
+    if(i >= 16) w[i & 15] = httpd_rol(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+    uint32_t f, k;
+    if(i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    } else if(i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    } else if(i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    uint32_t t = httpd_rol(a, 5) + f + e + k + w[i & 15];
+    e = d;
+    d = c;
+    c = httpd_rol(b, 30);
+    b = a;
+    a = t;
+  }
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+// Writes the 20 byte SHA-1 hash of len bytes to digest.
+void httpd_sha1(const uint8_t* p, uint len, uint8_t* digest) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  uint pos = 0;
+  for(; len - pos >= 64; pos += 64) httpd_sha1Block(h, p + pos);
+  // The last block is padded with a 1 bit, then zeros, then the length in bits, taking two blocks
+  // if there isn't room in one.
+  uint8_t block[64];
+  uint rest = len - pos;
+  memcpy(block, p + pos, rest);
+  block[rest++] = 0x80;
+  if(rest > 56) {
+    memset(block + rest, 0, 64 - rest);
+    httpd_sha1Block(h, block);
+    rest = 0;
+  }
+  memset(block + rest, 0, 56 - rest);
+  uint64_t bits = (uint64_t) len * 8;
+  for(uint8_t i = 0; i < 8; i++) block[56 + i] = bits >> (56 - 8 * i);
+  httpd_sha1Block(h, block);
+  for(uint8_t i = 0; i < 20; i++) digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+// Writes len bytes to out in base64, NUL-terminated. out needs room for 4 * ((len + 2) / 3) + 1.
+void httpd_base64(const uint8_t* p, uint len, char* out) {
+  const char* digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  for(uint i = 0; i < len; i += 3) {
+    uint32_t n = (uint32_t) p[i] << 16 | (i + 1 < len ? p[i + 1] << 8 : 0) | (i + 2 < len ? p[i + 2] : 0);
+    *out++ = digits[n >> 18];
+    *out++ = digits[(n >> 12) & 0x3F];
+    *out++ = i + 1 < len ? digits[(n >> 6) & 0x3F] : '=';
+    *out++ = i + 2 < len ? digits[n & 0x3F] : '=';
+  }
+  *out = '\0';
+}
 
-    SPF("lenData: %d sending header: %d\n", httpd_request.lenData, strlen(httphead));
-    espconn_send(pEspconn, (uint8 *)httphead, strlen(httphead));
-    httpd_request.method = HTTP_SENDING;
-  } else if(httpd_request.lenSoFar == httpd_request.lenData) {
-    SPN(" ... File sent");
+// Queues a frame after whatever is waiting to be sent. Returns false if there isn't room for it.
+bool httpd_wsQueue(HttpRequest &httpd_request, uint8_t opcode, const void* pData, uint len) {
+  // Without ESPCONN_COPY the SDK sends from the queue itself, so what's in flight mustn't move.
+  if(HTTPD_TX_WINDOW > 1 || !httpd_request.txInFlight) httpd_compactTx(httpd_request);
+  // The queue is smaller than 64K, so a 16 bit length always does.
+  uint lenHead = len < 126 ? 2 : 4;
+  if(httpd_request.txLen + lenHead + len > HTTPD_TX_BUFFER_SIZE) return false;
+  // Frames from the server are sent whole and aren't masked.
+  uint8_t* p = httpd_request.txBuf + httpd_request.txLen;
+  *p++ = 0x80 | opcode;
+  if(len < 126) {
+    *p++ = len;
   } else {
-    uint lenToSend = httpd_request.lenData - httpd_request.lenSoFar;
-    if(lenToSend > FILE_BUFFER_SIZE) lenToSend = FILE_BUFFER_SIZE;
-    SPF("lenData: %d lenSoFar: %d lenToSend: %d\n", httpd_request.lenData, httpd_request.lenSoFar, lenToSend);
-    char buf[lenToSend];
-    f.seek(httpd_request.lenSoFar, SeekSet);
-    f.readBytes(buf, lenToSend);
-    espconn_send(pEspconn, (uint8 *)buf, lenToSend);
-    httpd_request.lenSoFar += lenToSend;
+    *p++ = 126;
+    *p++ = len >> 8;
+    *p++ = len & 0xFF;
   }
+  if(len) memcpy(p, pData, len);
+  httpd_request.txLen += lenHead + len;
+  return true;
+}
 
-  f.close();
+// Sends a message in a single frame, or a ping or pong. Returns false if the connection isn't an
+// open WebSocket, or if its outbound queue hasn't room for the frame, which is then dropped.
+bool httpd_wsSend(HttpRequest &httpd_request, uint8_t opcode, const void* pData, uint len) {
+  if(httpd_request.method != HTTP_WEBSOCKET || httpd_request.ws->closing) return false;
+  if(!httpd_wsQueue(httpd_request, opcode, pData, len)) {
+    LOGW("No room to send a %d byte WebSocket frame", len);
+    httpd_counters.wsDropped++;
+    return false;
+  }
+  httpd_flush(httpd_request);
   return true;
 }
 
-bool httpd_dirHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg) {
-  SPN("\nDir Handler");
+bool httpd_wsSendText(HttpRequest &httpd_request, const char* pStr) {
+  return httpd_wsSend(httpd_request, WS_TEXT, pStr, strlen(pStr));
+}
+
+// Sends a message to every connection the WebSocket has upgraded. A connection whose queue is too
+// full to take it misses out, so a slow client doesn't hold the rest up. Returns the number of
+// connections it was queued for.
+uint8_t httpd_wsBroadcast(HttpWebSocket* ws, uint8_t opcode, const void* pData, uint len) {
+  uint8_t sent = 0;
+  for(uint8_t r = 0; r < httpd_slotCount; r++) {
+    if(httpd_requests[r].method != HTTP_WEBSOCKET || httpd_requests[r].ws->socket != ws) continue;
+    if(httpd_wsSend(httpd_requests[r], opcode, pData, len)) sent++;
+  }
+  return sent;
+}
+
+uint8_t httpd_wsBroadcastText(HttpWebSocket* ws, const char* pStr) {
+  return httpd_wsBroadcast(ws, WS_TEXT, pStr, strlen(pStr));
+}
+
+// Sends a close frame with the given status code, or none if it's 0, and closes the connection
+// once the frame has gone.
+void httpd_wsClose(HttpRequest &httpd_request, uint16_t code) {
+  if(httpd_request.method != HTTP_WEBSOCKET || httpd_request.ws->closing) return;
+  LOGD("Closing WebSocket with %d", code);
+  const uint8_t payload[2] = {(uint8_t) (code >> 8), (uint8_t) (code & 0xFF)};
+  bool queued = httpd_wsQueue(httpd_request, WS_CLOSE, payload, code ? 2 : 0);
+  httpd_request.ws->closing = true;
+  if(queued) {
+    httpd_flush(httpd_request);
+    // The sent callback closes the connection once the queue has drained.
+    if(httpd_request.txPos < httpd_request.txLen || httpd_request.txInFlight) return;
+  }
+  httpd_request.txFlags |= TX_CLOSE;
+  os_timer_arm(&httpd_closeTimer, 0, false);
+}
+
+// Called when a segment sent on a WebSocket has been acknowledged.
+void httpd_wsSent(HttpRequest &httpd_request) {
+  httpd_flush(httpd_request);
+  if(httpd_request.ws->closing && httpd_request.txPos == httpd_request.txLen && !(httpd_request.txFlags & TX_CLOSE)) {
+    httpd_request.txFlags |= TX_CLOSE;
+    os_timer_arm(&httpd_closeTimer, 0, false);
+  }
+}
+
+// Called when a WebSocket's connection has gone, before its slot is freed.
+void httpd_wsEnd(HttpRequest &httpd_request) {
+  HttpWsConn* c = httpd_request.ws;
+  c->closing = true;
+  if(c->socket->onClose) c->socket->onClose(httpd_request, c->socket->arg);
+  httpd_request.ws = NULL;
+}
+
+// Returns the length of a frame header from as much of it as has arrived, or 0 if that isn't
+// known yet.
+uint8_t httpd_wsHeadLen(const uint8_t* head, uint8_t lenHead) {
+  if(lenHead < 2) return 0;
+  uint8_t len = head[1] & 0x80 ? 6 : 2;
+  if((head[1] & 0x7F) == 126) len += 2;
+  else if((head[1] & 0x7F) == 127) len += 8;
+  return len;
+}
+
+// Checks the header of a frame, which has all arrived, and readies the parser for its payload.
+// Returns the status code to close the connection with if the frame breaks the rules, or 0.
+uint16_t httpd_wsBeginFrame(HttpWsConn* c) {
+  const uint8_t* h = c->head;
+  const uint8_t* p = h + 2;
+  uint64_t len = h[1] & 0x7F;
+  if(len == 126) {
+    len = p[0] << 8 | p[1];
+    p += 2;
+  } else if(len == 127) {
+    len = 0;
+    for(uint8_t i = 0; i < 8; i++) len = len << 8 | p[i];
+    p += 8;
+  }
+  // A client masks every frame, and no extension has been agreed that would use the RSV bits.
+  if((h[0] & 0x70) || !(h[1] & 0x80)) return 1002;
+  memcpy(c->mask, p, 4);
+  c->opcode = h[0] & 0x0F;
+  c->fin = h[0] & 0x80;
+  if(c->opcode >= WS_CLOSE) {
+    // Control frames can't be fragmented, but may come between the fragments of a message.
+    if(c->opcode > WS_PONG || !c->fin || len > HTTPD_WS_CONTROL_MAX) return 1002;
+  } else if(c->opcode == WS_CONTINUATION) {
+    if(c->msgOpcode == WS_CONTINUATION) return 1002;
+  } else if(c->opcode <= WS_BINARY) {
+    // A new message must wait for the last fragment of the one before.
+    if(c->msgOpcode != WS_CONTINUATION) return 1002;
+    c->msgOpcode = c->opcode;
+    c->lenMessage = 0;
+  } else {
+    return 1002;
+  }
+  if(c->opcode < WS_CLOSE && c->lenMessage + len > HTTPD_WS_MAX_MESSAGE) return 1009;
+  c->lenPayload = len;
+  c->payloadPos = 0;
+  return 0;
+}
+
+// Acts on a frame whose payload has all arrived.
+void httpd_wsEndFrame(HttpRequest &httpd_request) {
+  HttpWsConn* c = httpd_request.ws;
+  switch(c->opcode) {
+  case WS_PING:
+    httpd_wsSend(httpd_request, WS_PONG, c->control, c->lenPayload);
+    return;
+  case WS_PONG:
+    return;
+  case WS_CLOSE:
+    // Echo the client's status code, if it gave one.
+    httpd_wsClose(httpd_request, c->lenPayload >= 2 ? (uint8_t) c->control[0] << 8 | (uint8_t) c->control[1] : 0);
+    return;
+  }
+  c->lenMessage += c->lenPayload;
+  if(!c->fin) return;
+  c->message[c->lenMessage] = '\0';
+  uint8_t opcode = c->msgOpcode;
+  c->msgOpcode = WS_CONTINUATION;
+  httpd_counters.wsMessages++;
+  if(c->socket->onMessage) c->socket->onMessage(httpd_request, opcode, c->message, c->lenMessage, c->socket->arg);
+}
+
+// Parses frames from data received on a WebSocket. A frame may be split anywhere, so the parser
+// takes its header a byte at a time and its payload as it comes, unmasking it into place.
+void httpd_wsFeed(HttpRequest &httpd_request, const char* pData, uint len) {
+  HttpWsConn* c = httpd_request.ws;
+  // Once a close frame has been sent, whatever the client sends is ignored.
+  while(len && !c->closing) {
+    if(!c->inPayload) {
+      c->head[c->lenHead++] = *pData++;
+      len--;
+      uint8_t lenHead = httpd_wsHeadLen(c->head, c->lenHead);
+      if(!lenHead || c->lenHead < lenHead) continue;
+      c->lenHead = 0;
+      uint16_t code = httpd_wsBeginFrame(c);
+      if(code) {
+        LOGW("Bad WebSocket frame, closing with %d", code);
+        httpd_wsClose(httpd_request, code);
+        return;
+      }
+      c->inPayload = true;
+    } else {
+      uint n = c->lenPayload - c->payloadPos;
+      if(n > len) n = len;
+      char* p = (c->opcode >= WS_CLOSE ? c->control : c->message + c->lenMessage) + c->payloadPos;
+      for(uint i = 0; i < n; i++) p[i] = pData[i] ^ c->mask[(c->payloadPos + i) & 3];
+      c->payloadPos += n;
+      pData += n;
+      len -= n;
+    }
+    if(c->payloadPos == c->lenPayload) {
+      c->inPayload = false;
+      httpd_wsEndFrame(httpd_request);
+    }
+  }
+}
+
+// Answers a request that isn't a WebSocket handshake this server can accept.
+void httpd_wsRefuse(HttpRequest &httpd_request, uint responseCode) {
+  LOGW("WebSocket handshake refused with %d", responseCode);
+  httpd_endResponse(httpd_request);
+  char* buf = (char*) httpd_request.txBuf;
+  char* p = httpd_headStatus(buf, responseCode);
+  p = httpd_headStr(p, "Content-Length: 0\r\n" HTTPD_COMMON_HEAD);
+  // Tells the client which version of the protocol to try.
+  if(responseCode == 426) p = httpd_headStr(p, "Sec-WebSocket-Version: 13\r\n");
+  p += httpd_endHead(httpd_request, p);
+  httpd_beginResponse(httpd_request, p - buf, 0);
+  httpd_flush(httpd_request);
+}
+
+// Upgrades the connection to a WebSocket, whose HttpWebSocket is given as the handlerArg. The
+// connection is then the WebSocket's until either end closes it.
+bool httpd_wsHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg) {
+  LOGD("WebSocket Handler");
+  HttpWebSocket* socket = (HttpWebSocket*) handlerArg;
+  const char* upgrade = httpd_getHeader(httpd_request, "Upgrade");
+  const char* connection = httpd_getHeader(httpd_request, "Connection");
+  const char* version = httpd_getHeader(httpd_request, "Sec-WebSocket-Version");
+  const char* key = httpd_getHeader(httpd_request, "Sec-WebSocket-Key");
+  if(httpd_request.method != HTTP_GET || httpd_request.httpVersion < 11 ||
+    !upgrade || !httpd_hasToken(upgrade, "websocket") || !connection || !httpd_hasToken(connection, "upgrade") ||
+    !key || strlen(key) != HTTPD_WS_KEY) {
+    httpd_wsRefuse(httpd_request, 400);
+    return true;
+  }
+  if(!version || strcmp(version, "13") != 0) {
+    httpd_wsRefuse(httpd_request, 426);
+    return true;
+  }
+  HttpWsConn* c = (HttpWsConn*) httpd_arenaAlloc(httpd_request, sizeof(HttpWsConn));
+  if(!c) {
+    LOGE("No room for a WebSocket in the arena");
+    httpd_send(pEspconn, 500);
+    return true;
+  }
+  memset(c, 0, sizeof(HttpWsConn));
+  c->socket = socket;
+
+  char keyed[HTTPD_WS_KEY + sizeof(HTTPD_WS_GUID)];
+  memcpy(keyed, key, HTTPD_WS_KEY);
+  memcpy(keyed + HTTPD_WS_KEY, HTTPD_WS_GUID, sizeof(HTTPD_WS_GUID));
+  uint8_t digest[20];
+  httpd_sha1((const uint8_t*) keyed, sizeof(keyed) - 1, digest);
+  char accept[29];
+  httpd_base64(digest, sizeof(digest), accept);
+
+  httpd_endResponse(httpd_request);
+  char* buf = (char*) httpd_request.txBuf;
+  char* p = httpd_headStatus(buf, 101);
+  p = httpd_headStr(p, "Upgrade: websocket\r\nConnection: Upgrade\r\n");
+  p = httpd_headField(p, "Sec-WebSocket-Accept", accept);
+  p = httpd_headStr(p, "Server: " HTTPD_SERVER "\r\n\r\n");
+  httpd_beginResponse(httpd_request, p - buf, 0);
+  // The handshake is the last the metrics see of the connection as a request.
+  httpd_metricsRecord(httpd_request);
+  httpd_request.method = HTTP_WEBSOCKET;
+  httpd_request.ws = c;
+  espconn_regist_time(pEspconn, HTTPD_WS_IDLE_TIMEOUT_S, 1);
+  LOGD("WebSocket open");
+  // Whatever onOpen sends is queued behind the handshake.
+  if(socket->onOpen) socket->onOpen(httpd_request, socket->arg);
+  httpd_flush(httpd_request);
+  return true;
+}
+
+/********************************************************
+   Event Stream Functions
+ ********************************************************/
+
+// A route to httpd_sseHandler() answers with a text/event-stream (Server-Sent Events) that stays
+// open, and the connection becomes a subscriber to the route's HttpEventStream. The response has
+// no length; it ends when the connection closes. Events published to a subscriber go into its
+// backlog, and move on to the outbound queue only once what was queued before has been handed to
+// the SDK, so a slow client's events wait where the oldest can be dropped to make room.
+
+#if HTTPD_SSE_BACKLOG > HTTPD_TX_BUFFER_SIZE
+#error HTTPD_SSE_BACKLOG must fit in the outbound queue
+#endif
+
+// The state of an event stream subscriber, kept in its arena and pointed to by sse. Events waiting
+// to be sent are backlog[start..end), each ending in a blank line.
+struct HttpSseConn {
+  HttpEventStream* stream;
+  uint16_t start;
+  uint16_t end;
+  char backlog[HTTPD_SSE_BACKLOG];
+};
+
+// Appends len bytes to out, if it isn't NULL, and adds them to the count in pos.
+void httpd_sseAppend(char* out, uint &pos, const char* s, uint len) {
+  if(out) memcpy(out + pos, s, len);
+  pos += len;
+}
+
+// Formats an event into out and returns its length. With out NULL it just returns the length. Each
+// line of data gets a field of its own, and an event without data is a comment, which keeps the
+// connection from looking idle to a proxy. An id of 0 is left out.
+uint httpd_sseFormat(char* out, uint32_t id, const char* event, const char* data) {
+  uint pos = 0;
+  if(!data) {
+    httpd_sseAppend(out, pos, ":\n\n", 3);
+    return pos;
+  }
+  if(id) {
+    char digits[12];
+    httpd_sseAppend(out, pos, "id: ", 4);
+    httpd_sseAppend(out, pos, digits, httpd_headUint(digits, id) - digits);
+    httpd_sseAppend(out, pos, "\n", 1);
+  }
+  if(event) {
+    httpd_sseAppend(out, pos, "event: ", 7);
+    httpd_sseAppend(out, pos, event, strlen(event));
+    httpd_sseAppend(out, pos, "\n", 1);
+  }
+  const char* p = data;
+  do {
+    // A CR would end the line for the client, so it's left out.
+    const char* line = p;
+    while(*p && *p != '\n' && *p != '\r') p++;
+    httpd_sseAppend(out, pos, "data: ", 6);
+    httpd_sseAppend(out, pos, line, p - line);
+    httpd_sseAppend(out, pos, "\n", 1);
+    if(*p == '\r' && p[1] == '\n') p++;
+  } while(*p && *++p);
+  httpd_sseAppend(out, pos, "\n", 1);
+  return pos;
+}
+
+// Moves the backlog into the outbound queue and sends it, once the queue has been handed to the
+// SDK and the window has room for more.
+void httpd_ssePump(HttpRequest &httpd_request) {
+  HttpSseConn* c = httpd_request.sse;
+  if(c->start == c->end || httpd_request.txPos < httpd_request.txLen || httpd_request.txInFlight >= HTTPD_TX_WINDOW) return;
+  // The queue has all been sent, and with ESPCONN_COPY the SDK has its own copy of what's in flight.
+  uint len = c->end - c->start;
+  memcpy(httpd_request.txBuf, c->backlog + c->start, len);
+  httpd_request.txPos = 0;
+  httpd_request.txLen = len;
+  c->start = 0;
+  c->end = 0;
+  httpd_flush(httpd_request);
+}
 
-  if (!SPIFFS.begin()) {
-    SPN("Failed to start SPIFFS");
+// Puts an event in a subscriber's backlog, dropping the oldest to make room, and sends it if the
+// connection is ready for it. Returns false if the event is too long to go at all.
+bool httpd_sseQueue(HttpRequest &httpd_request, uint32_t id, const char* event, const char* data, uint len) {
+  HttpSseConn* c = httpd_request.sse;
+  if(len > HTTPD_SSE_BACKLOG) {
+    LOGW("A %d byte event is too long for the backlog", len);
+    httpd_counters.sseDropped++;
     return false;
   }
+  while(c->end - c->start + len > HTTPD_SSE_BACKLOG) {
+    // Every event ends in a blank line, and nothing else has one.
+    uint16_t p = c->start;
+    while(!(c->backlog[p] == '\n' && c->backlog[p + 1] == '\n')) p++;
+    c->start = p + 2;
+    httpd_counters.sseDropped++;
+  }
+  if(c->end + len > HTTPD_SSE_BACKLOG) {
+    memmove(c->backlog, c->backlog + c->start, c->end - c->start);
+    c->end -= c->start;
+    c->start = 0;
+  }
+  httpd_sseFormat(c->backlog + c->end, id, event, data);
+  c->end += len;
+  httpd_ssePump(httpd_request);
+  return true;
+}
 
-  File f = SPIFFS.open("/dirlist.htm", "w");
-  if(!f) {
-    SPN("dirlist.htm open failed");
+// An event name is sent as a single field, so it can't have a line break in it.
+bool httpd_sseEventName(const char* event) {
+  if(event && strpbrk(event, "\r\n")) {
+    LOGW("Event name with a line break");
     return false;
   }
+  return true;
+}
 
-  f.print("<html>\n<body>\n");
+// Sends an event to one subscriber, without an id, as onOpen might to bring a new subscriber up to
+// date. Returns false if the connection isn't an event stream, the event's name has a line break
+// in it, or the event is too long to send.
+bool httpd_sseSend(HttpRequest &httpd_request, const char* event, const char* data) {
+  if(httpd_request.method != HTTP_EVENTS || !httpd_sseEventName(event)) return false;
+  return httpd_sseQueue(httpd_request, 0, event, data, httpd_sseFormat(NULL, 0, event, data));
+}
 
-  Dir dir = SPIFFS.openDir("/");
-  char fn[128];
-  while (dir.next()) {
-    strcpy(fn, dir.fileName().c_str());
-    if(strcmp(fn, "/dirlist.htm") == 0) continue;
-    f.printf("<a href=\"%s\">%s</a><br>\n", fn, fn);
+// Sends an event to every subscriber to the stream, with the stream's next id. event may be NULL
+// for the default "message" type, and with data NULL as well a comment is sent, as a keep-alive.
+// Returns the number of subscribers it was queued for, none if event has a line break in it.
+uint8_t httpd_ssePublish(HttpEventStream* stream, const char* event, const char* data) {
+  if(!httpd_sseEventName(event)) return 0;
+  uint32_t id = data ? ++stream->lastId : 0;
+  uint len = httpd_sseFormat(NULL, id, event, data);
+  uint8_t sent = 0;
+  for(uint8_t r = 0; r < httpd_slotCount; r++) {
+    if(httpd_requests[r].method != HTTP_EVENTS || httpd_requests[r].sse->stream != stream) continue;
+    if(httpd_sseQueue(httpd_requests[r], id, event, data, len)) sent++;
   }
+  return sent;
+}
 
-  f.print("</body>\n</html>\n");
-  f.close();
-  SPN("Listing saved to /dirlist.htm");
+// Called when a segment sent on an event stream has been acknowledged.
+void httpd_sseSent(HttpRequest &httpd_request) {
+  httpd_flush(httpd_request);
+  httpd_ssePump(httpd_request);
+}
+
+// Called when a subscriber's connection has gone, before its slot is freed.
+void httpd_sseEnd(HttpRequest &httpd_request) {
+  HttpSseConn* c = httpd_request.sse;
+  // Nothing more can be sent to it.
+  httpd_request.method = HTTP_NONE;
+  if(c->stream->onClose) c->stream->onClose(httpd_request, c->stream->arg);
+  httpd_request.sse = NULL;
+}
 
-  return httpd_fileHandler(pEspconn, httpd_request, NULL);
+// Makes the connection a subscriber to the HttpEventStream given as the handlerArg. The response
+// goes on until the connection closes.
+bool httpd_sseHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg) {
+  LOGD("Event Stream Handler");
+  HttpEventStream* stream = (HttpEventStream*) handlerArg;
+  HttpSseConn* c = (HttpSseConn*) httpd_arenaAlloc(httpd_request, sizeof(HttpSseConn));
+  if(!c) {
+    LOGE("No room for an event stream in the arena");
+    httpd_send(pEspconn, 500);
+    return true;
+  }
+  c->stream = stream;
+  c->start = 0;
+  c->end = 0;
+
+  // Without a length, the end of the response is the end of the connection.
+  httpd_request.keepAlive = false;
+  httpd_endResponse(httpd_request);
+  char* buf = (char*) httpd_request.txBuf;
+  char* p = httpd_headStatus(buf, 200);
+  // X-Accel-Buffering stops nginx, as a reverse proxy, holding events back.
+  p = httpd_headStr(p, "Content-Type: text/event-stream\r\nCache-Control: no-cache\r\nX-Accel-Buffering: no\r\n" HTTPD_COMMON_HEAD);
+  p += httpd_endHead(httpd_request, p);
+  p = httpd_headStr(p, "retry: ");
+  p = httpd_headUint(p, HTTPD_SSE_RETRY_MS);
+  p = httpd_headStr(p, "\n\n");
+  httpd_beginResponse(httpd_request, p - buf, 0);
+  // The response starting is the last the metrics see of the connection as a request.
+  httpd_metricsRecord(httpd_request);
+  httpd_request.method = HTTP_EVENTS;
+  httpd_request.sse = c;
+  espconn_regist_time(pEspconn, HTTPD_SSE_IDLE_TIMEOUT_S, 1);
+  LOGD("Event stream open");
+  httpd_flush(httpd_request);
+  if(stream->onOpen) stream->onOpen(httpd_request, stream->arg);
+  return true;
 }
 
 /********************************************************
-   Utility Functions
+   Metrics Functions
  ********************************************************/
 
-void httpd_parseParams(HttpRequest &httpd_request, ParamLocation where) {
-  SPN("\n*** httpd_parseParams");
-  httpd_request.argCount = 0;
-  if(httpd_request.method == HTTP_ANY) return;
-  char* ptrStart;
-  if(where == HTTP_QUERY) {
-    if(!(ptrStart = strstr(httpd_request.uri, "?"))) return;
-    *ptrStart = '\0';
-    ptrStart++;
-    SPF("uri: %s query: %s\n", httpd_request.uri, ptrStart);
+// The counters are only ever added to, so they cost next to nothing to keep. They're formatted in
+// the Prometheus text format by httpd_metricsHandler(), which can be given a route:
+//   {HTTP_GET, "/metrics", httpd_metricsHandler, NULL}
+
+// Longest piece httpd_metricsGenerate() writes at a time. Route uris are cut short to fit.
+#define HTTPD_METRICS_PIECE 224
+#define HTTPD_METRICS_URI 96
+// Metrics numbered below HTTPD_METRICS_STATUS have a single value. The rest have a line for each
+// status code and each route respectively.
+#define HTTPD_METRICS_STATUS 22
+#define HTTPD_METRICS_LATENCY 23
+
+const HttpStats& httpd_stats() {
+  return httpd_counters;
+}
+
+void httpd_metricsHeap() {
+  uint32_t heap = ESP.getFreeHeap();
+  if(heap < httpd_counters.heapLow) httpd_counters.heapLow = heap;
+}
+
+// Counts a request whose response has gone.
+void httpd_metricsRecord(HttpRequest &httpd_request) {
+  if(httpd_routeStats) {
+    HttpRouteStats &stats = httpd_routeStats[httpd_request.route == NOT_FOUND ? httpd_routeCount : httpd_request.route];
+    uint ms = millis() - httpd_request.msStart;
+    uint8_t b = 0;
+    while(b < HTTPD_LATENCY_BUCKETS - 1 && ms > httpd_latencyBounds[b]) b++;
+    stats.buckets[b]++;
+    stats.msTotal += ms;
+  }
+  for(uint8_t i = 0; i < HTTPD_STATUS_CODES; i++) {
+    if(httpd_statusCounts[i].code == httpd_request.status || !httpd_statusCounts[i].code) {
+      httpd_statusCounts[i].code = httpd_request.status;
+      httpd_statusCounts[i].count++;
+      return;
+    }
+  }
+  httpd_statusOther++;
+}
+
+// Where httpd_metricsGenerate() is up to: which metric, and which line of it.
+struct HttpMetrics {
+  uint8_t metric;
+  uint16_t line;
+};
+
+void httpd_metricsHead(HttpRequest &httpd_request, const char* name, const char* type, const char* help) {
+  httpd_printf(httpd_request, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Writes a metric that has a single value.
+void httpd_metricsValue(HttpRequest &httpd_request, const char* name, const char* type, const char* help, uint32_t value) {
+  httpd_metricsHead(httpd_request, name, type, help);
+  httpd_printf(httpd_request, "%s %lu\n", name, (unsigned long) value);
+}
+
+// Writes the given line of the request latency histogram: the header, then for each route its
+// buckets, total and count. Returns false once they have all been written.
+bool httpd_metricsLatency(HttpRequest &httpd_request, uint16_t line) {
+  const char* name = "httpd_request_duration_seconds";
+  if(line == 0) {
+    httpd_metricsHead(httpd_request, name, "histogram", "Time from the first byte of a request to the last of its response, by route.");
+    return true;
+  }
+  line--;
+  uint16_t route = line / (HTTPD_LATENCY_BUCKETS + 2);
+  uint8_t b = line % (HTTPD_LATENCY_BUCKETS + 2);
+  if(route > httpd_routeCount) return false;
+  const HttpRouteStats &stats = httpd_routeStats[route];
+  const char* method = route < httpd_routeCount ? httpd_methodToString(httpd_routes[route].method) : "";
+  const char* uri = route < httpd_routeCount ? httpd_routes[route].uri : "";
+  uint32_t count = 0;
+  for(uint8_t i = 0; i < HTTPD_LATENCY_BUCKETS && i <= b; i++) count += stats.buckets[i];
+  if(b < HTTPD_LATENCY_BUCKETS - 1) {
+    uint bound = httpd_latencyBounds[b];
+    httpd_printf(httpd_request, "%s_bucket{method=\"%s\",route=\"%.*s\",le=\"%u.%03u\"} %lu\n",
+      name, method, HTTPD_METRICS_URI, uri, bound / 1000, bound % 1000, (unsigned long) count);
+  } else if(b == HTTPD_LATENCY_BUCKETS - 1) {
+    httpd_printf(httpd_request, "%s_bucket{method=\"%s\",route=\"%.*s\",le=\"+Inf\"} %lu\n",
+      name, method, HTTPD_METRICS_URI, uri, (unsigned long) count);
+  } else if(b == HTTPD_LATENCY_BUCKETS) {
+    httpd_printf(httpd_request, "%s_sum{method=\"%s\",route=\"%.*s\"} %lu.%03u\n",
+      name, method, HTTPD_METRICS_URI, uri, (unsigned long) (stats.msTotal / 1000), (uint) (stats.msTotal % 1000));
   } else {
-    if(strlen(httpd_request.data) == 0) return;
-    ptrStart = httpd_request.data;
+    httpd_printf(httpd_request, "%s_count{method=\"%s\",route=\"%.*s\"} %lu\n",
+      name, method, HTTPD_METRICS_URI, uri, (unsigned long) count);
+  }
+  return true;
+}
+
+// Writes the given line of the count of responses by status code. Returns false once they have
+// all been written.
+bool httpd_metricsStatus(HttpRequest &httpd_request, uint16_t line) {
+  const char* name = "httpd_responses_total";
+  if(line == 0) {
+    httpd_metricsHead(httpd_request, name, "counter", "Responses sent, by status code.");
+    return true;
+  }
+  line--;
+  if(line < HTTPD_STATUS_CODES && httpd_statusCounts[line].code) {
+    httpd_printf(httpd_request, "%s{code=\"%u\"} %lu\n", name, httpd_statusCounts[line].code, (unsigned long) httpd_statusCounts[line].count);
+    return true;
   }
+  // Codes are only counted together once every entry is taken.
+  if(line == HTTPD_STATUS_CODES && httpd_statusOther) {
+    httpd_printf(httpd_request, "%s{code=\"other\"} %lu\n", name, (unsigned long) httpd_statusOther);
+  }
+  return false;
+}
 
-  // Check for an empty query string.
-  if(*ptrStart == '\0') {
-    httpd_request.args = 0;
-    httpd_dumpHttpReq(httpd_request);
-    return;
+// Writes the given metric, or the given line of it. Returns false once it has all been written.
+bool httpd_metricsWrite(HttpRequest &httpd_request, uint8_t metric, uint16_t line) {
+  if(metric == HTTPD_METRICS_STATUS) return httpd_metricsStatus(httpd_request, line);
+  if(metric == HTTPD_METRICS_LATENCY) return httpd_routeStats && httpd_metricsLatency(httpd_request, line);
+  if(line) return false;
+  const HttpCacheStats &cache = httpd_cacheCounters;
+  uint8_t inUse = 0;
+  switch(metric) {
+  case 0:
+    httpd_metricsValue(httpd_request, "httpd_connections_total", "counter", "Connections accepted.", httpd_counters.connections);
+    break;
+  case 1:
+    httpd_metricsValue(httpd_request, "httpd_connections_rejected_total", "counter", "Connections turned away for want of a slot.", httpd_counters.rejected);
+    break;
+  case 2:
+    httpd_metricsValue(httpd_request, "httpd_slots", "gauge", "Connection slots.", httpd_slotCount);
+    break;
+  case 3:
+    for(uint8_t r = 0; r < httpd_slotCount; r++) {
+      if(httpd_requests[r].method != HTTP_NONE) inUse++;
+    }
+    httpd_metricsValue(httpd_request, "httpd_slots_in_use", "gauge", "Connection slots in use.", inUse);
+    break;
+  case 4:
+    httpd_metricsValue(httpd_request, "httpd_slots_in_use_peak", "gauge", "Most connection slots in use at once.", httpd_counters.slotsPeak);
+    break;
+  case 5:
+    httpd_metricsValue(httpd_request, "httpd_received_bytes_total", "counter", "Bytes received.", httpd_counters.bytesIn);
+    break;
+  case 6:
+    httpd_metricsValue(httpd_request, "httpd_sent_bytes_total", "counter", "Bytes sent.", httpd_counters.bytesOut);
+    break;
+  case 7:
+    httpd_metricsValue(httpd_request, "httpd_send_busy_total", "counter", "Sends retried because the SDK had no room.", httpd_counters.sendBusy);
+    break;
+  case 8:
+    httpd_metricsValue(httpd_request, "httpd_send_failures_total", "counter", "Sends that failed.", httpd_counters.sendFailures);
+    break;
+  case 9:
+    httpd_metricsValue(httpd_request, "httpd_heap_free_bytes", "gauge", "Free heap.", ESP.getFreeHeap());
+    break;
+  case 10:
+    httpd_metricsValue(httpd_request, "httpd_heap_free_low_bytes", "gauge", "Least free heap seen.", httpd_counters.heapLow);
+    break;
+  case 11:
+    httpd_metricsValue(httpd_request, "httpd_cache_hits_total", "counter", "File cache hits.", cache.hits);
+    break;
+  case 12:
+    httpd_metricsValue(httpd_request, "httpd_cache_misses_total", "counter", "File cache misses.", cache.misses);
+    break;
+  case 13:
+    httpd_metricsValue(httpd_request, "httpd_cache_evictions_total", "counter", "Files evicted from the file cache.", cache.evictions);
+    break;
+  case 14:
+    httpd_metricsValue(httpd_request, "httpd_cache_bytes", "gauge", "Bytes held by the file cache.", cache.bytes);
+    break;
+  case 15:
+    for(uint8_t r = 0; r < httpd_slotCount; r++) {
+      if(httpd_requests[r].method == HTTP_WEBSOCKET) inUse++;
+    }
+    httpd_metricsValue(httpd_request, "httpd_websockets", "gauge", "Open WebSocket connections.", inUse);
+    break;
+  case 16:
+    httpd_metricsValue(httpd_request, "httpd_websocket_messages_total", "counter", "WebSocket messages received.", httpd_counters.wsMessages);
+    break;
+  case 17:
+    httpd_metricsValue(httpd_request, "httpd_websocket_dropped_total", "counter", "WebSocket frames dropped for want of room to queue them.", httpd_counters.wsDropped);
+    break;
+  case 18:
+    for(uint8_t r = 0; r < httpd_slotCount; r++) {
+      if(httpd_requests[r].method == HTTP_EVENTS) inUse++;
+    }
+    httpd_metricsValue(httpd_request, "httpd_event_streams", "gauge", "Open event streams.", inUse);
+    break;
+  case 19:
+    httpd_metricsValue(httpd_request, "httpd_events_dropped_total", "counter", "Events dropped from a subscriber's backlog for newer ones.", httpd_counters.sseDropped);
+    break;
+  case 20:
+    httpd_metricsValue(httpd_request, "httpd_connections_client_limited_total", "counter", "Connections turned away because their client had its share of the slots.", httpd_counters.clientLimited);
+    break;
+  case 21:
+    httpd_metricsValue(httpd_request, "httpd_connections_evicted_total", "counter", "Idle keep-alive connections closed to make room for new ones.", httpd_counters.evicted);
+    break;
+  }
+  return true;
+}
+
+// Writes the metrics a piece at a time as they are sent.
+bool httpd_metricsGenerate(HttpRequest &httpd_request, void* generatorArg) {
+  HttpMetrics* m = (HttpMetrics*) generatorArg;
+  while(httpd_writeRoom(httpd_request) >= HTTPD_METRICS_PIECE) {
+    if(httpd_metricsWrite(httpd_request, m->metric, m->line)) {
+      m->line++;
+    } else if(m->metric < HTTPD_METRICS_LATENCY) {
+      m->metric++;
+      m->line = 0;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Serves the server's metrics in the Prometheus text format.
+bool httpd_metricsHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg) {
+  LOGD("Metrics Handler");
+  HttpMetrics* m = (HttpMetrics*) httpd_arenaAlloc(httpd_request, sizeof(HttpMetrics));
+  if(!m) return false;
+  m->metric = 0;
+  m->line = 0;
+  httpd_beginStream(pEspconn, 200, "text/plain; version=0.0.4", httpd_metricsGenerate, m);
+  return true;
+}
+
+/********************************************************
+   Utility Functions
+ ********************************************************/
+
+// Returns the value of the named request header, or NULL if the request doesn't have it. Names are
+// matched case-insensitively. The headers are indexed on the first call for the request.
+const char* httpd_getHeader(HttpRequest &httpd_request, const char* name) {
+  if(httpd_request.parseState < PARSE_BODY) return NULL;
+  const char* head = httpd_request.head;
+  // Each header is stored as name '\0' value '\0'.
+  uint16_t pos = httpd_request.headersAt;
+  if(!(httpd_request.parseFlags & PARSE_INDEXED)) {
+    while(pos < httpd_request.lenHead && httpd_request.headerCount < HTTPD_MAX_HEADERS) {
+      httpd_request.headers[httpd_request.headerCount++] = pos;
+      pos += strlen(head + pos) + 1;
+      pos += strlen(head + pos) + 1;
+    }
+    httpd_request.parseFlags |= PARSE_INDEXED;
+  }
+  for(uint8_t h = 0; h < httpd_request.headerCount; h++) {
+    const char* ptrName = head + httpd_request.headers[h];
+    if(strcasecmp(ptrName, name) == 0) return ptrName + strlen(ptrName) + 1;
+  }
+  // Any headers beyond the index are searched in place.
+  if(httpd_request.headerCount == HTTPD_MAX_HEADERS) {
+    pos = httpd_request.headers[HTTPD_MAX_HEADERS - 1];
+    pos += strlen(head + pos) + 1;
+    pos += strlen(head + pos) + 1;
+    while(pos < httpd_request.lenHead) {
+      const char* ptrValue = head + pos + strlen(head + pos) + 1;
+      if(strcasecmp(head + pos, name) == 0) return ptrValue;
+      pos = ptrValue + strlen(ptrValue) + 1 - head;
+    }
+  }
+  return NULL;
+}
+
+// Returns true if token appears, case-insensitively, in a comma separated header value such as
+// that of Connection.
+bool httpd_hasToken(const char* list, const char* token) {
+  uint lenToken = strlen(token);
+  const char* p = list;
+  while(*p) {
+    while(*p == ' ' || *p == '\t' || *p == ',') p++;
+    const char* start = p;
+    while(*p && *p != ',') p++;
+    const char* end = p;
+    while(end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    if((uint) (end - start) == lenToken && strncasecmp(start, token, lenToken) == 0) return true;
+  }
+  return false;
+}
+
+// Allocates memory that lasts until the response to the request has been sent, from the slot's
+// arena. Returns NULL if the arena doesn't have size bytes left. There's no need to free it.
+void* httpd_arenaAlloc(HttpRequest &httpd_request, uint size) {
+  // Keep every allocation aligned for a pointer, a word on the ESP8266 and more on a PC.
+  size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  if(size > (uint) (HTTPD_ARENA_SIZE - httpd_request.arenaUsed)) {
+    LOGW("Arena full, %d bytes wanted", size);
+    return NULL;
+  }
+  void* p = httpd_request.arena + httpd_request.arenaUsed;
+  httpd_request.arenaUsed += size;
+  return p;
+}
+
+// Returns the :param of the route being tried with the given name, or NULL if it has none.
+const PathParam* httpd_getPathParam(HttpRequest &httpd_request, const char* name) {
+  uint8_t lenName = strlen(name);
+  for(uint8_t p = 0; p < httpd_request.paramCount; p++) {
+    if(httpd_request.params[p].lenName == lenName && memcmp(httpd_request.params[p].name, name, lenName) == 0) return &httpd_request.params[p];
   }
+  return NULL;
+}
+
+// Along with the query string, a body is only taken for arguments if it's a form, or doesn't say.
+bool httpd_isFormBody(HttpRequest &httpd_request) {
+  const char* type = httpd_getHeader(httpd_request, "Content-Type");
+  return !type || strncasecmp(type, "application/x-www-form-urlencoded", 33) == 0;
+}
 
-  // Count the number of parameters
-  uint8_t c = 1;
-  uint i=0;
-  while(ptrStart[i]) {
-    if(ptrStart[i] == '&') c++;
-    i++;
-  }
-  httpd_request.args = (RequestArgument*) calloc(c, sizeof(RequestArgument));
-  char* ptrEquals;
-  char* ptrAmp;
-  for(i = 0; i < c; i++) {
-    httpd_request.args[i].key = ptrStart;
-    ptrEquals = strstr(ptrStart, "=");
-    ptrAmp = strstr(ptrStart, "&");
-    if(ptrAmp) *ptrAmp = '\0';
-    else ptrAmp = ptrStart + strlen(ptrStart);
-    if(ptrEquals && ptrEquals < ptrAmp) {
-      *ptrEquals = '\0';
-      httpd_request.args[i].value = ptrEquals + 1;
+// Adds the arguments in s to args, up to room of them, splitting it on & and = and decoding the
+// %xx escapes and +'s of each key and value as it goes. What's decoded is never longer than what
+// it was decoded from, so it's written over s. A % that isn't followed by two hex digits is kept
+// as it is, and empty arguments, as in "a=1&&b=2", are skipped.
+void httpd_splitParams(HttpRequest &httpd_request, char* s, uint room) {
+  char* out = s;
+  char* key = s;
+  char* value = NULL;
+  for(const char* p = s; ; p++) {
+    char c = *p;
+    if(c == '&' || c == '\0') {
+      *out++ = '\0';
+      if(value || out - 1 > key) {
+        if(httpd_request.argCount == room) {
+          LOGW("No room for args from %s", key);
+          return;
+        }
+        RequestArgument &arg = httpd_request.args[httpd_request.argCount++];
+        arg.key = key;
+        arg.value = value ? value : out - 1;
+      }
+      if(c == '\0') return;
+      key = out;
+      value = NULL;
+    } else if(c == '=' && !value) {
+      *out++ = '\0';
+      value = out;
+    } else if(c == '+') {
+      *out++ = ' ';
+    } else if(c == '%' && isxdigit((uint8_t) p[1]) && isxdigit((uint8_t) p[2])) {
+      *out++ = httpd_hexDigit(p[1]) << 4 | httpd_hexDigit(p[2]);
+      p += 2;
     } else {
-      httpd_request.args[i].value = ptrAmp;
+      *out++ = c;
     }
-    ptrStart = ptrAmp + 1;
   }
-  httpd_request.argCount = c;
+}
+
+// An empty entry in argIndex. No index can be this, so it's also the most args a request has.
+#define HTTPD_ARG_EMPTY 0xFF
+
+uint8_t httpd_argHash(const char* key) {
+  return httpd_hashBytes(HTTPD_FNV_BASIS, (const uint8_t*) key, strlen(key));
+}
+
+// Builds the table httpd_getArg() finds keys in: at least twice as many entries as args, up to
+// 256, each the index of an arg or HTTPD_ARG_EMPTY, probed linearly. Where a key is repeated the
+// first arg with it is found. Without room for the table, httpd_getArg() searches args instead,
+// and the table isn't tried for again until more args have been parsed.
+void httpd_indexParams(HttpRequest &httpd_request) {
+  httpd_request.argIndex = NULL;
+  if(!httpd_request.argCount) return;
+  uint size = 4;
+  while(size < 2u * httpd_request.argCount && size < 256) size <<= 1;
+  uint8_t* index = (uint8_t*) httpd_arenaAlloc(httpd_request, size);
+  if(!index) {
+    httpd_request.argUnindexed = true;
+    return;
+  }
+  memset(index, HTTPD_ARG_EMPTY, size);
+  uint8_t mask = size - 1;
+  for(uint8_t i = 0; i < httpd_request.argCount; i++) {
+    const char* key = httpd_request.args[i].key;
+    uint8_t h = httpd_argHash(key) & mask;
+    while(index[h] != HTTPD_ARG_EMPTY && strcmp(httpd_request.args[index[h]].key, key) != 0) h = (h + 1) & mask;
+    if(index[h] == HTTPD_ARG_EMPTY) index[h] = i;
+  }
+  httpd_request.argIndex = index;
+  httpd_request.argMask = mask;
+}
+
+// Parses the arguments in the query string, the body or both into args in a single pass over
+// each, decoding them where they lie. httpd_getArg() indexes them by key when it's first called,
+// so a handler that only goes through args doesn't pay for the index. Where arguments have
+// already been parsed from is skipped, so it may be called again, by a later handler say, and
+// what a second call finds is added to the args already there.
+void httpd_parseParams(HttpRequest &httpd_request, ParamLocation where) {
+  LOGD("*** httpd_parseParams");
+  if(httpd_request.method == HTTP_ANY) return;
+  uint8_t todo = where & ~httpd_request.argsParsed;
+  if(where == HTTP_QUERY_AND_DATA && !httpd_isFormBody(httpd_request)) todo &= ~HTTP_DATA;
+  httpd_request.argsParsed |= todo;
+  char* query = (todo & HTTP_QUERY) ? strchr(httpd_request.uri, '?') : NULL;
+  if(query) {
+    *query++ = '\0';
+    LOGD("uri: %s query: %s", httpd_request.uri, query);
+  }
+  char* body = (todo & HTTP_DATA) ? httpd_request.data : NULL;
+  if(!(query && *query) && !(body && *body)) return;
+
+  // Take the rest of the arena for args, keeping those already parsed, and give back what isn't
+  // used once they're known.
+  uint16_t arenaUsed = httpd_request.arenaUsed;
+  uint room = (HTTPD_ARENA_SIZE - arenaUsed) / sizeof(RequestArgument);
+  if(room > HTTPD_ARG_EMPTY) room = HTTPD_ARG_EMPTY;
+  RequestArgument* args = room > httpd_request.argCount ? (RequestArgument*) httpd_arenaAlloc(httpd_request, room * sizeof(RequestArgument)) : NULL;
+  if(!args) {
+    LOGW("No room for args");
+    return;
+  }
+  if(httpd_request.argCount) memcpy(args, httpd_request.args, httpd_request.argCount * sizeof(RequestArgument));
+  httpd_request.args = args;
+  if(query) httpd_splitParams(httpd_request, query, room);
+  if(body) httpd_splitParams(httpd_request, body, room);
+  httpd_request.arenaUsed = arenaUsed;
+  httpd_arenaAlloc(httpd_request, httpd_request.argCount * sizeof(RequestArgument));
+  if(!httpd_request.argCount) httpd_request.args = NULL;
+  httpd_request.argIndex = NULL;
+  httpd_request.argUnindexed = false;
   httpd_dumpHttpReq(httpd_request);
 }
 
+// Returns the decoded value of the argument key, or NULL if the request hasn't one. The arguments
+// in the query string and a form body are parsed the first time one is asked for.
+char* httpd_getArg(HttpRequest &httpd_request, const char* key) {
+  if(!httpd_request.argsParsed) httpd_parseParams(httpd_request);
+  if(!httpd_request.argIndex && !httpd_request.argUnindexed) httpd_indexParams(httpd_request);
+  RequestArgument* args = httpd_request.args;
+  if(!httpd_request.argIndex) {
+    for(uint8_t i = 0; i < httpd_request.argCount; i++) {
+      if(strcmp(args[i].key, key) == 0) return args[i].value;
+    }
+    return NULL;
+  }
+  uint8_t mask = httpd_request.argMask;
+  for(uint8_t h = httpd_argHash(key) & mask; httpd_request.argIndex[h] != HTTPD_ARG_EMPTY; h = (h + 1) & mask) {
+    if(strcmp(args[httpd_request.argIndex[h]].key, key) == 0) return args[httpd_request.argIndex[h]].value;
+  }
+  return NULL;
+}
+
+// Returns the argument key as a number, or dflt if it's absent or isn't one.
+long httpd_getArgInt(HttpRequest &httpd_request, const char* key, long dflt) {
+  const char* p = httpd_getArg(httpd_request, key);
+  if(!p || !*p) return dflt;
+  char* end;
+  long n = strtol(p, &end, 10);
+  return *end ? dflt : n;
+}
+
+float httpd_getArgFloat(HttpRequest &httpd_request, const char* key, float dflt) {
+  const char* p = httpd_getArg(httpd_request, key);
+  if(!p || !*p) return dflt;
+  char* end;
+  float n = strtod(p, &end);
+  return *end ? dflt : n;
+}
+
 const char* httpd_responseCodeToString(uint responseCode) {
   switch(responseCode) {
+  case 100:
+    return "Continue";
+  case 101:
+    return "Switching Protocols";
   case 200:
     return "OK";
+  case 201:
+    return "Created";
+  case 204:
+    return "No Content";
+  case 206:
+    return "Partial Content";
+  case 301:
+    return "Moved Permanently";
+  case 302:
+    return "Found";
+  case 304:
+    return "Not Modified";
+  case 400:
+    return "Bad Request";
+  case 401:
+    return "Unauthorized";
+  case 403:
+    return "Forbidden";
   case 404:
     return "Not Found";
+  case 405:
+    return "Method Not Allowed";
+  case 408:
+    return "Request Timeout";
+  case 411:
+    return "Length Required";
+  case 412:
+    return "Precondition Failed";
+  case 413:
+    return "Payload Too Large";
+  case 414:
+    return "URI Too Long";
+  case 415:
+    return "Unsupported Media Type";
+  case 416:
+    return "Range Not Satisfiable";
+  case 426:
+    return "Upgrade Required";
   case 500:
     return "Internal Server Error";
+  case 501:
+    return "Not Implemented";
+  case 503:
+    return "Service Unavailable";
+  case 507:
+    return "Insufficient Storage";
   }
   return "Unknown Error";
 }
 
 const char* httpd_mimetype(const char* filename) {
-  char* ext = strrchr(filename, '.');
-  SPF("ext: %s\n", ext);
+  const char* ext = strrchr(filename, '.');
+  LOGD("ext: %s", ext);
   if(!ext) {
     return "text/plain";
   }
@@ -531,6 +3916,7 @@ const char* httpd_mimetype(const char* filename) {
   else if(strcmp(ext, "png") == 0) return "image/png";
   else if(strcmp(ext, "gif") == 0) return "image/gif";
   else if(strcmp(ext, "js") == 0) return "application/javascript";
+  else if(strcmp(ext, "json") == 0) return "application/json";
 
   return "text/plain";
 }
@@ -553,48 +3939,47 @@ const char* httpd_methodToString(HTTPMethod method) {
     return "PATCH";
   case HTTP_DELETE:
     return "DELETE";
+  case HTTP_WEBSOCKET:
+    return "<websocket>";
+  case HTTP_EVENTS:
+    return "<events>";
+  default:
+    break;
   }
   return "Unknown";
 }
 
 void httpd_dumpHttpReq(HttpRequest &httpd_request) {
 #ifdef ESP_HTTPD_VERBOSE
-  SPN("\n>>> HttpRequest <<<");
-  SPF("httpd_request at %p\n", httpd_request);
-  SPF("->remote: %d.%d.%d.%d:%d\n",
+  LOGD(">>> HttpRequest at %p from %d.%d.%d.%d:%d",
+    &httpd_request,
     httpd_request.remote_ip[0],
     httpd_request.remote_ip[1],
     httpd_request.remote_ip[2],
     httpd_request.remote_ip[3],
     httpd_request.remote_port
   );
-  SPF("->method: %s\n", httpd_methodToString(httpd_request.method));
-  SPF("->uri: %s\n", httpd_request.uri);
-  SPF("->lenData: %d\n", httpd_request.lenData);
-  SPF("->lenSoFar: %d\n", httpd_request.lenSoFar);
-  SPF("->data: %s\n", httpd_request.data);
-  SPF("->argCount: %d\n", httpd_request.argCount);
+  LOGD("->method: %s uri: %s", httpd_methodToString(httpd_request.method), httpd_request.uri);
+  LOGD("->lenData: %d lenSoFar: %d", httpd_request.lenData, httpd_request.lenSoFar);
+  LOGD("->data: %s", httpd_request.data);
+  LOGD("->argCount: %d", httpd_request.argCount);
   RequestArgument* args = httpd_request.args;
   for(uint8_t i = 0; i < httpd_request.argCount; i++) {
-    SPF("->%s: %s\n", args[i].key, args[i].value);
+    LOGD("->%s: %s", args[i].key, args[i].value);
   }
 #endif
-  SPF("\nHeap: %d\n", ESP.getFreeHeap());
+  LOGD("Heap: %d", ESP.getFreeHeap());
 }
 
 void httpd_dumpEspconn(espconn* pEspconn) {
 #ifdef ESP_HTTPD_VERBOSE
-  SPN("\n### espconn ###");
-  SPF("espconn at %p\n", pEspconn);
-  SPF("->type: %d\n", pEspconn->type);
-  SPF("->state: %d\n", pEspconn->state);
-  SPF("->remote: %d.%d.%d.%d:%d\n",
+  LOGD("### espconn at %p type: %d state: %d link_cnt: %d", pEspconn, pEspconn->type, pEspconn->state, pEspconn->link_cnt);
+  LOGD("->remote: %d.%d.%d.%d:%d",
     pEspconn->proto.tcp->remote_ip[0],
     pEspconn->proto.tcp->remote_ip[1],
     pEspconn->proto.tcp->remote_ip[2],
     pEspconn->proto.tcp->remote_ip[3],
     pEspconn->proto.tcp->remote_port
   );
-  SPF("->link_cnt: %d\n", pEspconn->link_cnt);
 #endif
 }
@@ -1,16 +1,91 @@
 #ifndef ESP_HTTPD_H
 #define ESP_HTTPD_H
 
-#define MAX_HTTP_CONNECTIONS 4
+// The connection slot pool is sized by httpd_init() from a memory budget.
+// DEFAULT_HTTP_CONNECTIONS is used when no budget is given and MAX_HTTP_CONNECTIONS caps it.
+#define DEFAULT_HTTP_CONNECTIONS 4
+#define MAX_HTTP_CONNECTIONS 32
 #define CONNECTION_EXPIRE_MS 30000
+// Connections are kept open for further requests (HTTP keep-alive) until they have been idle for
+// HTTPD_IDLE_TIMEOUT_S seconds or have made HTTPD_KEEPALIVE_MAX_REQUESTS requests. A maximum of 1
+// closes every connection after its first response.
+#define HTTPD_IDLE_TIMEOUT_S 5
+#define HTTPD_KEEPALIVE_MAX_REQUESTS 16
+// Most connections one client address may hold at once, and never all the slots, so one browser
+// opening several connections at once can't keep every other client out. A connection beyond that,
+// or one arriving when every slot is busy, takes the slot of the least recently active idle
+// keep-alive connection, of that client or of any client respectively. Failing that it's answered
+// with a 503 that asks the client to retry after HTTPD_RETRY_AFTER_S seconds, and closed.
+#define HTTPD_MAX_CONNS_PER_CLIENT 4
+#define HTTPD_RETRY_AFTER_S 2
+// Connections the SDK may accept beyond the slots: those being turned away or evicted, which are
+// closed without a slot.
+#define HTTPD_SPARE_CONNS 2
+// Largest segment handed to espconn_send.
 #define FILE_BUFFER_SIZE 1400
+// Each slot queues outbound data in a buffer of this size. The response header is queued ahead of
+// the body so they go out together, and files are read from flash into it a buffer at a time.
+#define HTTPD_TX_BUFFER_SIZE (2 * FILE_BUFFER_SIZE)
+// Number of segments a connection may have sent but not yet acknowledged.
+#define HTTPD_TX_WINDOW 2
+// How long to wait before retrying a send the SDK had no room for.
+#define HTTPD_TX_RETRY_MS 10
+// Each slot collects the request line and headers in a buffer of this size. Header lines that
+// don't fit (huge cookies, for example) are dropped; a request line that doesn't fit gets a 414.
+#define HTTPD_HEAD_BUFFER_SIZE 1024
+// Each slot has an arena of this size for the memory a request needs: its body, its args, a copy
+// of a large response body, and whatever the handler takes with httpd_arenaAlloc(). The arena is
+// emptied in one step once the response has gone, so a busy server doesn't fragment the heap. A
+// request body must fit in it along with the rest, unless the route takes the body as it arrives
+// with a BodyFunc; a larger one gets a 413. To take larger bodies, such as a JSON configuration of
+// a few KB along with its tokens, build with a larger arena: -DHTTPD_ARENA_SIZE=8192, say.
+#ifndef HTTPD_ARENA_SIZE
+#define HTTPD_ARENA_SIZE 2048
+#endif
+// Number of headers indexed for httpd_getHeader(); later ones are still found, just more slowly.
+#define HTTPD_MAX_HEADERS 24
+// Most :param captures a route can have, and most routes tried for one request.
+#define HTTPD_MAX_PATH_PARAMS 4
+#define HTTPD_MAX_ROUTE_MATCHES 8
+// Files up to this size are kept in RAM by the file cache, once httpd_cacheInit() has enabled it.
+#define HTTPD_CACHE_MAX_FILE 8192
+// Longest file name listed by httpd_dirHandler(), including the terminator. SPIFFS allows 32.
+// An entry in a listing, the name escaped twice over, is at most HTTPD_DIR_ENTRY_MAX characters.
+#define HTTPD_DIR_NAME 32
+#define HTTPD_DIR_ENTRY_MAX (12 * HTTPD_DIR_NAME + 32)
+// httpd_uploadBody() collects file data in a buffer of this size and writes it to flash a buffer
+// at a time. It comes from the connection's arena, along with about 250 bytes of parser state.
+#define HTTPD_UPLOAD_BUFFER_SIZE 512
+// Number of files whose ETag (a hash of the contents) is remembered, so each is only hashed once.
+#define HTTPD_ETAG_ENTRIES 32
+// Files up to this size are hashed for their ETag before they are first served. A larger one would
+// hold up the callback too long, so it goes out without an ETag and is hashed as it is sent. Files
+// are only cached once hashed, so it should be at least HTTPD_CACHE_MAX_FILE.
+#define HTTPD_ETAG_HASH_MAX HTTPD_CACHE_MAX_FILE
+// Number of different response codes the metrics count separately. Any more are counted together.
+#define HTTPD_STATUS_CODES 12
+// Longest message a WebSocket connection takes, once its fragments are put together; a longer one
+// closes the connection. It's collected in the connection's arena, along with about 170 bytes of
+// parser state.
+#define HTTPD_WS_MAX_MESSAGE 1024
+// An idle WebSocket connection is closed after this many seconds rather than HTTPD_IDLE_TIMEOUT_S.
+#define HTTPD_WS_IDLE_TIMEOUT_S 600
+// Each event stream subscriber keeps a backlog of this many bytes of events waiting to be sent, in
+// its arena. When an event doesn't fit, the oldest are dropped to make room. It can't be larger
+// than HTTPD_TX_BUFFER_SIZE, as the backlog is moved into the outbound queue in one go.
+#define HTTPD_SSE_BACKLOG 1024
+// An idle event stream is closed after this many seconds, and a client that loses one waits
+// HTTPD_SSE_RETRY_MS before connecting again.
+#define HTTPD_SSE_IDLE_TIMEOUT_S 600
+#define HTTPD_SSE_RETRY_MS 3000
 
 #define NOT_FOUND -1
 
 #define HTTPD_SERVER "ESP_httpd"
 
 // #define NO_PRINT
-#define ESP_HTTPD_VERBOSE
+// Logs every request and connection in full. Needs LOG_LEVEL LOG_DEBUG as well.
+// #define ESP_HTTPD_VERBOSE
 
 #include <Arduino.h>
 #include <serial.print.h>
@@ -20,7 +95,7 @@
 extern "C" {
   // #include "ets_sys.h"
   // #include "os_type.h"
-  // #include "osapi.h"
+  #include "osapi.h"
   // #include "mem_manager.h"
   // #include "mem.h"
   #include "user_interface.h"
@@ -33,8 +108,21 @@ extern "C" {
 #define zalloc(n) calloc(n, 1)
 
 // HTTPMethod is also used to indicate the state of the HTTP request.
-enum HTTPMethod { HTTP_NONE, HTTP_ANY, HTTP_GET, HTTP_POST, HTTP_PUT, HTTP_PATCH, HTTP_DELETE, HTTP_SENDING };
-enum ParamLocation { HTTP_QUERY, HTTP_DATA };
+// HTTP_WEBSOCKET marks a connection upgraded to a WebSocket and HTTP_EVENTS one carrying an event
+// stream, neither of which carries any more requests.
+enum HTTPMethod { HTTP_NONE, HTTP_ANY, HTTP_GET, HTTP_POST, HTTP_PUT, HTTP_PATCH, HTTP_DELETE, HTTP_SENDING, HTTP_WEBSOCKET, HTTP_EVENTS };
+// Where httpd_parseParams() takes arguments from.
+enum ParamLocation { HTTP_QUERY = 1, HTTP_DATA = 2, HTTP_QUERY_AND_DATA = 3 };
+// WebSocket frame opcodes (RFC 6455).
+enum WsOpcode { WS_CONTINUATION = 0x0, WS_TEXT = 0x1, WS_BINARY = 0x2, WS_CLOSE = 0x8, WS_PING = 0x9, WS_PONG = 0xA };
+// The kinds of JSON value. JSON_PRIMITIVE is a number, true, false or null.
+enum JsonType { JSON_UNDEFINED, JSON_OBJECT, JSON_ARRAY, JSON_STRING, JSON_PRIMITIVE };
+// Returned by httpd_parseJson() for a body it can't tokenize.
+#define JSON_ERROR_NOMEM -1    // There's no room left in the arena for the tokens.
+#define JSON_ERROR_INVALID -2  // The body isn't JSON.
+#define JSON_ERROR_PARTIAL -3  // The body ends part way through.
+// Where the request parser is within the request. Everything before PARSE_BODY is the header.
+enum HttpParseState { PARSE_METHOD, PARSE_URI, PARSE_VERSION, PARSE_NAME, PARSE_VALUE, PARSE_BODY, PARSE_DONE, PARSE_ERROR };
 
 // Parsed arguments will be returned as an array of RequestArgument's.
 struct RequestArgument {
@@ -42,37 +130,209 @@ struct RequestArgument {
   char* value;
 };
 
+// A :param captured from the URI by the route being tried. name and value point into the
+// route's uri and the request's uri respectively and are not NUL-terminated.
+struct PathParam {
+  const char* name;
+  uint8_t lenName;
+  const char* value;
+  uint16_t lenValue;
+};
+
+// A value in a JSON body, as found by httpd_parseJson(): len bytes of data from start, without a
+// string's quotes. Tokens are in the order their values start in the body, so the keys and values
+// of an object, or the elements of an array, follow it up to next.
+struct JsonToken {
+  uint16_t start;
+  uint16_t len;
+  uint16_t next;   // The first token after this value and everything in it.
+  uint8_t type;    // A JsonType.
+  uint8_t flags;
+};
+
+// A file held in RAM by the file cache.
+struct HttpCacheEntry;
+
+// The state of a WebSocket connection, kept in its arena.
+struct HttpWsConn;
+// The state of an event stream subscriber, kept in its arena.
+struct HttpSseConn;
+
+struct HttpRequest;
+// Prototype for the functions that produce a streamed response a piece at a time. Each call
+// writes some more with httpd_write() and friends and returns true, or returns false once the
+// response is complete.
+typedef bool (*GeneratorFunc)(HttpRequest &httpd_request, void* generatorArg);
+// Prototype for the functions that take a request body a segment at a time, as it arrives, rather
+// than have it collected in data. lenSoFar is the number of bytes of the lenData byte body that came
+// before pData. Return false to refuse the rest; the server then answers with parseError, 500
+// unless the function sets another, and closes the connection. data isn't used for a body taken
+// this way, so the function may keep its state there.
+typedef bool (*BodyFunc)(HttpRequest &httpd_request, const char* pData, uint len, void* handlerArg);
+// Prototypes for the functions called on a WebSocket's connections. A message is NUL-terminated
+// after its len bytes, and only stays put until the function returns; opcode is WS_TEXT or WS_BINARY.
+typedef void (*WsEventFunc)(HttpRequest &httpd_request, void* arg);
+typedef void (*WsMessageFunc)(HttpRequest &httpd_request, uint8_t opcode, char* pData, uint len, void* arg);
+
+// A WebSocket endpoint, given as the handlerArg of a route to httpd_wsHandler():
+//   {HTTP_GET, "/ws", httpd_wsHandler, &dashboard}
+// The connections it has upgraded are its subscribers, which httpd_wsBroadcast() sends to. Each
+// function is optional.
+struct HttpWebSocket {
+  WsEventFunc onOpen;
+  WsMessageFunc onMessage;
+  WsEventFunc onClose;
+  void* arg;
+};
+
+// Prototype for the functions called on an event stream's connections.
+typedef void (*SseEventFunc)(HttpRequest &httpd_request, void* arg);
+
+// A stream of Server-Sent Events, given as the handlerArg of a route to httpd_sseHandler():
+//   {HTTP_GET, "/events", httpd_sseHandler, &telemetry}
+// The connections it has taken are its subscribers, which httpd_ssePublish() sends to. Each
+// function is optional.
+struct HttpEventStream {
+  SseEventFunc onOpen;
+  SseEventFunc onClose;
+  void* arg;
+  uint32_t lastId;  // Kept by the server; each event published has the next id.
+};
+
 // An array of HttpRequest's is used to track HTTP connections between callback function invocations.
+// Each slot is bound to its espconn through the espconn's reverse pointer, which holds the slot
+// index and the slot's generation. The generation changes every time the slot is reused, so
+// callbacks for a connection whose slot has been reclaimed are recognized and ignored.
 struct HttpRequest {
+  espconn* pEspconn;
+  uint32_t gen;
+  int8_t peerNext;    // Next slot in the same remote ip:port hash bucket.
   uint8_t remote_ip[4];
-  uint remote_port;
+  int remote_port;
   uint msLast;
+  // For the metrics: when the request began to arrive, the route whose handler took it and the
+  // response's status code.
+  uint msStart;
+  int16_t route;
+  uint16_t status;
   HTTPMethod method;
+  // The request line and headers are parsed a byte at a time as they arrive, so a header can be
+  // split across any number of segments. They are stored in head and split in place: uri, auth
+  // and the values returned by httpd_getHeader() are C-strings inside head.
+  HttpParseState parseState;
+  uint8_t parseFlags;
+  uint16_t parseError;  // Response code to send when parseState is PARSE_ERROR.
+  uint16_t parsePos;    // Position within the version token, or where the current header value starts.
+  char* head;
+  uint16_t lenHead;
+  uint16_t lineStart;
+  uint16_t headersAt;   // Offset of the first header in head.
+  uint8_t headerId;     // Which header the parser is in, if it is one the server uses itself.
+  uint8_t headerCount;  // Number of headers indexed so far by httpd_getHeader().
+  uint16_t headers[HTTPD_MAX_HEADERS];
+  uint8_t httpVersion;  // 10 for HTTP/1.0, 11 for HTTP/1.1.
+  bool keepAlive;       // The connection stays open after the response. A handler may clear it.
+  uint8_t requestCount; // Requests made on the connection so far.
+  // Data that arrived while the previous response was being sent, typically pipelined requests.
+  // Receiving is held until the response has gone and this has been processed.
+  char* rxPending;
+  uint16_t lenRxPending;
   char* uri;
   char* auth;
   uint lenData;
   uint lenSoFar;
   char* data;
   uint8_t argCount;
+  uint8_t argsParsed;   // The ParamLocation's args have been parsed from.
+  uint8_t argMask;      // argIndex has argMask + 1 entries.
   RequestArgument* args;
+  uint8_t* argIndex;    // args by the hash of their keys, for httpd_getArg().
+  bool argUnindexed;    // There was no room for argIndex, so httpd_getArg() searches args.
+  uint8_t paramCount;
+  PathParam params[HTTPD_MAX_PATH_PARAMS];
+  // The tokens of a JSON body, from httpd_parseJson(), in the arena.
+  JsonToken* json;
+  uint16_t jsonCount;
+  // The route taking the body as it arrives, if any.
+  BodyFunc rxBody;
+  void* rxBodyArg;
+  // data and args are allocated from the arena, so they must not be freed.
+  char* arena;
+  uint16_t arenaUsed;
+  // Outbound queue. Bytes waiting to be sent are txBuf[txPos..txLen). As it drains it is refilled
+  // from the response body: the open file, or txBody for data held in memory. While a response is
+  // being sent lenData is the size of its body and lenSoFar the number of bytes queued so far.
+  uint8_t* txBuf;
+  uint16_t txPos;
+  uint16_t txLen;
+  uint8_t txInFlight;
+  uint8_t txFlags;
+  const char* txBody;
+  HttpCacheEntry* txCache;  // Cache entry txBody points into, held until the response is sent.
+  // A file sent whole without an ETag is hashed as it goes; the hash so far and the file's path hash.
+  uint32_t txHash;
+  uint32_t txHashPath;
+  // A streamed response is written into the queue after txLen, txChunk bytes so far, and queued
+  // a chunk at a time. txGenerator is called for more as the queue drains.
+  uint16_t txChunk;
+  GeneratorFunc txGenerator;
+  void* txGeneratorArg;
+  File file;
+  // Once the connection has been upgraded to a WebSocket, the frame parser's state.
+  HttpWsConn* ws;
+  // Once the connection carries an event stream, its backlog.
+  HttpSseConn* sse;
+};
+
+// Counters kept by the file cache.
+struct HttpCacheStats {
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t evictions;
+  uint32_t bytes;  // Bytes held, including each entry's path and response header.
+  uint16_t entries;
+};
+
+// Counters kept by the server, also served by httpd_metricsHandler() along with the number of
+// requests and their latency for each route, and the number of responses with each status code.
+struct HttpStats {
+  uint32_t connections;   // Connections accepted.
+  uint32_t rejected;      // Connections turned away for want of a slot.
+  uint32_t clientLimited; // Connections turned away because their client had HTTPD_MAX_CONNS_PER_CLIENT.
+  uint32_t evicted;       // Idle keep-alive connections closed to make room for new ones.
+  uint32_t bytesIn;
+  uint32_t bytesOut;
+  uint32_t sendBusy;      // Sends the SDK had no room for, which are retried.
+  uint32_t sendFailures;  // Sends that failed, cutting the response short.
+  uint32_t heapLow;       // Least free heap seen.
+  uint8_t slotsPeak;      // Most slots in use at once.
+  uint32_t wsMessages;    // WebSocket messages received.
+  uint32_t wsDropped;     // WebSocket frames not sent because the connection's queue was full.
+  uint32_t sseDropped;    // Events dropped from a subscriber's backlog to make room for newer ones.
 };
 
 // Prototype for the request handler functions.
 typedef bool (*HandlerFunc)(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg);
 
 // Each HTTP is checked against an array of HttpRoute's to determine if there is one or more suitable handlers.
+// httpd_init() compiles the array into a radix trie, so the cost of routing a request depends on the
+// length of its URI rather than the number of routes. A uri may end in a * wildcard and may contain
+// :name segments, which match up to the next / or ? and are available to the handler as PathParam's.
 struct HttpRoute {
   HTTPMethod method;
     const char* uri;
     HandlerFunc handlerFunc;
     void* handlerArg;
+    // Optional. If the first route matching a request has one, it is given the body as it arrives,
+    // and the handler is called after the last of it.
+    BodyFunc bodyFunc;
 };
 
 /********************************************************
   Function Prototypes
  ********************************************************/
 
-void httpd_init(HttpRoute* pHttpRoutes, int port);
+void httpd_init(HttpRoute* pHttpRoutes, int port, uint memBudget = 0);
 // Callbacks called by ESP
 void httpd_connect(void* arg);
 void httpd_discon(void* arg);
@@ -85,11 +345,54 @@ void httpd_router(espconn* pEspconn, HttpRequest &httpd_request);
 void httpd_send(espconn* pEspconn, uint responseCode);
 void httpd_send(espconn* pEspconn, uint responseCode, const char *pMime, const char *pData);
 void httpd_send(espconn* pEspconn, uint responseCode, const char *pMime, const char *pData, uint lData);
+void httpd_sendStatic(espconn* pEspconn, uint responseCode, const char *pMime, const char *pData);
+void httpd_sendStatic(espconn* pEspconn, uint responseCode, const char *pMime, const char *pData, uint lData);
+void httpd_beginStream(espconn* pEspconn, uint responseCode, const char* pMime, GeneratorFunc generator = NULL, void* generatorArg = NULL);
+uint httpd_write(HttpRequest &httpd_request, const void* pData, uint lData);
+uint httpd_print(HttpRequest &httpd_request, const char* pStr);
+uint httpd_printf(HttpRequest &httpd_request, const char* format, ...);
+uint httpd_writeRoom(HttpRequest &httpd_request);
+void httpd_endStream(HttpRequest &httpd_request);
 // File Handling Functions
 bool httpd_fileHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg);
 bool httpd_dirHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg);
+bool httpd_dirJsonHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg);
+bool httpd_uploadHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg);
+bool httpd_uploadBody(HttpRequest &httpd_request, const char* pData, uint len, void* handlerArg);
+// JSON functions
+int16_t httpd_parseJson(HttpRequest &httpd_request);
+int16_t httpd_jsonFind(HttpRequest &httpd_request, int16_t parent, const char* path);
+char* httpd_jsonValue(HttpRequest &httpd_request, int16_t token);
+char* httpd_jsonGet(HttpRequest &httpd_request, const char* path);
+long httpd_jsonInt(HttpRequest &httpd_request, const char* path, long dflt = 0);
+bool httpd_jsonBool(HttpRequest &httpd_request, const char* path, bool dflt = false);
+// WebSocket functions
+bool httpd_wsHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg);
+bool httpd_wsSend(HttpRequest &httpd_request, uint8_t opcode, const void* pData, uint len);
+bool httpd_wsSendText(HttpRequest &httpd_request, const char* pStr);
+uint8_t httpd_wsBroadcast(HttpWebSocket* ws, uint8_t opcode, const void* pData, uint len);
+uint8_t httpd_wsBroadcastText(HttpWebSocket* ws, const char* pStr);
+void httpd_wsClose(HttpRequest &httpd_request, uint16_t code = 1000);
+// Event stream functions
+bool httpd_sseHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg);
+bool httpd_sseSend(HttpRequest &httpd_request, const char* event, const char* data);
+uint8_t httpd_ssePublish(HttpEventStream* stream, const char* event, const char* data);
+// Metrics functions
+bool httpd_metricsHandler(espconn* pEspconn, HttpRequest &httpd_request, void* handlerArg);
+const HttpStats& httpd_stats();
+// File cache functions
+void httpd_cacheInit(uint budget);
+void httpd_cacheInvalidate(const char* path);
+const HttpCacheStats& httpd_cacheStats();
 // Utility functions
-void httpd_parseParams(HttpRequest &httpd_request, ParamLocation where);
+void* httpd_arenaAlloc(HttpRequest &httpd_request, uint size);
+const char* httpd_getHeader(HttpRequest &httpd_request, const char* name);
+bool httpd_hasToken(const char* list, const char* token);
+const PathParam* httpd_getPathParam(HttpRequest &httpd_request, const char* name);
+void httpd_parseParams(HttpRequest &httpd_request, ParamLocation where = HTTP_QUERY_AND_DATA);
+char* httpd_getArg(HttpRequest &httpd_request, const char* key);
+long httpd_getArgInt(HttpRequest &httpd_request, const char* key, long dflt = 0);
+float httpd_getArgFloat(HttpRequest &httpd_request, const char* key, float dflt = 0);
 const char* httpd_responseCodeToString(uint responseCode);
 const char* httpd_mimetype(const char* filename);
 // Debug functions
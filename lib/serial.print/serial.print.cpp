@@ -0,0 +1,303 @@
+#include "serial.print.h"
+
+/********************************************************
+   Global Variables
+ ********************************************************/
+
+// The kinds of argument a printf conversion takes.
+enum LogArgType { ARG_NONE, ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_PTR, ARG_DOUBLE, ARG_STR };
+
+// Each message is recorded as a LogHead followed by its arguments, in the order and at the size
+// of their types. A %s argument is recorded as a length byte and that many characters, or
+// LOG_NULL_STRING for a NULL pointer.
+struct LogHead {
+  uint16_t len;  // Of the whole record.
+  uint8_t level;
+  uint8_t dropped;  // Messages dropped just before this one, up to 255.
+  uint32_t ms;
+  const char* format;
+};
+#define LOG_NULL_STRING 0xFF
+
+// Messages are added by the SDK's callbacks and by loop(), which never interrupt each other, and
+// printed from loop(). With one writer and one reader the ring needs no lock: log_head only moves
+// once a record is complete, and log_tail once it has been formatted. Both run freely and are
+// reduced to an offset when the ring is indexed.
+uint8_t log_ring[LOG_RING_SIZE];
+volatile uint32_t log_head;
+volatile uint32_t log_tail;
+uint32_t log_droppedCount;
+uint32_t log_gap;  // Messages dropped since the last one recorded.
+// The line being printed by log_drain().
+char log_line[LOG_LINE_SIZE];
+uint16_t log_lineLen;
+uint16_t log_linePos;
+
+/********************************************************
+   Recording Functions
+ ********************************************************/
+
+// Reads the conversion specification that follows a %, noting the types of the arguments it
+// takes: one for each * and one for the value. Returns the end of the specification.
+const char* log_spec(const char* p, uint8_t* types, uint8_t &count) {
+  count = 0;
+  while(*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0') p++;
+  if(*p == '*') {
+    types[count++] = ARG_INT;
+    p++;
+  }
+  while(*p >= '0' && *p <= '9') p++;
+  if(*p == '.') {
+    p++;
+    if(*p == '*') {
+      types[count++] = ARG_INT;
+      p++;
+    }
+    while(*p >= '0' && *p <= '9') p++;
+  }
+  uint8_t type = ARG_INT;
+  if(*p == 'h') {
+    p++;
+    if(*p == 'h') p++;
+  } else if(*p == 'l') {
+    p++;
+    type = ARG_LONG;
+    if(*p == 'l') {
+      p++;
+      type = ARG_LLONG;
+    }
+  } else if(*p == 'z' || *p == 't' || *p == 'j') {
+    type = *p == 'j' ? ARG_LLONG : ARG_SIZE;
+    p++;
+  } else if(*p == 'L') {
+    p++;
+  }
+  switch(*p) {
+  case '%':
+    type = ARG_NONE;
+    break;
+  case 's':
+    type = ARG_STR;
+    break;
+  case 'p':
+  case 'n':
+    type = ARG_PTR;
+    break;
+  case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+    type = ARG_DOUBLE;
+    break;
+  case '\0':
+    return p;
+  }
+  if(type != ARG_NONE) types[count++] = type;
+  return p + 1;
+}
+
+void log_putAt(uint32_t pos, const void* data, uint len) {
+  const uint8_t* p = (const uint8_t*) data;
+  while(len--) log_ring[pos++ & (LOG_RING_SIZE - 1)] = *p++;
+}
+
+void log_getAt(uint32_t pos, void* data, uint len) {
+  uint8_t* p = (uint8_t*) data;
+  while(len--) *p++ = log_ring[pos++ & (LOG_RING_SIZE - 1)];
+}
+
+// Records the arguments of a message at pos, or with store false just works out how much room they
+// take. Returns the number of bytes.
+uint log_args(const char* format, va_list args, bool store, uint32_t pos) {
+  uint len = 0;
+  uint8_t types[3];
+  uint8_t count;
+  for(const char* p = format; *p; ) {
+    if(*p++ != '%') continue;
+    p = log_spec(p, types, count);
+    for(uint8_t i = 0; i < count; i++) {
+      switch(types[i]) {
+      case ARG_INT: {
+        int v = va_arg(args, int);
+        if(store) log_putAt(pos + len, &v, sizeof(v));
+        len += sizeof(v);
+        break;
+      }
+      case ARG_LONG: {
+        long v = va_arg(args, long);
+        if(store) log_putAt(pos + len, &v, sizeof(v));
+        len += sizeof(v);
+        break;
+      }
+      case ARG_LLONG: {
+        long long v = va_arg(args, long long);
+        if(store) log_putAt(pos + len, &v, sizeof(v));
+        len += sizeof(v);
+        break;
+      }
+      case ARG_SIZE: {
+        size_t v = va_arg(args, size_t);
+        if(store) log_putAt(pos + len, &v, sizeof(v));
+        len += sizeof(v);
+        break;
+      }
+      case ARG_PTR: {
+        void* v = va_arg(args, void*);
+        if(store) log_putAt(pos + len, &v, sizeof(v));
+        len += sizeof(v);
+        break;
+      }
+      case ARG_DOUBLE: {
+        double v = va_arg(args, double);
+        if(store) log_putAt(pos + len, &v, sizeof(v));
+        len += sizeof(v);
+        break;
+      }
+      case ARG_STR: {
+        const char* s = va_arg(args, const char*);
+        uint8_t lenS = s ? strnlen(s, LOG_MAX_STRING) : LOG_NULL_STRING;
+        if(store) log_putAt(pos + len, &lenS, 1);
+        len++;
+        if(!s) break;
+        if(store) log_putAt(pos + len, s, lenS);
+        len += lenS;
+        break;
+      }
+      }
+    }
+  }
+  return len;
+}
+
+// Records a message to be printed by log_drain(). Nothing is formatted here, so it takes about as
+// long as copying the arguments.
+void log_push(uint8_t level, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  uint len = sizeof(LogHead) + log_args(format, args, false, 0);
+  va_end(args);
+  uint32_t head = log_head;
+  if(len > LOG_RING_SIZE - (head - log_tail)) {
+    log_droppedCount++;
+    log_gap++;
+    return;
+  }
+  LogHead h = {(uint16_t) len, level, (uint8_t) (log_gap < 255 ? log_gap : 255), (uint32_t) millis(), format};
+  log_gap = 0;
+  log_putAt(head, &h, sizeof(h));
+  va_start(args, format);
+  log_args(format, args, true, head + sizeof(LogHead));
+  va_end(args);
+  // Only now can the reader see it.
+  log_head = head + len;
+}
+
+uint32_t log_dropped() {
+  return log_droppedCount;
+}
+
+/********************************************************
+   Printing Functions
+ ********************************************************/
+
+#ifndef NO_PRINT
+
+// Formats one conversion with the arguments read back from the ring. spec is the conversion,
+// % and all, as a C-string.
+int log_convert(char* out, uint room, const char* spec, uint8_t* types, uint8_t count, uint32_t &pos) {
+  int stars[2];
+  uint8_t starCount = 0;
+  for(uint8_t i = 0; i + 1 < count; i++) {
+    log_getAt(pos, &stars[starCount++], sizeof(int));
+    pos += sizeof(int);
+  }
+  uint8_t type = count ? types[count - 1] : (uint8_t) ARG_NONE;
+#define LOG_SNPRINTF(v) (starCount == 0 ? snprintf(out, room, spec, v) : \
+  starCount == 1 ? snprintf(out, room, spec, stars[0], v) : snprintf(out, room, spec, stars[0], stars[1], v))
+#define LOG_CONVERT(T) { T v; log_getAt(pos, &v, sizeof(v)); pos += sizeof(v); return LOG_SNPRINTF(v); }
+  switch(type) {
+  case ARG_INT: LOG_CONVERT(int)
+  case ARG_LONG: LOG_CONVERT(long)
+  case ARG_LLONG: LOG_CONVERT(long long)
+  case ARG_SIZE: LOG_CONVERT(size_t)
+  case ARG_PTR: LOG_CONVERT(void*)
+  case ARG_DOUBLE: LOG_CONVERT(double)
+  case ARG_STR: {
+    char s[LOG_MAX_STRING + 1];
+    uint8_t lenS;
+    log_getAt(pos++, &lenS, 1);
+    if(lenS == LOG_NULL_STRING) return LOG_SNPRINTF("(null)");
+    log_getAt(pos, s, lenS);
+    pos += lenS;
+    s[lenS] = '\0';
+    return LOG_SNPRINTF(s);
+  }
+  }
+#undef LOG_CONVERT
+#undef LOG_SNPRINTF
+  return snprintf(out, room, "%%");
+}
+
+// Notes in log_line that messages were dropped, at least that many if atLeast. Returns the length.
+int log_formatDropped(uint32_t dropped, bool atLeast) {
+  return snprintf(log_line, LOG_LINE_SIZE, "%lu - %lu%s log messages dropped\n",
+    (unsigned long) millis(), (unsigned long) dropped, atLeast ? "+" : "");
+}
+
+// Formats the oldest message into log_line and removes it from the ring. If messages were dropped
+// before it, that's noted on a line of its own first.
+void log_format() {
+  LogHead h;
+  uint32_t tail = log_tail;
+  log_getAt(tail, &h, sizeof(h));
+  uint32_t pos = tail + sizeof(LogHead);
+  // Leave room for the newline.
+  uint room = LOG_LINE_SIZE - 1;
+  int len = h.dropped ? log_formatDropped(h.dropped, h.dropped == 255) : 0;
+  len += snprintf(log_line + len, room - len, "%lu %c ", (unsigned long) h.ms, "-EWID"[h.level]);
+  char spec[16];
+  uint8_t types[3];
+  uint8_t count;
+  for(const char* p = h.format; *p; ) {
+    if(*p != '%') {
+      if((uint) len < room - 1) log_line[len++] = *p;
+      p++;
+      continue;
+    }
+    const char* end = log_spec(p + 1, types, count);
+    uint lenSpec = end - p < (int) sizeof(spec) ? end - p : sizeof(spec) - 1;
+    memcpy(spec, p, lenSpec);
+    spec[lenSpec] = '\0';
+    p = end;
+    int n = log_convert(log_line + len, room - len, spec, types, count, pos);
+    if(n > 0) len += n;
+    if((uint) len > room - 1) len = room - 1;
+  }
+  log_line[len++] = '\n';
+  log_lineLen = len;
+  log_linePos = 0;
+  log_tail = tail + h.len;
+}
+
+void log_drain() {
+  while(true) {
+    if(log_linePos < log_lineLen) {
+      int room = Serial.availableForWrite();
+      if(room <= 0) return;
+      uint n = log_lineLen - log_linePos;
+      if(n > (uint) room) n = room;
+      Serial.write((const uint8_t*) log_line + log_linePos, n);
+      log_linePos += n;
+      if(log_linePos < log_lineLen) return;
+    }
+    if(log_tail != log_head) {
+      log_format();
+    } else if(log_gap) {
+      // Nothing has been recorded since the last messages were dropped.
+      log_lineLen = log_formatDropped(log_gap, false);
+      log_linePos = 0;
+      log_gap = 0;
+    } else {
+      return;
+    }
+  }
+}
+
+#endif
@@ -9,6 +9,44 @@
 
 // #define _NL_        \r\n
 
+#include <Arduino.h>
+
+// The SP macros print straight away and wait for the serial port, which is fine in setup(). Code
+// that runs while serving, in network callbacks especially, logs with the LOG macros instead. They
+// only record the format and its arguments in a ring buffer; log_drain(), called from loop(),
+// formats and prints them as the serial port has room.
+
+// Log levels. Messages above LOG_LEVEL are compiled out.
+#define LOG_NONE  0
+#define LOG_ERROR 1
+#define LOG_WARN  2
+#define LOG_INFO  3
+#define LOG_DEBUG 4
+#ifndef LOG_LEVEL
+  #define LOG_LEVEL LOG_INFO
+#endif
+
+// Modules. Each source file logs as the module in LOG_MODULE, defined before this is included;
+// messages from modules not in LOG_MODULES are compiled out.
+#define LOG_APP   0x01
+#define LOG_HTTPD 0x02
+#ifndef LOG_MODULES
+  #define LOG_MODULES 0xFF
+#endif
+#ifndef LOG_MODULE
+  #define LOG_MODULE LOG_APP
+#endif
+
+// Size of the ring buffer, a power of two. Messages that don't fit are dropped and counted.
+#ifndef LOG_RING_SIZE
+  #define LOG_RING_SIZE 2048
+#endif
+// A %s argument is copied into the ring, up to this many characters, since the string it points
+// to may be gone by the time it's printed.
+#define LOG_MAX_STRING 48
+// Longest line log_drain() prints; longer ones are cut short.
+#define LOG_LINE_SIZE 160
+
 #ifdef NO_PRINT
   #define SB(arg)
   #define SA() true
@@ -16,6 +54,8 @@
   #define SPN(args...)
   #define SPF(args...)
   #define SPFN(args...)
+  #define LOG_ON(level) false
+  #define log_drain()
 #else
   #define SB(arg) Serial.begin(arg)
   #define SA() Serial.available()
@@ -23,6 +63,23 @@
   #define SPN(args...) Serial.println(args)
   #define SPF(args...) Serial.printf(args)
   #define SPFN(args...) Serial.printf(args);Serial.println("")
+  #define LOG_ON(level) ((level) <= LOG_LEVEL && (LOG_MODULE & LOG_MODULES))
+#endif
+
+// Each message is a line; there's no need to end the format with a newline.
+#define LOGF(level, format, args...) do { if(LOG_ON(level)) log_push(level, format, ##args); } while(0)
+#define LOGE(format, args...) LOGF(LOG_ERROR, format, ##args)
+#define LOGW(format, args...) LOGF(LOG_WARN, format, ##args)
+#define LOGI(format, args...) LOGF(LOG_INFO, format, ##args)
+#define LOGD(format, args...) LOGF(LOG_DEBUG, format, ##args)
+
+// Records a message. format must be a string constant; it's kept by reference.
+void log_push(uint8_t level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+#ifndef NO_PRINT
+// Prints as many of the recorded messages as the serial port will take without waiting.
+void log_drain();
 #endif
+// Number of messages dropped because the ring buffer was full.
+uint32_t log_dropped();
 
 #endif
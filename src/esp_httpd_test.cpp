@@ -9,21 +9,34 @@
  ********************************************************/
 
 uint32_t msBlink;
+uint32_t msPush;
 STATUSES status = STATUS_OK;
 
+// Dashboards connect to /ws, or /events where a WebSocket can't get through, for a reading every
+// PUSH_MS.
+HttpWebSocket dashboard = {wsOpen, wsMessage, NULL, NULL};
+HttpEventStream telemetry = {NULL, NULL, NULL, 0};
+
 /********************************************************
    Routes
  ********************************************************/
 
 HttpRoute httpRoutes[] = {
-  {HTTP_GET, "/favicon.ico", cgiFavicon, NULL},
-  {HTTP_ANY, "/static", cgiStatic, NULL},
-  {HTTP_GET, "/test?*", cgiGet, NULL},
-  {HTTP_POST, "/test", cgiPost, NULL},
-  {HTTP_GET, "/", httpd_dirHandler, NULL},
-  // {HTTP_GET, "/", httpd_fileHandler, (void*) "/dirlist.htm"},
-  {HTTP_GET, "*", httpd_fileHandler, NULL},
-  {HTTP_NONE, NULL, NULL, NULL}
+  {HTTP_GET, "/favicon.ico", cgiFavicon, NULL, NULL},
+  {HTTP_ANY, "/static", cgiStatic, NULL, NULL},
+  {HTTP_GET, "/test?*", cgiGet, NULL, NULL},
+  {HTTP_POST, "/test", cgiPost, NULL, NULL},
+  {HTTP_GET, "/readings", cgiReadings, NULL, NULL},
+  {HTTP_POST, "/count", cgiCount, NULL, bodyCount},
+  {HTTP_POST, "/config", cgiConfig, NULL, NULL},
+  {HTTP_POST, "/upload", httpd_uploadHandler, (void*) "/", httpd_uploadBody},
+  {HTTP_GET, "/", httpd_dirHandler, NULL, NULL},
+  {HTTP_GET, "/dir.json", httpd_dirJsonHandler, NULL, NULL},
+  {HTTP_GET, "/metrics", httpd_metricsHandler, NULL, NULL},
+  {HTTP_GET, "/ws", httpd_wsHandler, &dashboard, NULL},
+  {HTTP_GET, "/events", httpd_sseHandler, &telemetry, NULL},
+  {HTTP_GET, "*", httpd_fileHandler, NULL, NULL},
+  {HTTP_NONE, NULL, NULL, NULL, NULL}
 };
 
 /********************************************************
@@ -52,6 +65,8 @@ void setup() {
 
   // Start the web server.
   httpd_init(httpRoutes, SVRPORT);
+  // Keep the small page and image files in RAM.
+  httpd_cacheInit(16 * 1024);
 
   digitalWrite(PIN_HB_LED, LED_OFF);     // Turn LED off
 }
@@ -66,9 +81,20 @@ void loop() {
     digitalWrite(PIN_HB_LED, !digitalRead(PIN_HB_LED));
     msBlink = millis();
   }
+  // Print what the server has logged, as far as the serial port has room.
+  log_drain();
 
   if(status == STATUS_ERR) return;
 
+  // Push a reading to the dashboards.
+  if(msNow - msPush >= PUSH_MS) {
+    msPush = msNow;
+    char reading[48];
+    snprintf(reading, sizeof(reading), "{\"ms\":%lu,\"heap\":%u}", msNow, ESP.getFreeHeap());
+    httpd_wsBroadcastText(&dashboard, reading);
+    httpd_ssePublish(&telemetry, "reading", reading);
+  }
+
   // Do other stuff here.
 }
 
@@ -77,69 +103,121 @@ void loop() {
  ********************************************************/
 
 bool cgiFavicon(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg) {
- SPN("\n*** cgiFavicon");
+  LOGD("*** cgiFavicon");
  httpd_send(pEspconn, 404);
  return true;  // Handler indicates that it has handled the request.
 }
 
 bool cgiStatic(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg) {
- SPN("\n*** cgiStatic");
- httpd_send(pEspconn, 200, "text/html", "<html><body><h3>cgiStatic Worked!</h3></body></html>");
+  LOGD("*** cgiStatic");
+ // A string constant stays put, so it's sent without being copied.
+ httpd_sendStatic(pEspconn, 200, "text/html", "<html><body><h3>cgiStatic Worked!</h3></body></html>");
  return true;  // Handler indicates that it has handled the request.
 }
 
 bool cgiGet(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg) {
-  SPN("\n*** cgiGet");
-  httpd_parseParams(httpReq, HTTP_QUERY);
-  // Tally the size of the buffer needed for the resulting HTML page.
-  unsigned int lData = 70;
-  for(uint8_t i = 0; i < httpReq.argCount; i++) {
-    lData += strlen(httpReq.args[i].key) + strlen(httpReq.args[i].value) + 8;
-  }
-  char* pData = (char*) zalloc(lData);
+  LOGD("*** cgiGet");
+  // Takes the arguments from the query string and, for a form, the body, decoding them.
+  httpd_parseParams(httpReq);
 
-  // Build the response.
-  strcpy(pData, "<html>\n<body>\n<h3>cgiGet Worked!</h3>\n<p>\n");
-  char* ptr = pData + 42;
+  // Stream the response, so there's no need to work out its size first.
+  httpd_beginStream(pEspconn, 200, "text/html");
+  httpd_print(httpReq, "<html>\n<body>\n<h3>cgiGet Worked!</h3>\n<p>\n");
   for(uint8_t i = 0; i < httpReq.argCount; i++) {
-    sprintf(ptr, "%s = %s<br>\n", httpReq.args[i].key, httpReq.args[i].value);
-    ptr += strlen(httpReq.args[i].key) + strlen(httpReq.args[i].value) + 8;
+    httpd_printf(httpReq, "%s = %s<br>\n", httpReq.args[i].key, httpReq.args[i].value);
   }
-  strcpy(ptr, "</p>\n</body>\n</html>\n");
-
-  // Send the response.
-  httpd_send(pEspconn, 200, "text/html", pData);
+  // Or look one up by its key.
+  httpd_printf(httpReq, "a + 1 = %ld<br>\n", httpd_getArgInt(httpReq, "a") + 1);
+  httpd_print(httpReq, "</p>\n</body>\n</html>\n");
+  httpd_endStream(httpReq);
   return true;  // Handler indicates that it has handled the request.
 }
 
 bool cgiPost(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg) {
-  SPN("\n*** cgiPost");
+  LOGD("*** cgiPost");
   httpd_parseParams(httpReq, HTTP_DATA);
-  // Tally the size of the buffer needed for the resulting HTML page.
-  unsigned int lData = 70;
+
+  httpd_beginStream(pEspconn, 200, "text/html");
+  httpd_print(httpReq, "<html>\n<body>\n<h3>cgiPost Worked!</h3>\n<p>\n");
   for(uint8_t i = 0; i < httpReq.argCount; i++) {
-    lData += strlen(httpReq.args[i].key) + strlen(httpReq.args[i].value) + 8;
+    httpd_printf(httpReq, "%s = %s<br>\n", httpReq.args[i].key, httpReq.args[i].value);
   }
-  char* pData = (char*) zalloc(lData);
+  httpd_print(httpReq, "</p>\n</body>\n</html>\n");
+  httpd_endStream(httpReq);
+  return true;  // Handler indicates that it has handled the request.
+}
 
-  // Build the response.
-  strcpy(pData, "<html>\n<body>\n<h3>cgiPost Worked!</h3>\n<p>\n");
-  char* ptr = pData + 43;
-  for(uint8_t i = 0; i < httpReq.argCount; i++) {
-    sprintf(ptr, "%s = %s<br>\n", httpReq.args[i].key, httpReq.args[i].value);
-    ptr += strlen(httpReq.args[i].key) + strlen(httpReq.args[i].value) + 8;
+// Writes the next batch of readings each time the server has room for more.
+bool genReadings(HttpRequest &httpReq, void* generatorArg) {
+  uint* pNext = (uint*) generatorArg;
+  if(*pNext == 0) httpd_print(httpReq, "[");
+  while(*pNext < READINGS && httpd_writeRoom(httpReq) > 40) {
+    httpd_printf(httpReq, "%s{\"n\":%u,\"ms\":%lu}", *pNext ? "," : "", *pNext, millis());
+    (*pNext)++;
+  }
+  if(*pNext < READINGS) return true;  // More to come.
+  httpd_print(httpReq, "]");
+  return false;
+}
+
+bool cgiReadings(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg) {
+  LOGD("*** cgiReadings");
+  // The generator's state must last as long as the response, and each connection needs its own,
+  // so it goes in the request's arena.
+  uint* pNext = (uint*) httpd_arenaAlloc(httpReq, sizeof(uint));
+  if(!pNext) return false;
+  *pNext = 0;
+  httpd_beginStream(pEspconn, 200, "application/json", genReadings, pNext);
+  return true;  // Handler indicates that it has handled the request.
+}
+
+// Counts the lines in a body of any size as it arrives, without keeping it. The count is kept in
+// the request's arena, so it lasts until the response has gone.
+bool bodyCount(HttpRequest &httpReq, const char* pData, uint len, void* handlerArg) {
+  if(httpReq.lenSoFar == 0) {
+    httpReq.data = (char*) httpd_arenaAlloc(httpReq, sizeof(uint));
+    if(!httpReq.data) return false;
+    *(uint*) httpReq.data = 0;
   }
-  strcpy(ptr, "</p>\n</body>\n</html>\n");
+  uint* pLines = (uint*) httpReq.data;
+  for(uint i = 0; i < len; i++) {
+    if(pData[i] == '\n') (*pLines)++;
+  }
+  return true;
+}
 
-  // Send the response.
-  httpd_send(pEspconn, 200, "text/html", pData);
+bool cgiCount(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg) {
+  LOGD("*** cgiCount");
+  // Starting the response reuses lenData, so read it first.
+  uint lenBody = httpReq.lenData;
+  httpd_beginStream(pEspconn, 200, "text/plain");
+  httpd_printf(httpReq, "%u bytes, %u lines\n", lenBody, httpReq.data ? *(uint*) httpReq.data : 0);
+  httpd_endStream(httpReq);
+  return true;  // Handler indicates that it has handled the request.
+}
+
+// Takes a JSON configuration such as {"name":"porch","led":{"pin":2,"on":true}} and reports what
+// it found. The body is tokenized where it lies, so it costs no heap.
+bool cgiConfig(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg) {
+  LOGD("*** cgiConfig");
+  int16_t tokens = httpd_parseJson(httpReq);
+  if(tokens < 0) {
+    httpd_send(pEspconn, 400, "text/plain", tokens == JSON_ERROR_NOMEM ? "Too big\n" : "Not JSON\n");
+    return true;
+  }
+  const char* name = httpd_jsonGet(httpReq, "name");
+  long pin = httpd_jsonInt(httpReq, "led.pin", PIN_HB_LED);
+  bool on = httpd_jsonBool(httpReq, "led.on");
+  httpd_beginStream(pEspconn, 200, "text/plain");
+  httpd_printf(httpReq, "%d tokens, name %s, led pin %ld %s\n", tokens, name ? name : "(none)", pin, on ? "on" : "off");
+  httpd_endStream(httpReq);
   return true;  // Handler indicates that it has handled the request.
 }
 
 bool cgiTest(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg) {
-  SPN("\n*** cgiTest");
+  LOGD("*** cgiTest");
   if(strcmp(httpReq.uri, "/test") == 0) {
-    httpd_send(pEspconn, 200, "text/html", "<html><body><h3>cgiTest Worked! /test</h3></body></html>");
+    httpd_sendStatic(pEspconn, 200, "text/html", "<html><body><h3>cgiTest Worked! /test</h3></body></html>");
     return true;  // Handler indicates that it has handled the request.
   }
   // A simple form of URL rewriting
@@ -150,3 +228,18 @@ bool cgiTest(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg) {
   }
   return false;
 }
+
+/********************************************************
+   WebSocket Handlers
+ ********************************************************/
+
+void wsOpen(HttpRequest &httpReq, void* arg) {
+  LOGD("*** wsOpen");
+  httpd_wsSendText(httpReq, "{\"hello\":\"" HTTPD_SERVER "\"}");
+}
+
+// Echoes whatever a dashboard sends.
+void wsMessage(HttpRequest &httpReq, uint8_t opcode, char* pData, uint len, void* arg) {
+  LOGD("*** wsMessage: %d bytes", len);
+  httpd_wsSend(httpReq, opcode, pData, len);
+}
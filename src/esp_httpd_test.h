@@ -8,6 +8,11 @@
 // #define PIN_HB_LED  LED_BUILTIN
 #define PIN_HB_LED  2
 
+// Number of readings streamed by /readings
+#define READINGS 500
+// Milliseconds between the readings pushed to /ws
+#define PUSH_MS 1000
+
 // #define NO_PRINT
 
 #include <Arduino.h>
@@ -27,5 +32,13 @@ bool cgiStatic(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg);
 bool cgiGet(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg);
 bool cgiPost(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg);
 bool cgiTest(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg);
+bool cgiCount(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg);
+bool cgiConfig(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg);
+bool bodyCount(HttpRequest &httpReq, const char* pData, uint len, void* handlerArg);
+bool cgiReadings(espconn* pEspconn, HttpRequest &httpReq, void* handlerArg);
+bool genReadings(HttpRequest &httpReq, void* generatorArg);
+// WebSocket handlers
+void wsOpen(HttpRequest &httpReq, void* arg);
+void wsMessage(HttpRequest &httpReq, uint8_t opcode, char* pData, uint len, void* arg);
 
 #endif